@@ -16,10 +16,14 @@
 
 #include "conductor.h"
 
+#include <algorithm>
 #include <atomic>
+#include <unordered_map>
+#include <utility>
 
 #include <spdlog/spdlog.h>
 
+#include "sertop/serapi.h"
 #include "utils/config.h"
 
 #include <nlohmann/json.hpp>
@@ -28,60 +32,246 @@ using json = nlohmann::json;
 
 namespace wpwrapper {
 
-conductor::conductor()
-        :next_id_(0), server_failed_(false), signal_received_(false)
+#ifdef WPWRAPPER_POSIX
+conductor::conductor(std::vector<stop_callback> stop_callbacks, settings settings)
+        :conductor(std::move(stop_callbacks), std::move(settings), std::nullopt)
 {
+}
+
+conductor::conductor(std::vector<stop_callback> stop_callbacks, settings settings, std::optional<snapshot> adopted)
+#else
+conductor::conductor(std::vector<stop_callback> stop_callbacks, settings settings)
+#endif
+        :next_id_(0), server_failed_(false), signal_received_(false), stopped_(false),
+         on_stop_(std::move(stop_callbacks)), memory_interval_(settings.memory_interval_),
+         background_priority_(settings.background_priority_), hibernate_after_(settings.hibernate_after_),
+         recover_(settings.recover_), speculate_ahead_(settings.speculate_ahead_)
+{
+#ifdef WPWRAPPER_POSIX
+    cgroup_root_ = std::move(settings.cgroup_root_);
+    next_cgroup_ = 0;
+#endif
+
     logger_ = spdlog::get("main")->clone("conductor");
 
     api_ = std::make_shared<api_wrapper>();
 
-    server::failure_callback on_failure = [&](const api_error& error)
+    // Threads are divided over the cores that they may run on.
+    unsigned int cores = std::thread::hardware_concurrency();
+
+#ifdef WPWRAPPER_POSIX
+    if (settings.reserved_cores_ > 0)
     {
+        // Every thread started from here on inherits the reserved cores, until they are restored at the end.
+        try
+        {
+            placement_ = std::make_unique<placement>(api_, settings.reserved_cores_);
+            placement_->confine();
+            cores = settings.reserved_cores_;
+        }
+        catch (const api_error& e)
         {
-            std::lock_guard<std::mutex> guard(queue_m_);
-            server_failed_ = true;
+            logger_->warn("not pinning sertop instances to cores: {}", e.what());
+            placement_.reset();
         }
-        queue_cv_.notify_one();
+    }
+
+    reactor_ = std::make_shared<reactor>(api_);
+
+    // A worker whose priority cannot be raised again would stay slow for good.
+    if (background_priority_ == worker::priority::idle && !worker::can_leave(api_, worker::priority::idle))
+    {
+        logger_->warn("not allowed to raise workers out of SCHED_IDLE, giving idle workers background priority");
+        background_priority_ = worker::priority::background;
+    }
+    if (background_priority_ && !worker::can_leave(api_, *background_priority_))
+    {
+        logger_->warn("changing the priority of workers is not supported, leaving it alone");
+        background_priority_.reset();
+    }
+#endif
+
+    for (unsigned int i = 0; i < std::max(1u, settings.shard_count_); ++i)
+    {
+        shards_.push_back(std::make_unique<shard>());
+    }
+
+    executor_ = std::make_shared<executor>(cores);
+
+    // Forking and executing sertop happens here, so a burst of create requests is handled in parallel.
+    provisioner_ = std::make_unique<executor>(std::max(2u, cores));
+
+    server::failure_callback on_failure = [&](const api_error& error)
+    {
+        logger_->debug("server failed, stopping");
+        server_failed_ = true;
+        stop();
     };
 
     server::request_callback on_request = [&](const request& request)
     {
-        {
-            std::lock_guard<std::mutex> guard(queue_m_);
-            in_queue_.push(request);
-        }
-        queue_cv_.notify_one();
+        // Stop requests do not belong to an instance, any shard can handle them.
+        shard& s = shard_of(request.verb_ == request::verb::stop ? 0 : request.instance_id_);
+        s.in_queue_.push(request);
+        schedule(s);
     };
 
     server::invalidate_callback on_invalidate = [&](unsigned int id)
     {
+        post(event{event::kind::invalidated, id, nullptr, ""});
+    };
+
+#ifdef WPWRAPPER_POSIX
+    // Adopted workers start reading right away, but their responses can only be handled once the server exists.
+    std::vector<std::unique_lock<std::mutex>> held;
+    std::vector<unsigned int> lost;
+
+    if (adopted)
+    {
+        for (auto& s: shards_)
         {
-            std::lock_guard<std::mutex> guard(queue_m_);
-            workers_.erase(id);
-            logger_->debug("destroyed worker {}", id);
+            held.emplace_back(s->mutex_);
         }
-        queue_cv_.notify_one();
-    };
 
-    server_ = std::make_unique<server>(api_,
-            std::vector<server::failure_callback>{on_failure},
-            std::vector<server::request_callback>{on_request},
-            std::vector<server::invalidate_callback>{on_invalidate});
+        auto on_response = std::bind(&conductor::handle_response, this, std::placeholders::_1, std::placeholders::_2);
+        auto on_worker_failure = std::bind(&conductor::handle_worker_failure, this, std::placeholders::_1,
+                std::placeholders::_2);
+
+        for (auto& w: adopted->workers_)
+        {
+            std::unique_ptr<worker> adopted_worker;
+
+            try
+            {
+                if (w.worker_)
+                {
+                    adopted_worker = std::make_unique<worker>(w.id_, std::move(*w.worker_), api_,
+                            std::vector<worker::failure_callback>{on_worker_failure},
+                            std::vector<worker::response_callback>{on_response}, reactor_);
+                }
+            }
+            catch (const api_error& e)
+            {
+                lost.push_back(w.id_);
+            }
+
+            if (placement_ && adopted_worker && adopted_worker->core())
+            {
+                placement_->adopt(w.id_, *adopted_worker->core());
+            }
+
+            instance adopted_instance{std::move(adopted_worker), std::nullopt};
+            configure(w.id_, adopted_instance, std::move(w.options_));
+            adopted_instance.journal_ = std::move(w.journal_);
+            adopted_instance.hibernating_ = !w.worker_;
+            adopted_instance.last_active_ = std::chrono::steady_clock::now();
+
+            // Forward requests are numbered from the first one that has not completed.
+            adopted_instance.forwarded_ = w.outstanding_.size();
+            adopted_instance.unanswered_ = w.outstanding_;
+
+            // A new sidecar catches up from the journal, so without one it cannot.
+            if (w.worker_ && journaling())
+            {
+                start_sidecar(w.id_, adopted_instance);
+            }
+            shard_of(w.id_).instances_.assign(w.id_, std::move(adopted_instance));
+        }
+    }
+#endif
+
+#ifdef WPWRAPPER_POSIX
+    if (adopted)
+    {
+        server_ = std::make_unique<server>(api_, executor_,
+                std::vector<server::failure_callback>{on_failure},
+                std::vector<server::request_callback>{on_request},
+                std::vector<server::invalidate_callback>{on_invalidate},
+                settings.grace_period_, std::move(adopted->server_));
+    }
+#endif
+
+    if (!server_)
+    {
+        server_ = std::make_unique<server>(api_, executor_,
+                std::vector<server::failure_callback>{on_failure},
+                std::vector<server::request_callback>{on_request},
+                std::vector<server::invalidate_callback>{on_invalidate},
+                settings.grace_period_);
+    }
+
+#ifdef WPWRAPPER_POSIX
+    // Like any failed worker, a worker that could not be taken over is reported to Waterproof.
+    for (unsigned int id: lost)
+    {
+        response response = create_empty_response(id, 1, wpwrapper::response::status::failure);
+        response.verb_ = request::verb::destroy;
+        response.content_ = "unable to take over sertop instance";
+        server_->enqueue(std::move(response));
+    }
+
+    if (adopted)
+    {
+        held.clear();
+        logger_->info("took over {} workers", adopted->workers_.size() - lost.size());
+    }
+#endif
+
+#ifdef WPWRAPPER_POSIX
+    if (adopted)
+    {
+        for (auto& s: shards_)
+        {
+            std::lock_guard<std::mutex> guard(s->mutex_);
+            s->instances_.for_each([&](unsigned int id, instance& i)
+            {
+                watch_memory(id, i);
+                watch_idle(id, i);
+                prioritize(id, i);
+            });
+            arm(*s);
+        }
+    }
+#endif
+
+#ifdef WPWRAPPER_POSIX
+    if (placement_)
+    {
+        // Only the threads of the wrapper stay on the reserved cores. A new wrapper process, started from this thread
+        // on an upgrade, needs to see all cores.
+        placement_->restore();
+    }
+#endif
 
-    run_thread_ = std::thread(&conductor::run, this);
+    logger_->debug("started {} shards", shards_.size());
 }
 
 conductor::~conductor()
 {
-    if (!signal_received_ && !server_failed_)
+    notify();
+
+    // From now on, shards are no longer handled. Wait until the handlers that are still active have finished.
+    for (auto& s: shards_)
+    {
+        std::lock_guard<std::mutex> guard(s->mutex_);
+    }
+
+    // Stop the server first, so that no new requests arrive while the workers are torn down.
+    server_.reset();
+    for (auto& s: shards_)
     {
-        signal_received_ = true;
-        queue_cv_.notify_all();
+        s->instances_.clear();
     }
 
-    if (run_thread_.joinable())
+    // Wait for outstanding provisioning and teardown tasks. Workers that were created after the conductor stopped are
+    // destroyed together with the remaining events.
+    provisioner_.reset();
+    executor_.reset();
+    for (auto& s: shards_)
     {
-        run_thread_.join();
+        while (s->event_queue_.pop())
+        {
+        }
     }
 }
 
@@ -89,7 +279,7 @@ void conductor::notify()
 {
     signal_received_ = true;
 
-    queue_cv_.notify_all();
+    stop();
 }
 
 bool conductor::has_failed() const noexcept
@@ -97,139 +287,1958 @@ bool conductor::has_failed() const noexcept
     return server_failed_ || signal_received_;
 }
 
-void conductor::run()
+conductor::shard& conductor::shard_of(unsigned int instance_id) noexcept
 {
-    logger_->debug("started");
+    return *shards_[slot_map<instance>::index(instance_id) % shards_.size()];
+}
 
-    while (!signal_received_ && !server_failed_)
+void conductor::schedule(shard& s)
+{
+    // Once the conductor stops, remaining items are dropped in the destructor.
+    if (has_failed())
     {
-        std::unique_lock<std::mutex> lock(queue_m_);
+        return;
+    }
 
-        queue_cv_.wait_for(lock, std::chrono::milliseconds(500), [&]
+    // If a handler is active, it will see the new item before it finishes.
+    if (s.scheduled_.fetch_add(1) == 0)
+    {
+        executor_->submit([this, &s]
         {
-            return !in_queue_.empty() || !out_queue_.empty() || server_failed_ || signal_received_;
+            run(s);
         });
+    }
+}
 
-        if (server_failed_)
+void conductor::run(shard& s)
+{
+    std::lock_guard<std::mutex> guard(s.mutex_);
+
+    unsigned int handled = s.scheduled_.load();
+
+    while (true)
+    {
+        // Once the conductor stops, remaining items are dropped in the destructor.
+        if (has_failed())
         {
-            logger_->debug("server failed, stopping");
+            s.scheduled_ = 0;
             break;
         }
 
-        if (signal_received_)
+        expire(s);
+
+        while (auto event = s.event_queue_.pop())
+        {
+            handle_event(s, *event);
+        }
+
+        while (auto request = s.in_queue_.pop())
+        {
+            handle_request(s, std::move(*request));
+        }
+
+        flush(s);
+        arm(s);
+
+        // Everything pushed before we were scheduled for the last time has been handled. Stop if nothing was pushed in
+        // the meantime.
+        unsigned int remaining = s.scheduled_.fetch_sub(handled) - handled;
+        if (remaining == 0)
         {
-            logger_->debug("flag set, stopping");
             break;
         }
+        handled = remaining;
+    }
+
+    caught_up_.unpark();
+}
+
+void conductor::flush(shard& s)
+{
+    while (auto response = s.out_queue_.pop())
+    {
+        if (response->from_sidecar_ ? track_sidecar(s, *response) : track(s, *response))
+        {
+            server_->enqueue(std::move(*response));
+        }
+    }
+}
+
+#ifdef WPWRAPPER_POSIX
+conductor::snapshot conductor::release()
+{
+    // No new requests from now on. The ones that were read already are handed to the shards.
+    server_->pause();
 
-        while (!in_queue_.empty())
+    // A worker that is being provisioned, or that replays its journal, cannot be handed over yet.
+    while (true)
+    {
+        settle();
+
+        bool busy = false;
+        for (auto& s: shards_)
         {
-            // Potentially expensive, so done on this thread instead of the callback thread
-            handle_request(in_queue_.front());
-            in_queue_.pop();
+            std::lock_guard<std::mutex> guard(s->mutex_);
+            s->instances_.for_each([&](unsigned int id, instance& i)
+            {
+                busy = busy || i.pending_.has_value() || i.replaying_ > 0;
+
+                // The other process does not know which commands sertop ran ahead of the user, so they are cancelled.
+                if (i.speculation_ && i.worker_)
+                {
+                    hint(id, i, {});
+                    busy = busy || !i.speculation_->settled();
+                }
+            });
         }
 
-        if (signal_received_)
+        if (!busy)
         {
-            logger_->debug("flag set, stopping");
             break;
         }
 
-        while (!out_queue_.empty())
+        // Whatever keeps an instance busy ends with its shard being handled: the worker is provisioned, or answers.
+        caught_up_.park();
+    }
+
+    snapshot state;
+
+    // Deadlines are not handed over: the forward requests that are still running are no longer timed.
+    std::unordered_map<unsigned int, worker::snapshot> released;
+    for (auto& s: shards_)
+    {
+        std::lock_guard<std::mutex> guard(s->mutex_);
+        s->instances_.for_each([&](unsigned int id, instance& i)
+        {
+            cancel_timers(id, i);
+            if (i.worker_)
+            {
+                released.emplace(id, i.worker_->release());
+            }
+
+            // Sidecars are not handed over. The other process starts new ones from the journal.
+            stop_sidecar(id, i, "the wrapper is handing over to another process");
+        });
+    }
+
+    // Hand the responses that the workers read before they were released to the server, which sends them. They may
+    // complete forward requests, so the instances are only taken afterwards.
+    settle();
+
+    for (auto& s: shards_)
+    {
+        std::lock_guard<std::mutex> guard(s->mutex_);
+        s->instances_.for_each([&](unsigned int id, instance& i)
+        {
+            auto r = released.find(id);
+            if ((r == released.end() || !i.worker_) && !i.hibernating_)
+            {
+                return;
+            }
+
+            journal j = i.journal_;
+            j.renumber(i.completed_);
+
+            state.workers_.push_back(snapshot::instance{id,
+                    i.worker_ ? std::make_optional(std::move(r->second)) : std::nullopt, i.options_, std::move(j),
+                    i.unanswered_});
+        });
+    }
+
+    state.server_ = server_->release();
+
+    logger_->info("released {} workers", state.workers_.size());
+
+    return state;
+}
+
+std::vector<int> conductor::snapshot::files() const
+{
+    std::vector<int> files{server_.listen_socket_};
+    files.insert(files.end(), server_.clients_.begin(), server_.clients_.end());
+
+    for (const auto& w: workers_)
+    {
+        if (w.worker_)
+        {
+            files.push_back(w.worker_->stdin_fd_);
+            files.push_back(w.worker_->stdout_fd_);
+            if (w.worker_->pidfd_ >= 0)
+            {
+                files.push_back(w.worker_->pidfd_);
+            }
+        }
+    }
+
+    return files;
+}
+
+void conductor::snapshot::rebind(const std::vector<int>& copies)
+{
+    std::vector<int> originals = files();
+    if (copies.size() != originals.size())
+    {
+        throw api_error(fmt::format("expected {} file descriptors, got {}", originals.size(), copies.size()), 0);
+    }
+
+    std::unordered_map<int, int> copy_of;
+    for (std::size_t i = 0; i < originals.size(); ++i)
+    {
+        copy_of[originals[i]] = copies[i];
+    }
+
+    auto rebound = [&](int fd)
+    {
+        auto copy = copy_of.find(fd);
+        return copy == copy_of.end() ? server::detached : copy->second;
+    };
+
+    server_.listen_socket_ = rebound(server_.listen_socket_);
+    std::transform(server_.clients_.begin(), server_.clients_.end(), server_.clients_.begin(), rebound);
+
+    for (auto& i: server_.instances_)
+    {
+        i.socket_ = rebound(i.socket_);
+    }
+
+    for (auto& w: workers_)
+    {
+        if (w.worker_)
         {
-            server_->enqueue(out_queue_.front());
-            out_queue_.pop();
+            w.worker_->stdin_fd_ = rebound(w.worker_->stdin_fd_);
+            w.worker_->stdout_fd_ = rebound(w.worker_->stdout_fd_);
+            if (w.worker_->pidfd_ >= 0)
+            {
+                w.worker_->pidfd_ = rebound(w.worker_->pidfd_);
+            }
         }
+    }
+}
+
+// Frames and partial sertop output are arbitrary bytes, which JSON strings cannot hold.
+static std::string to_hex(const std::string& bytes)
+{
+    static constexpr char digits[] = "0123456789abcdef";
 
-        lock.unlock();
+    std::string hex;
+    hex.reserve(2 * bytes.size());
+    for (unsigned char c: bytes)
+    {
+        hex.push_back(digits[c >> 4]);
+        hex.push_back(digits[c & 0xf]);
     }
+    return hex;
+}
 
-    logger_->debug("stopped");
+static std::string from_hex(const std::string& hex)
+{
+    std::string bytes;
+    bytes.reserve(hex.size() / 2);
+    for (std::size_t i = 0; i + 1 < hex.size(); i += 2)
+    {
+        bytes.push_back(static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+    }
+    return bytes;
+}
+
+std::string conductor::snapshot::encode() const
+{
+    json instances = json::array();
+    for (const auto& i: server_.instances_)
+    {
+        json history = json::array();
+        for (const auto& f: i.history_)
+        {
+            history.push_back({{"priority", f.priority_}, {"sequence", f.sequence_}, {"data", to_hex(f.data_)}});
+        }
+
+        json instance = {{"id", i.id_}, {"socket", i.socket_}, {"token", i.token_},
+                {"next_sequence", i.next_sequence_}, {"history", history}};
+        if (i.grace_left_)
+        {
+            instance["grace_left"] = i.grace_left_->count();
+        }
+        instances.push_back(instance);
+    }
+
+    json workers = json::array();
+    for (const auto& w: workers_)
+    {
+        json worker = {{"id", w.id_}, {"options", w.options_}};
+        if (w.worker_)
+        {
+            worker.update({{"pid", w.worker_->sertop_instance_}, {"stdin", w.worker_->stdin_fd_},
+                    {"stdout", w.worker_->stdout_fd_}, {"remainder", to_hex(w.worker_->remainder_)},
+                    {"cgroup", w.worker_->cgroup_}});
+            if (w.worker_->core_)
+            {
+                worker["core"] = *w.worker_->core_;
+            }
+            if (w.worker_->pidfd_ >= 0)
+            {
+                worker["pidfd"] = w.worker_->pidfd_;
+            }
+        }
+        if (!w.journal_.commands().empty() || !w.worker_)
+        {
+            worker["journal"] = {{"commands", w.journal_.commands()}, {"states", w.journal_.states()},
+                    {"running", w.journal_.running()}, {"completed_states", w.journal_.completed_states()}};
+        }
+        if (!w.outstanding_.empty())
+        {
+            // Older wrappers only read the number of forward requests, counting one command for each.
+            worker["outstanding"] = w.outstanding_.size();
+            worker["unanswered"] = w.outstanding_;
+        }
+        workers.push_back(worker);
+    }
+
+    json state = {{"listen_socket", server_.listen_socket_}, {"clients", server_.clients_},
+            {"instances", instances}, {"workers", workers}};
+
+    return state.dump();
+}
+
+conductor::snapshot conductor::snapshot::decode(const std::string& encoded)
+{
+    json state = json::parse(encoded);
+
+    snapshot decoded;
+    decoded.server_.listen_socket_ = state.at("listen_socket").get<int>();
+    decoded.server_.clients_ = state.at("clients").get<std::vector<int>>();
+
+    for (const auto& i: state.at("instances"))
+    {
+        server::snapshot::instance instance{i.at("id").get<unsigned int>(), i.at("socket").get<int>(),
+                i.at("token").get<std::string>(), i.at("next_sequence").get<uint64_t>(), {}, std::nullopt};
+
+        for (const auto& f: i.at("history"))
+        {
+            instance.history_.push_back(frame{instance.id_, f.at("priority").get<int>(),
+                    f.at("sequence").get<uint64_t>(), from_hex(f.at("data").get<std::string>())});
+        }
+
+        if (i.contains("grace_left"))
+        {
+            instance.grace_left_ = std::chrono::milliseconds(i.at("grace_left").get<int64_t>());
+        }
+
+        decoded.server_.instances_.push_back(std::move(instance));
+    }
+
+    for (const auto& w: state.at("workers"))
+    {
+        // Older wrappers do not hand over control groups, create options and journals. Hibernating instances have no
+        // sertop instance.
+        snapshot::instance instance{w.at("id").get<unsigned int>(), std::nullopt,
+                w.contains("options") ? w.at("options").get<std::string>() : "", {}, {}};
+
+        if (w.contains("unanswered"))
+        {
+            instance.outstanding_ = w.at("unanswered").get<std::deque<std::size_t>>();
+        }
+        else if (w.contains("outstanding"))
+        {
+            instance.outstanding_.assign(w.at("outstanding").get<std::size_t>(), 1);
+        }
+
+        if (w.contains("pid"))
+        {
+            instance.worker_ = worker::snapshot{w.at("pid").get<pid_t>(), w.at("stdin").get<int>(),
+                    w.at("stdout").get<int>(), from_hex(w.at("remainder").get<std::string>()),
+                    w.contains("cgroup") ? w.at("cgroup").get<std::string>() : "",
+                    w.contains("core") ? std::make_optional(w.at("core").get<unsigned int>()) : std::nullopt,
+                    w.contains("pidfd") ? w.at("pidfd").get<int>() : -1};
+        }
+
+        if (w.contains("journal"))
+        {
+            const auto& j = w.at("journal");
+            auto commands = j.at("commands").get<std::vector<std::string>>();
+            auto states = j.at("states").get<std::vector<uint64_t>>();
+
+            // Older wrappers only hand over commands that completed.
+            std::deque<uint64_t> running;
+            std::size_t completed_states = states.size();
+            if (j.contains("running"))
+            {
+                running = j.at("running").get<std::deque<uint64_t>>();
+                completed_states = j.at("completed_states").get<std::size_t>();
+            }
+            instance.journal_ = journal(std::move(commands), std::move(states), std::move(running), completed_states);
+        }
+
+        decoded.workers_.push_back(std::move(instance));
+    }
+
+    return decoded;
+}
+#endif
+
+void conductor::settle()
+{
+    // A handler that catches up after the check unparks before we park, which then returns right away.
+    while (std::any_of(shards_.begin(), shards_.end(), [](const auto& s)
+    {
+        return s->scheduled_ != 0;
+    }))
+    {
+        caught_up_.park();
+    }
 }
 
-void conductor::handle_response(unsigned int instance_id, const std::string& response)
+void conductor::stop()
 {
+    if (stopped_.exchange(true))
     {
-        std::lock_guard<std::mutex> guard(queue_m_);
+        return;
+    }
 
-        wpwrapper::response rsp = create_empty_response(instance_id);
-        rsp.content_ = response;
-        rsp.verb_ = request::verb::forward;
+    logger_->debug("stopped");
 
-        out_queue_.push(rsp);
+    // Notify subscribers.
+    for (const auto& callback: on_stop_)
+    {
+        callback();
     }
-    queue_cv_.notify_all();
 }
 
-void conductor::handle_request(const wpwrapper::request& request)
+void conductor::handle_response(unsigned int instance_id, std::string_view response)
+{
+    wpwrapper::response rsp = create_empty_response(instance_id);
+    rsp.content_ = response;
+    rsp.verb_ = request::verb::forward;
+
+    shard& s = shard_of(instance_id);
+    s.out_queue_.push(std::move(rsp));
+    schedule(s);
+}
+
+void conductor::handle_sidecar_response(unsigned int instance_id, std::string_view response)
+{
+    wpwrapper::response rsp = create_empty_response(instance_id);
+    rsp.content_ = response;
+    rsp.verb_ = request::verb::forward;
+    rsp.from_sidecar_ = true;
+
+    shard& s = shard_of(instance_id);
+    s.out_queue_.push(std::move(rsp));
+    schedule(s);
+}
+
+void conductor::handle_request(shard& s, wpwrapper::request request)
 {
     switch (request.verb_)
     {
     case request::verb::create:
     { // Open a new scope here because we declare variables.
-        response response = create_empty_response(request.instance_id_, 1);
-        response.verb_ = request::verb::create;
+        instance created{nullptr, pending_instance{}};
+        configure(request.instance_id_, created, request.content_);
 
-        auto on_response = std::bind(&conductor::handle_response, this, std::placeholders::_1, std::placeholders::_2);
-        auto on_failure = std::bind(&conductor::handle_worker_failure, this, std::placeholders::_1,
-                std::placeholders::_2);
+        // The server only reuses an instance id slot after unmapping it, so anything still stored there is stale.
+        auto displaced = s.instances_.assign(request.instance_id_, std::move(created));
+        if (displaced)
+        {
+            cancel_timers(request.instance_id_, *displaced);
+            stop_sidecar(request.instance_id_, *displaced, "");
+        }
+        if (displaced && displaced->worker_)
+        {
+            retire(std::move(displaced->worker_));
+        }
 
-        try
+        provisioner_->submit([this, instance_id = request.instance_id_, options = request.content_]
         {
-            config conf(request.content_);
-            logger_->info("start sertop at: {}", conf.sertop_path);
-            auto w = std::make_unique<worker>(request.instance_id_,
-                    conf.sertop_path,
-                    conf.sertop_args, api_,
-                    std::vector<worker::failure_callback>{on_failure},
-                    std::vector<worker::response_callback>{on_response});
-            workers_.insert(std::make_pair(request.instance_id_, std::move(w)));
-            response.status_ = response::status::success;
+            provision(instance_id, options);
+        });
+        start_sidecar(request.instance_id_, *s.instances_.find(request.instance_id_));
+
+        logger_->debug("provisioning worker {}", request.instance_id_);
+        break;
+    }
+    case request::verb::clone:
+    { // Open a new scope here because we declare variables.
+        if (!journaling())
+        {
+            response response = create_empty_response(request.instance_id_, 1, response::status::failure);
+            response.verb_ = request::verb::clone;
+            response.content_ = "cloning needs a journal, which is only kept if hibernation or recovery is enabled";
+            server_->enqueue(std::move(response));
+            break;
         }
-        catch (const api_error& e)
+
+        // Provisioned once the instance that is cloned handed over its options and its journal.
+        instance created{nullptr, pending_instance{}};
+        created.pending_->cloning_ = true;
+
+        auto displaced = s.instances_.assign(request.instance_id_, std::move(created));
+        if (displaced)
         {
-            response.status_ = response::status::failure;
-            response.content_ = e.what();
+            cancel_timers(request.instance_id_, *displaced);
+            stop_sidecar(request.instance_id_, *displaced, "");
+        }
+        if (displaced && displaced->worker_)
+        {
+            retire(std::move(displaced->worker_));
         }
 
-        logger_->debug("created worker {}", request.instance_id_);
+        event lend{event::kind::clone, request.source_id_, nullptr, ""};
+        lend.clone_id_ = request.instance_id_;
+        post(std::move(lend));
 
-        out_queue_.push(response);
+        logger_->debug("cloning worker {} into {}", request.source_id_, request.instance_id_);
         break;
     }
     case request::verb::destroy:
     { // Open a new scope here because we declare variables.
-        workers_.erase(request.instance_id_);
+        instance* target = s.instances_.find(request.instance_id_);
+        if (target != nullptr && target->pending_)
+        {
+            // Destroyed once the create response has been sent.
+            target->pending_->destroy_requested_ = true;
+            break;
+        }
+
+        if (target != nullptr)
+        {
+            cancel_timers(request.instance_id_, *target);
+            stop_sidecar(request.instance_id_, *target, "");
+            if (target->worker_)
+            {
+                retire(std::move(target->worker_));
+            }
+            s.instances_.erase(request.instance_id_);
+        }
         logger_->debug("destroyed worker {}", request.instance_id_);
 
         response response = create_empty_response(request.instance_id_, 1);
         response.verb_ = request::verb::destroy;
         response.content_ = "";
-        server_->unmap(request.instance_id_, response);
+        server_->unmap(request.instance_id_, std::move(response));
         break;
     }
     case request::verb::forward:
-        workers_[request.instance_id_]->enqueue(request.content_);
-        break;
+    { // Open a new scope here because we declare variables.
+        instance* target = s.instances_.find(request.instance_id_);
+        if (target == nullptr || (!target->pending_ && !target->worker_ && !target->hibernating_))
+        {
+            logger_->warn("dropped forward request for unknown worker {}", request.instance_id_);
+            break;
+        }
+
+        if (target->hibernating_)
+        {
+            resume(request.instance_id_, *target);
+        }
+
+        // Sertop answers nothing at all if there is no command, so Waterproof would wait for it forever.
+        std::size_t commands = serapi::count_commands(request.content_);
+        if (commands == 0)
+        {
+            response response = create_empty_response(request.instance_id_, 1, response::status::failure);
+            response.verb_ = request::verb::forward;
+            response.content_ = "nothing to forward";
+            server_->enqueue(std::move(response));
+            break;
+        }
+
+        // Queries only read the state, which the sidecar shares once it is ready. They are not numbered like the
+        // requests that sertop completes in order, so they have no deadline.
+        if (request.query_ && target->sidecar_ && target->sidecar_->ready() && !serapi::changes_state(request.content_))
+        {
+            target->sidecar_->mirror(std::move(request.content_), true);
+            prioritize_sidecar(request.instance_id_, *target);
+            break;
+        }
+
+        // The deadline starts when the request arrives, even if the worker is not ready yet.
+        uint64_t forward = ++target->forwarded_;
+        target->unanswered_.push_back(commands);
+        if (!request.background_)
+        {
+            target->last_interactive_ = forward;
+        }
+
+        target->last_active_ = std::chrono::steady_clock::now();
+        verdict fate = target->speculation_ ? foresee(request.instance_id_, *target, request.content_, forward)
+                                            : verdict::unrelated;
+        if (fate == verdict::answered)
+        {
+            break;
+        }
+
+        if (fate == verdict::unrelated)
+        {
+            journal_forward(*target, request.content_, forward);
+        }
+
+        auto limit = request.deadline_ ? request.deadline_ : target->default_deadline_;
+        if (limit && *limit > std::chrono::milliseconds::zero())
+        {
+            timer t{request.instance_id_, event::kind::expired, deadline{forward, 0, *limit}};
+            target->deadlines_.emplace_back(forward, start_timer(t, *limit));
+        }
+
+        if (fate != verdict::unrelated)
+        {
+            // Sertop runs it already, or will once the guesses that the user moved away from are cancelled.
+            prioritize(request.instance_id_, *target);
+            break;
+        }
+
+        if (target->pending_)
+        {
+            // Sent to the worker as soon as it is ready.
+            target->pending_->forwards_.push(std::move(request.content_));
+            break;
+        }
+
+        // Raised before sertop sees the request, so that it starts running right away.
+        prioritize(request.instance_id_, *target);
+        target->worker_->enqueue(std::move(request.content_));
+        break;
+    }
+    case request::verb::speculate:
+    { // Open a new scope here because we declare variables.
+        response response = create_empty_response(request.instance_id_, 1);
+        response.verb_ = request::verb::speculate;
+        response.content_ = "";
+
+        std::vector<std::string> commands;
+        instance* target = s.instances_.find(request.instance_id_);
+        try
+        {
+            json::parse(request.content_).get_to(commands);
+        }
+        catch (const json::exception& e)
+        {
+            response.status_ = response::status::failure;
+            response.content_ = "invalid hint";
+        }
+
+        if (speculate_ahead_ == 0)
+        {
+            response.status_ = response::status::failure;
+            response.content_ = "speculation is disabled";
+        }
+        else if (target == nullptr)
+        {
+            response.status_ = response::status::failure;
+            response.content_ = "unknown worker";
+        }
+        else if (response.status_ == response::status::success)
+        {
+            // Kept while the instance hibernates, sertop runs ahead once it is needed again.
+            hint(request.instance_id_, *target, std::move(commands));
+        }
+
+        server_->enqueue(std::move(response));
+        break;
+    }
     case request::verb::stop:
         logger_->debug("received stop signal");
-        signal_received_ = true;
+        notify();
+        break;
+    case request::verb::reattach:
+        // Handled by the server.
+        break;
+    case request::verb::interrupt:
+    { // Open a new scope here because we declare variables.
+        response response = create_empty_response(request.instance_id_, 1);
+        response.verb_ = request::verb::interrupt;
+        response.content_ = "";
+
+        instance* target = s.instances_.find(request.instance_id_);
+        if (target == nullptr || !target->worker_)
+        {
+            // Nothing runs before the worker is ready.
+            response.status_ = response::status::failure;
+            response.content_ = target == nullptr ? "unknown worker" : "worker is not ready";
+        }
+        else
+        {
+            // Sertop only handles the signal inside a command. While it waits for input, or replays commands that the
+            // client did not send, the signal would break the wrong thing, or sertop itself.
+            bool outstanding = target->completed_ != target->forwarded_ && target->replaying_ == 0;
+
+            // Interrupting a mirrored command would leave the sidecar in another state than the worker.
+            bool querying = target->sidecar_ && target->sidecar_->answering();
+
+            try
+            {
+                if (!outstanding && !querying)
+                {
+                    response.status_ = response::status::failure;
+                    response.content_ = "nothing to interrupt";
+                }
+
+                // A command that sertop runs ahead of the user is cancelled once the user moves elsewhere, and
+                // interrupted then if it still runs.
+                if (outstanding && !guessing(*target))
+                {
+                    target->worker_->interrupt();
+                }
+
+                if (querying)
+                {
+                    target->sidecar_->interrupt();
+                }
+            }
+            catch (const api_error& e)
+            {
+                response.status_ = response::status::failure;
+                response.content_ = e.what();
+            }
+        }
+
+        server_->enqueue(std::move(response));
+        break;
+    }
+    case request::verb::stats:
+    { // Open a new scope here because we declare variables.
+        response response = create_empty_response(request.instance_id_, 1);
+        response.verb_ = request::verb::stats;
+
+        instance* target = s.instances_.find(request.instance_id_);
+        if (target == nullptr || (!target->worker_ && !target->hibernating_))
+        {
+            response.status_ = response::status::failure;
+            response.content_ = target == nullptr ? "unknown worker" : "worker is not ready";
+            server_->enqueue(std::move(response));
+            break;
+        }
+
+        json stats = {{"forwarded", target->forwarded_}, {"completed", target->completed_}};
+        if (journaling())
+        {
+            stats["journal"] = target->journal_.commands().size();
+        }
+        if (hibernate_after_ > std::chrono::seconds::zero())
+        {
+            stats["hibernating"] = target->hibernating_;
+        }
+        if (recover_)
+        {
+            stats["recoveries"] = target->recoveries_;
+        }
+        if (target->wants_sidecar_)
+        {
+            stats["sidecar"] = target->sidecar_ && target->sidecar_->ready();
+        }
+        if (speculate_ahead_ > 0)
+        {
+            std::size_t ahead = target->speculation_ ? target->speculation_->ahead() : 0;
+            stats["speculation"] = {{"ahead", ahead}, {"hits", target->hits_}, {"misses", target->misses_}};
+        }
+
+        if (target->hibernating_)
+        {
+            // Nothing runs, and nothing uses memory.
+            response.content_ = stats.dump();
+            server_->enqueue(std::move(response));
+            break;
+        }
+
+        try
+        {
+            worker::memory_usage usage = target->worker_->memory();
+            stats["resident"] = usage.resident_;
+            stats["shared"] = usage.shared_;
+        }
+        catch (const api_error& e)
+        {
+            // Left out where sampling is not supported.
+        }
+
+#ifdef WPWRAPPER_POSIX
+        try
+        {
+            if (auto usage = target->worker_->cgroup_usage())
+            {
+                stats["cpu_usec"] = usage->cpu_usec_;
+                if (usage->memory_current_)
+                {
+                    stats["memory_current"] = *usage->memory_current_;
+                }
+            }
+        }
+        catch (const api_error& e)
+        {
+            logger_->warn("unable to read cgroup statistics of worker {}: {}", request.instance_id_, e.what());
+        }
+
+        if (placement_)
+        {
+            if (auto core = target->worker_->core())
+            {
+                stats["core"] = *core;
+            }
+
+            json loads = json::object();
+            for (const auto& [core, load]: placement_->loads())
+            {
+                loads[std::to_string(core)] = load;
+            }
+            stats["placement"] = loads;
+        }
+#endif
+
+        response.content_ = stats.dump();
+        server_->enqueue(std::move(response));
         break;
     }
+    case request::verb::memory:
+    { // Open a new scope here because we declare variables.
+        response response = create_empty_response(request.instance_id_, 1, wpwrapper::response::status::failure);
+        response.verb_ = request::verb::memory;
+        response.content_ = "memory is not a request";
+        server_->enqueue(std::move(response));
+        break;
+    }
+    }
 }
 
-void conductor::handle_worker_failure(unsigned int instance_id, const wpwrapper::api_error& error)
+void conductor::handle_event(shard& s, event& event)
+{
+    instance* target = s.instances_.find(event.instance_id_);
+
+    switch (event.kind_)
+    {
+    case event::kind::provisioned:
+    { // Open a new scope here because we declare variables.
+        if (target == nullptr || !target->pending_)
+        {
+            // The instance was invalidated in the meantime: nobody is listening anymore.
+            if (event.worker_)
+            {
+                retire(std::move(event.worker_));
+            }
+            logger_->debug("discarded worker {}", event.instance_id_);
+            break;
+        }
+
+        pending_instance pending = std::move(*target->pending_);
+        target->pending_.reset();
+
+        response response = create_empty_response(event.instance_id_, 1);
+        response.verb_ = pending.cloning_ ? request::verb::clone : request::verb::create;
+
+        if (event.worker_ && !pending.failure_)
+        {
+            response.status_ = response::status::success;
+            logger_->debug("created worker {}", event.instance_id_);
+        }
+        else
+        {
+            response.status_ = response::status::failure;
+            response.content_ = pending.failure_ ? *pending.failure_ : event.error_;
+        }
+
+        // Waterproof does not know that the worker of a hibernating instance was replaced. A clone is only announced
+        // once it is in the same state as the instance that it was cloned from.
+        bool replay = pending.resuming_ || pending.cloning_;
+        if (!pending.resuming_ && !(pending.cloning_ && response.status_ == response::status::success))
+        {
+            server_->enqueue(response);
+        }
+
+        if (response.status_ == response::status::success && !pending.destroy_requested_)
+        {
+            if (replay)
+            {
+                // The forward requests that arrived in the meantime are journaled already, but not replayed.
+                const journal& j = target->journal_;
+                logger_->debug("replaying {} commands to worker {}", j.replayable(), event.instance_id_);
+                target->replaying_ = 0;
+                for (std::size_t c = 0; c < j.replayable(); ++c)
+                {
+                    target->replaying_ += serapi::count_commands(j.commands()[c]);
+                    event.worker_->enqueue(j.commands()[c]);
+                }
+                target->journal_.rewind();
+            }
+
+            // Deliver everything that arrived while the worker was being created, in order.
+            while (!pending.forwards_.empty())
+            {
+                event.worker_->enqueue(std::move(pending.forwards_.front()));
+                pending.forwards_.pop();
+            }
+
+            target->worker_ = std::move(event.worker_);
+            target->priority_ = worker::priority::interactive;
+            watch_memory(event.instance_id_, *target);
+            watch_idle(event.instance_id_, *target);
+            prioritize(event.instance_id_, *target);
+
+            target->cloning_ = pending.cloning_;
+            if (target->replaying_ == 0)
+            {
+                finish_replay(event.instance_id_, *target);
+                speculate(event.instance_id_, *target);
+            }
+            break;
+        }
+
+        // Like before, a failed create leaves the instance mapped until Waterproof destroys it. The forward requests
+        // that were waiting for the worker are dropped, and so are their deadlines.
+        cancel_timers(event.instance_id_, *target);
+        stop_sidecar(event.instance_id_, *target, "");
+        if (event.worker_)
+        {
+            retire(std::move(event.worker_));
+        }
+
+        if (pending.destroy_requested_)
+        {
+            s.instances_.erase(event.instance_id_);
+            logger_->debug("destroyed worker {}", event.instance_id_);
+
+            wpwrapper::response destroyed = create_empty_response(event.instance_id_, 1);
+            destroyed.verb_ = request::verb::destroy;
+            destroyed.content_ = "";
+            server_->unmap(event.instance_id_, std::move(destroyed));
+        }
+        else if (pending.resuming_)
+        {
+            // Like a failed worker, an instance that cannot be resumed is removed, and Waterproof is told.
+            s.instances_.erase(event.instance_id_);
+            response.verb_ = request::verb::destroy;
+            response.content_ = fmt::format("unable to {} sertop instance: {}",
+                    target->recovery_ ? "recover" : "resume", response.content_);
+            server_->enqueue(std::move(response));
+        }
+        break;
+    }
+    case event::kind::failed:
+    { // Open a new scope here because we declare variables.
+        if (target != nullptr && target->pending_)
+        {
+            // Reported in the create response.
+            if (!target->pending_->failure_)
+            {
+                target->pending_->failure_ = event.error_;
+            }
+            break;
+        }
+
+        if (target == nullptr || !target->worker_)
+        {
+            // Already removed, e.g. because both worker threads failed.
+            break;
+        }
+
+        // A worker that fails while it replays the journal would fail again.
+        if (recover_ && target->replaying_ == 0 && !target->diverged_)
+        {
+            // The worker read everything before it failed. Its answers may complete commands, which are replayed then.
+            flush(s);
+            recover(event.instance_id_, *target, event.error_);
+            break;
+        }
+
+        // Fatal error occurred, delete worker and inform Waterproof. A clone that has not been announced yet fails.
+        cancel_timers(event.instance_id_, *target);
+        stop_sidecar(event.instance_id_, *target, "");
+        retire(std::move(target->worker_));
+        bool cloning = target->cloning_;
+        s.instances_.erase(event.instance_id_);
+
+        response response = create_empty_response(event.instance_id_, 1, wpwrapper::response::status::failure);
+        response.verb_ = cloning ? request::verb::clone : request::verb::destroy;
+        response.content_ = cloning ? fmt::format("unable to clone sertop instance: {}", event.error_) : event.error_;
+
+        server_->enqueue(std::move(response));
+        break;
+    }
+    case event::kind::invalidated:
+    { // Open a new scope here because we declare variables.
+        if (target == nullptr)
+        {
+            break;
+        }
+
+        // A worker that is still being provisioned is discarded once it is ready.
+        cancel_timers(event.instance_id_, *target);
+        stop_sidecar(event.instance_id_, *target, "");
+        if (target->worker_)
+        {
+            retire(std::move(target->worker_));
+        }
+        s.instances_.erase(event.instance_id_);
+        logger_->debug("destroyed worker {}", event.instance_id_);
+        break;
+    }
+    case event::kind::expired:
+        // Requests that completed in the meantime, or whose instance is gone, are no longer timed.
+        if (target != nullptr && event.deadline_->forward_ > target->completed_)
+        {
+            escalate(event.instance_id_, *target, *event.deadline_);
+        }
+        break;
+    case event::kind::sample:
+        if (target != nullptr && target->sampler_)
+        {
+            check_memory(event.instance_id_, *target);
+        }
+        break;
+    case event::kind::idle:
+        if (target == nullptr || !target->idler_)
+        {
+            break;
+        }
+
+        // The timer is not restarted for every forward request, so it may expire before the worker is idle for long.
+        target->idler_.reset();
+        if (target->worker_ && !target->replaying_ && target->completed_ == target->forwarded_
+            && (!target->sidecar_ || target->sidecar_->idle()) && !guessing(*target))
+        {
+            if (std::chrono::steady_clock::now() - target->last_active_ >= hibernate_after_)
+            {
+                hibernate(event.instance_id_, *target);
+            }
+            else
+            {
+                watch_idle(event.instance_id_, *target);
+            }
+        }
+        break;
+    case event::kind::clone:
+        lend(event.instance_id_, target, event.clone_id_);
+        break;
+    case event::kind::cloned:
+        if (target == nullptr || !target->pending_ || !target->pending_->cloning_)
+        {
+            // The new instance was invalidated in the meantime.
+            break;
+        }
+
+        configure(event.instance_id_, *target, event.origin_->options_);
+        target->journal_ = std::move(event.origin_->journal_);
+
+        provisioner_->submit([this, instance_id = event.instance_id_, options = target->options_]
+        {
+            provision(instance_id, options);
+        });
+        start_sidecar(event.instance_id_, *target);
+
+        logger_->debug("provisioning worker {}", event.instance_id_);
+        break;
+    case event::kind::sidecar_provisioned:
+    { // Open a new scope here because we declare variables.
+        if (target == nullptr || !target->sidecar_ || target->sidecar_->ready())
+        {
+            // The sidecar was stopped, or replaced by one that was ready sooner.
+            if (event.worker_)
+            {
+                retire(std::move(event.worker_));
+            }
+            break;
+        }
+
+        if (!event.worker_)
+        {
+            // Queries keep going to the worker.
+            logger_->warn("unable to start the sidecar of worker {}: {}", event.instance_id_, event.error_);
+            target->sidecar_.reset();
+            break;
+        }
+
+        logger_->debug("mirroring {} commands to the sidecar of worker {}", target->sidecar_->waiting(),
+                       event.instance_id_);
+        target->sidecar_->attach(std::move(event.worker_));
+        prioritize_sidecar(event.instance_id_, *target);
+        break;
+    }
+    case event::kind::sidecar_failed:
+        if (target == nullptr || !target->sidecar_ || !target->sidecar_->ready())
+        {
+            break;
+        }
+
+        stop_sidecar(event.instance_id_, *target, event.error_);
+
+        // Without a journal, a new sidecar cannot catch up with the worker.
+        if (journaling())
+        {
+            logger_->warn("sidecar of worker {} failed, restarting it: {}", event.instance_id_, event.error_);
+            start_sidecar(event.instance_id_, *target);
+        }
+        else
+        {
+            logger_->warn("sidecar of worker {} failed: {}", event.instance_id_, event.error_);
+        }
+        break;
+    case event::kind::moved:
+#ifdef WPWRAPPER_POSIX
+        // The worker may have gone away, or moved already, in the meantime.
+        if (target != nullptr && target->worker_ && target->worker_->core() == event.move_->from_
+            && placement_->relocate(*event.move_))
+        {
+            try
+            {
+                target->worker_->pin(event.move_->to_);
+            }
+            catch (const api_error& e)
+            {
+                logger_->warn("unable to move worker {}: {}", event.instance_id_, e.what());
+                placement_->relocate(placement::move{event.instance_id_, event.move_->to_, event.move_->from_});
+            }
+        }
+#endif
+        break;
+    }
+}
+
+void conductor::provision(unsigned int instance_id, const std::string& options, bool sidecar)
 {
-    std::lock_guard<std::mutex> guard(queue_m_);
+    event result{sidecar ? event::kind::sidecar_provisioned : event::kind::provisioned, instance_id, nullptr, ""};
+#ifdef WPWRAPPER_POSIX
+    std::optional<unsigned int> core;
+#endif
 
-    // Fatal error occurred, delete worker and inform Waterproof.
-    workers_.erase(instance_id);
+    auto on_response = std::bind(sidecar ? &conductor::handle_sidecar_response : &conductor::handle_response, this,
+            std::placeholders::_1, std::placeholders::_2);
+    auto on_failure = std::bind(sidecar ? &conductor::handle_sidecar_failure : &conductor::handle_worker_failure, this,
+            std::placeholders::_1, std::placeholders::_2);
 
-    response response = create_empty_response(instance_id, 1, wpwrapper::response::status::failure);
-    response.verb_ = request::verb::destroy;
-    response.content_ = error.what();
+    try
+    {
+        config conf(options);
+        worker::environment env;
+
+#ifdef WPWRAPPER_POSIX
+        env.reactor_ = reactor_;
+
+        // Cores are placed per instance, and taken by the worker. Sidecars share the cores of all instances; they must
+        // not stay on the reserved cores that this thread runs on.
+        if (placement_)
+        {
+            env.shared_ = placement_->shared();
+            if (!sidecar)
+            {
+                core = placement_->assign(instance_id);
+                env.core_ = core;
+            }
+        }
+
+        if (!cgroup_root_.empty())
+        {
+            // Names must be unique among recycled workers, and among wrapper processes that take over from each other.
+            env.group_ = std::make_unique<cgroup>(api_, cgroup_root_,
+                    fmt::format("sertop-{}-{}", getpid(), next_cgroup_++),
+                    cgroup::limits{conf.cpu_max, conf.memory_max, conf.memory_high, conf.pids_max});
+        }
+#endif
+
+        logger_->info("start sertop at: {}", conf.sertop_path);
+        result.worker_ = std::make_unique<worker>(instance_id,
+                conf.sertop_path,
+                conf.sertop_args, api_,
+                std::vector<worker::failure_callback>{on_failure},
+                std::vector<worker::response_callback>{on_response},
+                std::move(env));
+    }
+    catch (const api_error& e)
+    {
+        result.error_ = e.what();
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        result.error_ = fmt::format("invalid create options: {}", e.what());
+    }
+
+#ifdef WPWRAPPER_POSIX
+    if (!result.worker_ && core)
+    {
+        placement_->release(instance_id, *core);
+    }
+#endif
 
-    out_queue_.push(response);
+    post(std::move(result));
+}
+
+void conductor::retire(std::unique_ptr<worker> w)
+{
+#ifdef WPWRAPPER_POSIX
+    if (placement_ && w->core())
+    {
+        if (auto m = placement_->release(w->id(), *w->core()))
+        {
+            // Moved by the shard that owns the other worker.
+            post(event{event::kind::moved, m->instance_id_, nullptr, "", std::nullopt, m});
+        }
+    }
+#endif
+
+    // Tasks need to be copyable, so the worker is moved into a shared pointer. It is destructed on the executor thread,
+    // which only waits for its pipelines to stop: the reactor waits for sertop to shut down.
+    std::shared_ptr<worker> retired(std::move(w));
+    provisioner_->submit([retired]() mutable
+    {
+        retired.reset();
+    });
+}
+
+void conductor::post(event event)
+{
+    shard& s = shard_of(event.instance_id_);
+    s.event_queue_.push(std::move(event));
+    schedule(s);
+}
+
+void conductor::configure(unsigned int instance_id, instance& i, std::string options)
+{
+    i.options_ = std::move(options);
+
+    // Invalid options set nothing here. Provisioning the worker fails on them, which fails the create request.
+    try
+    {
+        config conf(i.options_);
+        i.default_deadline_ = conf.deadline;
+        i.soft_memory_limit_ = conf.soft_memory_limit;
+        i.hard_memory_limit_ = conf.hard_memory_limit;
+        i.wants_sidecar_ = conf.sidecar;
+    }
+    catch (const nlohmann::json::exception& e)
+    {
+        logger_->warn("invalid create options for worker {}: {}", instance_id, e.what());
+    }
+}
+
+timer_wheel<conductor::timer>::handle conductor::start_timer(const timer& t, std::chrono::milliseconds delay)
+{
+    // The shard is armed for the new timer before its handler finishes.
+    return shard_of(t.instance_id_).timers_.schedule(std::chrono::steady_clock::now() + delay, t);
+}
+
+void conductor::cancel_timers(unsigned int instance_id, instance& i)
+{
+    if (i.deadlines_.empty() && !i.sampler_ && !i.idler_)
+    {
+        return;
+    }
+
+    auto& timers = shard_of(instance_id).timers_;
+    for (const auto& [forward, handle]: i.deadlines_)
+    {
+        timers.cancel(handle);
+    }
+    i.deadlines_.clear();
+
+    if (i.sampler_)
+    {
+        timers.cancel(*i.sampler_);
+        i.sampler_.reset();
+    }
+
+    if (i.idler_)
+    {
+        timers.cancel(*i.idler_);
+        i.idler_.reset();
+    }
+}
+
+void conductor::expire(shard& s)
+{
+    auto now = std::chrono::steady_clock::now();
+
+    // The task that was submitted for this moment has run, or runs soon and finds nothing to do.
+    if (s.wakeup_ && *s.wakeup_ <= now)
+    {
+        s.wakeup_.reset();
+    }
+
+    s.timers_.advance(now, [&](timer t)
+    {
+        event e{t.kind_, t.instance_id_, nullptr, "", t.deadline_};
+        handle_event(s, e);
+    });
+}
+
+void conductor::arm(shard& s)
+{
+    auto next = s.timers_.next_expiry();
+
+    // A task that is due earlier handles the shard anyway, and arms it again.
+    if (!next || (s.wakeup_ && *s.wakeup_ <= *next))
+    {
+        return;
+    }
+
+    s.wakeup_ = next;
+    executor_->submit_at(*next, [this, &s]
+    {
+        schedule(s);
+    });
+}
+
+void conductor::watch_memory(unsigned int instance_id, instance& i)
+{
+    if (memory_interval_ == std::chrono::seconds::zero() || !i.worker_ || i.sampler_
+        || (!i.soft_memory_limit_ && !i.hard_memory_limit_))
+    {
+        return;
+    }
+
+    i.sampler_ = start_timer(timer{instance_id, event::kind::sample, std::nullopt}, memory_interval_);
+}
+
+void conductor::check_memory(unsigned int instance_id, instance& i)
+{
+    // The sampler has expired, so there is nothing to cancel.
+    i.sampler_.reset();
+
+    if (!i.worker_)
+    {
+        return;
+    }
+
+    worker::memory_usage usage;
+    try
+    {
+        usage = i.worker_->memory();
+    }
+    catch (const api_error& e)
+    {
+        // Sampling is not supported here, or sertop is gone, which its worker reports by itself.
+        logger_->warn("stopped watching the memory usage of worker {}: {}", instance_id, e.what());
+        return;
+    }
+
+    if (i.hard_memory_limit_ && usage.resident_ > *i.hard_memory_limit_)
+    {
+        logger_->warn("worker {} uses {} MiB, more than its hard limit of {} MiB", instance_id, usage.resident_ >> 20,
+                *i.hard_memory_limit_ >> 20);
+
+        response response = create_empty_response(instance_id, 1, wpwrapper::response::status::failure);
+        response.verb_ = request::verb::memory;
+        response.content_ = json{{"limit", "hard"}, {"usage", usage.resident_}, {"threshold", *i.hard_memory_limit_}}
+                .dump();
+        server_->enqueue(std::move(response));
+
+        recycle(instance_id, i);
+        return;
+    }
+
+    bool over_soft_limit = i.soft_memory_limit_ && usage.resident_ > *i.soft_memory_limit_;
+    if (over_soft_limit && !i.over_soft_memory_limit_)
+    {
+        logger_->info("worker {} uses {} MiB, more than its soft limit of {} MiB", instance_id, usage.resident_ >> 20,
+                *i.soft_memory_limit_ >> 20);
+
+        response response = create_empty_response(instance_id, 1);
+        response.verb_ = request::verb::memory;
+        response.content_ = json{{"limit", "soft"}, {"usage", usage.resident_}, {"threshold", *i.soft_memory_limit_}}
+                .dump();
+        server_->enqueue(std::move(response));
+    }
+
+    // Coq rarely gives memory back, but if it does, Waterproof is warned again the next time.
+    i.over_soft_memory_limit_ = over_soft_limit;
+
+    watch_memory(instance_id, i);
+}
+
+void conductor::prioritize(unsigned int instance_id, instance& i)
+{
+    if (!background_priority_ || !i.worker_)
+    {
+        return;
+    }
+
+    // Forward requests complete in order, so an interactive request is outstanding until the last one has completed.
+    auto wanted = i.completed_ < i.last_interactive_ ? worker::priority::interactive : *background_priority_;
+    if (wanted == i.priority_)
+    {
+        return;
+    }
+
+    try
+    {
+        i.worker_->prioritize(wanted);
+        i.priority_ = wanted;
+    }
+    catch (const api_error& e)
+    {
+        logger_->warn("unable to change the priority of worker {}: {}", instance_id, e.what());
+    }
+}
+
+void conductor::watch_idle(unsigned int instance_id, instance& i)
+{
+    if (hibernate_after_ == std::chrono::seconds::zero() || !i.worker_ || i.idler_ || i.completed_ != i.forwarded_)
+    {
+        return;
+    }
+
+    auto idle = std::chrono::steady_clock::now() - i.last_active_;
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(hibernate_after_ - idle);
+    i.idler_ = start_timer(timer{instance_id, event::kind::idle, std::nullopt},
+            std::max(left, std::chrono::milliseconds(1)));
+}
+
+void conductor::hibernate(unsigned int instance_id, instance& i)
+{
+    // The new sertop instance runs the hinted commands ahead of the user again, once it replayed the others.
+    if (i.speculation_)
+    {
+        i.speculation_->rewind(i.journal_);
+    }
+
+    logger_->info("hibernating worker {}, keeping {} commands", instance_id, i.journal_.commands().size());
+    cancel_timers(instance_id, i);
+    stop_sidecar(instance_id, i, "the worker hibernated");
+    retire(std::move(i.worker_));
+    i.hibernating_ = true;
+    i.over_soft_memory_limit_ = false;
+}
+
+void conductor::resume(unsigned int instance_id, instance& i)
+{
+    logger_->info("resuming worker {}", instance_id);
+    i.hibernating_ = false;
+    i.pending_ = pending_instance{};
+    i.pending_->resuming_ = true;
+
+    provisioner_->submit([this, instance_id, options = i.options_]
+    {
+        provision(instance_id, options);
+    });
+    start_sidecar(instance_id, i);
+}
+
+void conductor::start_sidecar(unsigned int instance_id, instance& i)
+{
+    if (!i.wants_sidecar_)
+    {
+        return;
+    }
+
+    stop_sidecar(instance_id, i, "the sidecar was restarted");
+    i.sidecar_.emplace();
+    for (const auto& command: i.journal_.commands())
+    {
+        i.sidecar_->mirror(command, false);
+    }
+
+    // Sertop may be running a command ahead of the user, which is journaled once it completed.
+    if (auto command = i.speculation_ ? i.speculation_->in_flight() : std::nullopt)
+    {
+        i.sidecar_->mirror(std::move(*command), false);
+    }
+
+    provisioner_->submit([this, instance_id, options = i.options_]
+    {
+        provision(instance_id, options, true);
+    });
+}
+
+void conductor::stop_sidecar(unsigned int instance_id, instance& i, std::string_view reason)
+{
+    if (!i.sidecar_)
+    {
+        return;
+    }
+
+    // Waterproof waits for the queries to complete, unless it no longer knows the instance.
+    if (!reason.empty())
+    {
+        for (std::size_t query = i.sidecar_->queries(); query > 0; --query)
+        {
+            response response = create_empty_response(instance_id, 1, wpwrapper::response::status::failure);
+            response.verb_ = request::verb::forward;
+            response.content_ = fmt::format("dropped query: {}", reason);
+            server_->enqueue(std::move(response));
+        }
+    }
+
+    if (i.sidecar_->ready())
+    {
+        retire(i.sidecar_->detach());
+    }
+    i.sidecar_.reset();
+}
+
+void conductor::prioritize_sidecar(unsigned int instance_id, instance& i)
+{
+    if (!background_priority_)
+    {
+        return;
+    }
+
+    try
+    {
+        i.sidecar_->prioritize(*background_priority_);
+    }
+    catch (const api_error& e)
+    {
+        logger_->warn("unable to change the priority of the sidecar of worker {}: {}", instance_id, e.what());
+    }
+}
+
+bool conductor::journaling() const noexcept
+{
+    return hibernate_after_ > std::chrono::seconds::zero() || recover_;
+}
+
+void conductor::recover(unsigned int instance_id, instance& i, std::string error)
+{
+    // The commands that sertop ran ahead of the user are not replayed either, as they may never be forwarded.
+    if (i.speculation_)
+    {
+        i.speculation_->forget(i.journal_);
+        i.speculation_.reset();
+    }
+
+    // The command that sertop was running may be what made it fail, so neither it nor the ones after it are replayed.
+    i.journal_.abandon();
+
+    logger_->warn("worker {} failed, recovering it from {} commands: {}", instance_id, i.journal_.commands().size(),
+            error);
+    cancel_timers(instance_id, i);
+    retire(std::move(i.worker_));
+    stop_sidecar(instance_id, i, fmt::format("the worker failed ({})", error));
+    i.recovery_ = recovery{std::move(error), i.forwarded_ - i.completed_};
+    i.completed_ = i.forwarded_;
+    i.unanswered_.clear();
+    i.over_soft_memory_limit_ = false;
+    ++i.recoveries_;
+
+    i.pending_ = pending_instance{};
+    i.pending_->resuming_ = true;
+
+    provisioner_->submit([this, instance_id, options = i.options_]
+    {
+        provision(instance_id, options);
+    });
+    start_sidecar(instance_id, i);
+}
+
+void conductor::lend(unsigned int instance_id, instance* i, unsigned int clone_id)
+{
+    // The journal of an instance that is being cloned itself is not complete yet.
+    if (i == nullptr || i->cloning_ || (i->pending_ && i->pending_->cloning_))
+    {
+        post(event{event::kind::provisioned, clone_id, nullptr,
+                   i == nullptr ? "unknown sertop instance" : "sertop instance is still being cloned"});
+        return;
+    }
+
+    // Commands that are still running may never complete, so only the ones that did are replayed.
+    origin o{i->options_, i->journal_.completed()};
+
+    // The clone is in the state that the user brought the instance in, without what sertop ran ahead of the user.
+    if (i->speculation_)
+    {
+        i->speculation_->forget(o.journal_);
+    }
+
+    logger_->debug("lending {} commands of worker {} to {}", o.journal_.commands().size(), instance_id, clone_id);
+    event cloned{event::kind::cloned, clone_id, nullptr, ""};
+    cloned.origin_ = std::move(o);
+    post(std::move(cloned));
+}
+
+void conductor::finish_replay(unsigned int instance_id, instance& i)
+{
+    if (i.cloning_)
+    {
+        logger_->info("worker {} cloned", instance_id);
+        i.cloning_ = false;
+
+        // The server hands out the token of the new instance.
+        response response = create_empty_response(instance_id, 1, wpwrapper::response::status::success);
+        response.verb_ = request::verb::clone;
+        server_->enqueue(std::move(response));
+    }
+
+    if (!i.recovery_)
+    {
+        return;
+    }
+
+    std::size_t replayed = i.journal_.replayable();
+    logger_->info("worker {} recovered", instance_id);
+
+    // The forward requests that were dropped never complete, which Waterproof needs to know.
+    response response = create_empty_response(instance_id, 1, wpwrapper::response::status::failure);
+    response.verb_ = request::verb::forward;
+    response.content_ = fmt::format("recovered sertop instance after it failed ({}): replayed {} commands, dropped {} "
+                                     "forward requests", i.recovery_->error_, replayed, i.recovery_->dropped_);
+    server_->enqueue(std::move(response));
+
+    i.recovery_.reset();
+}
+
+void conductor::recycle(unsigned int instance_id, instance& i)
+{
+    // Everything that was sent to the old worker is abandoned.
+    logger_->warn("recycling worker {}", instance_id);
+    cancel_timers(instance_id, i);
+    retire(std::move(i.worker_));
+    i.completed_ = i.forwarded_;
+    i.unanswered_.clear();
+    i.over_soft_memory_limit_ = false;
+    i.pending_ = pending_instance{};
+
+    // The new worker starts from scratch, and so does Waterproof.
+    i.journal_ = journal{};
+    i.replaying_ = 0;
+    i.recovery_.reset();
+    i.diverged_ = false;
+    i.speculation_.reset();
+    stop_sidecar(instance_id, i, "the worker was recycled");
+
+    provisioner_->submit([this, instance_id, options = i.options_]
+    {
+        provision(instance_id, options);
+    });
+    start_sidecar(instance_id, i);
+}
+
+void conductor::journal_forward(instance& i, const std::string& command, uint64_t forward)
+{
+    bool changes = (journaling() || i.sidecar_) && serapi::changes_state(command);
+    if (journaling() && changes)
+    {
+        i.journal_.add(command, forward);
+    }
+    if (i.sidecar_ && changes)
+    {
+        i.sidecar_->mirror(command, false);
+    }
+}
+
+void conductor::hint(unsigned int instance_id, instance& i, std::vector<std::string> commands)
+{
+    if (!i.speculation_)
+    {
+        i.speculation_.emplace();
+    }
+
+    if (i.speculation_->hint(std::move(commands)))
+    {
+        interrupt_guess(instance_id, i);
+    }
+    speculate(instance_id, i);
+}
+
+conductor::verdict conductor::foresee(unsigned int instance_id, instance& i, const std::string& command,
+        uint64_t forward)
+{
+    speculation& spec = *i.speculation_;
+    if (auto g = spec.claim(command))
+    {
+        ++i.hits_;
+
+        for (auto& answer: g->answers_)
+        {
+            response rsp = create_empty_response(instance_id);
+            rsp.content_ = std::move(answer);
+            rsp.verb_ = request::verb::forward;
+            server_->enqueue(std::move(rsp));
+        }
+
+        if (g->done_)
+        {
+            // Journaled when it completed.
+            i.unanswered_.pop_back();
+            ++i.completed_;
+            prioritize(instance_id, i);
+            watch_idle(instance_id, i);
+            speculate(instance_id, i);
+            return verdict::answered;
+        }
+
+        // From now on, the output of sertop answers the forward request, which is journaled like any other.
+        i.unanswered_.back() = g->unanswered_;
+        if (journaling() && g->changes_state_)
+        {
+            i.journal_.add(std::move(g->command_), forward, g->states_);
+        }
+        return verdict::claimed;
+    }
+
+    if (spec.follow(command))
+    {
+        return verdict::unrelated;
+    }
+
+    // The user moved elsewhere.
+    if (spec.hold(forward, command))
+    {
+        interrupt_guess(instance_id, i);
+    }
+    speculate(instance_id, i);
+    return verdict::held;
+}
+
+void conductor::interrupt_guess(unsigned int instance_id, instance& i)
+{
+    if (!i.worker_)
+    {
+        return;
+    }
+
+    try
+    {
+        i.worker_->interrupt();
+    }
+    catch (const api_error& e)
+    {
+        logger_->warn("unable to interrupt worker {}: {}", instance_id, e.what());
+    }
+}
+
+void conductor::speculate(unsigned int instance_id, instance& i)
+{
+    if (!i.speculation_ || !i.worker_ || i.replaying_ > 0 || guessing(i))
+    {
+        return;
+    }
+    speculation& spec = *i.speculation_;
+
+    if (auto cancel = spec.cancel())
+    {
+        if (i.sidecar_)
+        {
+            i.sidecar_->mirror(*cancel, false);
+        }
+        i.worker_->enqueue(std::move(*cancel));
+        return;
+    }
+    i.misses_ += spec.drop();
+
+    auto held = spec.release();
+    if (!held.empty())
+    {
+        while (!held.empty())
+        {
+            auto& [forward, command] = held.front();
+            journal_forward(i, command, forward);
+            i.worker_->enqueue(std::move(command));
+            held.pop();
+        }
+        prioritize(instance_id, i);
+        return;
+    }
+
+    // Sertop only runs ahead of the user while nobody waits for it.
+    if (i.completed_ != i.forwarded_)
+    {
+        return;
+    }
+
+    const auto* g = spec.next(speculate_ahead_);
+    if (g == nullptr)
+    {
+        return;
+    }
+    if (i.sidecar_ && g->changes_state_)
+    {
+        i.sidecar_->mirror(g->command_, false);
+    }
+    i.worker_->enqueue(g->command_);
+}
+
+void conductor::record(unsigned int instance_id, instance& i, const response& r)
+{
+    auto cancelled = i.speculation_->record(r.content_, journaling() ? &i.journal_ : nullptr);
+    if (!cancelled)
+    {
+        return;
+    }
+
+    i.misses_ += *cancelled;
+    speculate(instance_id, i);
+    watch_idle(instance_id, i);
+}
+
+bool conductor::guessing(const instance& i) noexcept
+{
+    return i.speculation_ && i.speculation_->running();
+}
+
+void conductor::escalate(unsigned int instance_id, instance& target, deadline d)
+{
+    auto timed = std::find_if(target.deadlines_.begin(), target.deadlines_.end(), [&](const auto& entry)
+    {
+        return entry.first == d.forward_;
+    });
+    if (timed == target.deadlines_.end())
+    {
+        // Cancelled in the meantime.
+        return;
+    }
+
+    switch (d.escalations_)
+    {
+    case 0:
+    { // Open a new scope here because we declare variables.
+        logger_->info("forward request {} of worker {} exceeded its deadline of {} ms", d.forward_, instance_id,
+                d.limit_.count());
+
+        response response = create_empty_response(instance_id, 1, wpwrapper::response::status::failure);
+        response.verb_ = request::verb::forward;
+        response.content_ = fmt::format("deadline of {} ms exceeded", d.limit_.count());
+        server_->enqueue(std::move(response));
+        break;
+    }
+    case 1:
+        // A forward request that waits for guesses to be cancelled is not running yet. The guess that runs was
+        // interrupted already, and a Cancel command must not be.
+        if (target.worker_ && !guessing(target))
+        {
+            logger_->info("interrupting worker {}", instance_id);
+            try
+            {
+                target.worker_->interrupt();
+            }
+            catch (const api_error& e)
+            {
+                logger_->warn("unable to interrupt worker {}: {}", instance_id, e.what());
+            }
+        }
+        break;
+    default:
+        if (!target.worker_)
+        {
+            // Being provisioned, which has timeouts of its own.
+            target.deadlines_.erase(timed);
+            return;
+        }
+
+        recycle(instance_id, target);
+        return;
+    }
+
+    ++d.escalations_;
+    timed->second = start_timer(timer{instance_id, event::kind::expired, d}, escalation_step);
+}
+
+bool conductor::track(shard& s, const response& r)
+{
+    if (r.verb_ != request::verb::forward)
+    {
+        return true;
+    }
+
+    instance* target = s.instances_.find(r.instance_id_);
+    if (target == nullptr)
+    {
+        return true;
+    }
+
+    bool done = serapi::ends_command(r.content_);
+
+    if (target->replaying_ > 0)
+    {
+        // A new sertop instance hands out state ids in the same order. If it does not, the ones that Waterproof holds
+        // no longer mean anything.
+        auto state = serapi::added_state(r.content_);
+        if (state && !target->journal_.replayed(*state))
+        {
+            target->diverged_ = true;
+            post(event{event::kind::failed, r.instance_id_, nullptr, "unable to restore the state of sertop instance"});
+        }
+
+        if (done && --target->replaying_ == 0)
+        {
+            logger_->debug("worker {} replayed its journal", r.instance_id_);
+            if (!target->diverged_)
+            {
+                finish_replay(r.instance_id_, *target);
+                speculate(r.instance_id_, *target);
+            }
+        }
+        return false;
+    }
+
+    if (guessing(*target))
+    {
+        // Sent once Waterproof forwards the same command, if it does.
+        record(r.instance_id_, *target, r);
+        return false;
+    }
+
+    if (target->completed_ == target->forwarded_)
+    {
+        // Output of a worker that was recycled.
+        return true;
+    }
+
+    if (auto state = serapi::added_state(r.content_))
+    {
+        target->journal_.assign(target->completed_ + 1, *state);
+    }
+
+    // A forward request may hold several commands, which sertop runs one after the other.
+    if (!done || --target->unanswered_.front() > 0)
+    {
+        return true;
+    }
+
+    target->unanswered_.pop_front();
+    ++target->completed_;
+    target->journal_.confirm(target->completed_);
+    prioritize(r.instance_id_, *target);
+
+    if (target->completed_ == target->forwarded_)
+    {
+        target->last_active_ = std::chrono::steady_clock::now();
+        watch_idle(r.instance_id_, *target);
+        speculate(r.instance_id_, *target);
+    }
+
+    if (target->deadlines_.empty() || target->deadlines_.front().first > target->completed_)
+    {
+        return true;
+    }
+
+    while (!target->deadlines_.empty() && target->deadlines_.front().first <= target->completed_)
+    {
+        s.timers_.cancel(target->deadlines_.front().second);
+        target->deadlines_.pop_front();
+    }
+
+    return true;
+}
+
+bool conductor::track_sidecar(shard& s, const response& r)
+{
+    instance* target = s.instances_.find(r.instance_id_);
+    if (target == nullptr || !target->sidecar_ || target->sidecar_->idle())
+    {
+        // Output of a sidecar that was stopped.
+        return false;
+    }
+
+    bool query = target->sidecar_->track(r.content_);
+    if (!serapi::ends_command(r.content_))
+    {
+        return query;
+    }
+
+    prioritize_sidecar(r.instance_id_, *target);
+
+    // The worker does not hibernate while its sidecar answers a query.
+    if (target->sidecar_->idle() && target->completed_ == target->forwarded_)
+    {
+        target->last_active_ = std::chrono::steady_clock::now();
+        watch_idle(r.instance_id_, *target);
+    }
+    return query;
+}
+
+void conductor::handle_worker_failure(unsigned int instance_id, const wpwrapper::api_error& error)
+{
+    post(event{event::kind::failed, instance_id, nullptr, error.what()});
+}
+
+void conductor::handle_sidecar_failure(unsigned int instance_id, const wpwrapper::api_error& error)
+{
+    post(event{event::kind::sidecar_failed, instance_id, nullptr, error.what()});
 }
 
 response conductor::create_empty_response(
@@ -240,6 +2249,7 @@ response conductor::create_empty_response(
     response response;
     response.id_ = next_id_++;
     response.priority_ = priority;
+    response.sequence_ = 0;
     response.instance_id_ = instance_id;
     response.status_ = status;
     return response;
@@ -17,9 +17,31 @@
 #ifndef WPWRAPPER_CONDUCTOR_H
 #define WPWRAPPER_CONDUCTOR_H
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <spdlog/logger.h>
 
+#include "sertop/journal.h"
+#include "sertop/sidecar.h"
+#include "sertop/speculation.h"
 #include "sertop/worker.h"
+#include "utils/executor.h"
+#include "utils/mpsc_queue.h"
+#include "utils/parker.h"
+#include "utils/slot_map.h"
+#include "utils/timer_wheel.h"
 #include "waterproof/server.h"
 
 #ifdef WPWRAPPER_WIN
@@ -29,6 +51,8 @@
 #elif WPWRAPPER_POSIX
 
 #include "posix/api_wrapper.h"
+#include "posix/placement.h"
+#include "posix/reactor.h"
 
 #endif
 
@@ -38,9 +62,120 @@ namespace wpwrapper {
 class conductor {
 
 public:
+    /// \brief A stop callback takes no arguments. It is executed once, on the thread that stops the conductor.
+    using stop_callback = std::function<void()>;
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief What another wrapper process needs to take over the instances and connections of a conductor.
+    struct snapshot {
+        /// \brief The connections, routes and sessions.
+        server::snapshot server_;
+
+        /// \brief A sertop instance.
+        struct instance {
+            /// \brief The instance id.
+            unsigned int id_;
+
+            /// \brief The worker. Empty if the instance is hibernating.
+            std::optional<worker::snapshot> worker_;
+
+            /// \brief The options that the instance was created with.
+            std::string options_;
+
+            /// \brief The journal of the instance. Empty if neither hibernation nor recovery is enabled. Its forward
+            /// requests are numbered from the first one that has not completed.
+            journal journal_;
+
+            /// \brief For every forward request that has not completed, in order, the number of its SerAPI commands
+            /// that have not completed.
+            std::deque<std::size_t> outstanding_;
+        };
+
+        /// \brief The sertop instances.
+        std::vector<instance> workers_;
+
+        /// \brief Returns every file descriptor that the snapshot refers to, once.
+        /// \return The file descriptors.
+        std::vector<int> files() const;
+
+        /// \brief Replaces the file descriptors that the snapshot refers to by their copies in another process.
+        /// \param copies The copies, in the order of files().
+        /// \throw api_error If the number of copies does not match.
+        void rebind(const std::vector<int>& copies);
+
+        /// \brief Serializes the snapshot. File descriptors are stored by number.
+        /// \return The serialized snapshot.
+        std::string encode() const;
+
+        /// \brief Deserializes a snapshot.
+        /// \param encoded The serialized snapshot, as returned by encode().
+        /// \return The snapshot.
+        /// \throw nlohmann::json::exception If the serialized snapshot is invalid.
+        static snapshot decode(const std::string& encoded);
+    };
+#endif
+
+    /// \brief How a conductor runs its instances. The defaults disable every optional feature.
+    struct settings {
+        /// \brief The number of shards that instances are divided over by instance id. At least one shard is used.
+        unsigned int shard_count_ = std::thread::hardware_concurrency();
+
+        /// \brief How long the instances of a disconnected client are kept alive, so that a new connection can
+        /// reattach them. Zero destroys them right away.
+        std::chrono::seconds grace_period_ = std::chrono::seconds::zero();
+
+        /// \brief How often the memory usage of workers with memory limits is sampled. Zero disables memory limits.
+        std::chrono::seconds memory_interval_ = std::chrono::seconds::zero();
+
+        /// \brief The priority of workers that are idle or only run background requests. Workers run with interactive
+        /// priority while a request that a user waits for is outstanding. Empty leaves the priority of workers alone.
+        std::optional<worker::priority> background_priority_;
+
+        /// \brief How long a worker may be idle before its sertop instance is shut down. The commands that were
+        /// forwarded to it are kept, and replayed to a new sertop instance once the next forward request arrives. Zero
+        /// keeps idle workers running.
+        std::chrono::seconds hibernate_after_ = std::chrono::seconds::zero();
 
-    /// \brief
-    conductor();
+        /// \brief Whether a worker whose sertop instance fails is replaced by a new one, which replays the commands
+        /// that were completed before the failure. Waterproof is told once the new sertop instance is in the same
+        /// state.
+        bool recover_ = false;
+
+        /// \brief How many of the commands that Waterproof hints at may run ahead of the user, so that they are
+        /// answered right away once they are forwarded. Zero ignores hints.
+        unsigned int speculate_ahead_ = 0;
+
+#ifdef WPWRAPPER_POSIX
+        /// \brief A cgroup v2 control group that was delegated to the wrapper. Every sertop instance is started in a
+        /// control group of its own below it, with the limits from its create options. Empty to start sertop instances
+        /// in the control group of the wrapper. Only available on Ubuntu.
+        std::string cgroup_root_;
+
+        /// \brief The number of cores to keep the threads of the wrapper on. Every sertop instance is pinned to one of
+        /// the other cores. Zero lets the wrapper and sertop instances run on any core. Only available on Ubuntu.
+        unsigned int reserved_cores_ = 0;
+#endif
+    };
+
+    /// \brief Constructs a conductor, which starts a server and handles its requests on a pool of threads.
+    /// \details Instances are divided over shards by instance id. Shards are executed as tasks on a work-stealing
+    /// executor with one thread per core. Different shards are handled in parallel, but a single shard is never handled
+    /// by two threads at once, so the messages of a single instance are still handled in order.
+    /// \param stop_callbacks A list of callbacks to execute when the conductor stops, either because the server failed,
+    /// because a stop request was received or because notify() was called.
+    /// \param settings How the conductor runs its instances.
+    /// \throw api_error If the server could not be started.
+    conductor(std::vector<stop_callback> stop_callbacks, settings settings);
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief Constructs a conductor that takes over the instances and connections that another wrapper process
+    /// released. Only available on macOS and Ubuntu.
+    /// \param stop_callbacks A list of callbacks to execute when the conductor stops.
+    /// \param settings How the conductor runs its instances.
+    /// \param adopted The instances and connections to take over. Empty to start without any.
+    /// \throw api_error If the server could not be started.
+    conductor(std::vector<stop_callback> stop_callbacks, settings settings, std::optional<snapshot> adopted);
+#endif
 
     ~conductor();
 
@@ -48,35 +183,548 @@ public:
 
     bool has_failed() const noexcept;
 
+#ifdef WPWRAPPER_POSIX
+    /// \brief Stops taking requests, finishes the work in progress, and gives up all instances and connections, so
+    /// that another wrapper process can take them over.
+    /// \details Requests that were read already are handled, workers that are being provisioned are waited for, and
+    /// queued messages and responses are written. Sertop instances and clients are left alone on destruction.
+    /// \return Everything that is needed to take over.
+    snapshot release();
+#endif
+
 private:
+    /// \brief How long each escalation step after an expired deadline waits for the forward request to complete.
+    static constexpr std::chrono::seconds escalation_step{2};
+
+    /// \brief The deadline of a forward request.
+    struct deadline {
+        /// \brief The number of the request among the forward requests of its instance, counting from one.
+        uint64_t forward_;
+
+        /// \brief The number of escalation steps that were taken already.
+        unsigned int escalations_;
+
+        /// \brief How long the request was allowed to take.
+        std::chrono::milliseconds limit_;
+    };
+
+    /// \brief What a new instance needs to be created in the same state as an existing one.
+    struct origin {
+        /// \brief The options that the existing instance was created with.
+        std::string options_;
+
+        /// \brief The commands of the existing instance that completed.
+        journal journal_;
+    };
+
+    /// \brief Something that happened on another thread, which needs to be handled on the conductor thread.
+    struct event {
+        /// \brief The kind of thing that happened.
+        enum class kind {
+            /// \brief The provisioning executor finished (or failed) creating a worker.
+                    provisioned,
+            /// \brief A worker failed.
+                    failed,
+            /// \brief The socket to which an instance was mapped became invalid.
+                    invalidated,
+            /// \brief A deadline expired, or the next escalation step after it is due.
+                    expired,
+            /// \brief The memory usage of a worker is due to be sampled.
+                    sample,
+            /// \brief A worker should move to another core, to even out the load.
+                    moved,
+            /// \brief A worker may have been idle for long enough to hibernate.
+                    idle,
+            /// \brief A new instance needs the options and the journal of this one, to be cloned from it.
+                    clone,
+            /// \brief The options and the journal of the instance to clone from arrived.
+                    cloned,
+            /// \brief A sidecar has been provisioned, or could not be.
+                    sidecar_provisioned,
+            /// \brief A sidecar failed.
+                    sidecar_failed
+        };
+
+        /// \brief The kind of thing that happened.
+        kind kind_;
+
+        /// \brief The instance to which the event applies.
+        unsigned int instance_id_;
+
+        /// \brief The newly created worker for provisioned and sidecar_provisioned events. Empty if provisioning
+        /// failed.
+        std::unique_ptr<worker> worker_;
+
+        /// \brief The error message for failed events and for provisioned events without a worker.
+        std::string error_;
+
+        /// \brief The deadline for expired events.
+        std::optional<deadline> deadline_;
+
+#ifdef WPWRAPPER_POSIX
+        /// \brief The move for moved events.
+        std::optional<placement::move> move_;
+#endif
+
+        /// \brief The new instance for clone events.
+        unsigned int clone_id_ = 0;
+
+        /// \brief What the new instance is created from, for cloned events.
+        std::optional<origin> origin_;
+    };
+
+    /// \brief What a timer was started for.
+    struct timer {
+        /// \brief The instance to which the timer applies.
+        unsigned int instance_id_;
+
+        /// \brief The kind of event that is posted when the timer expires.
+        event::kind kind_;
+
+        /// \brief The deadline of a forward request. Empty unless the timer is for a deadline.
+        std::optional<deadline> deadline_;
+    };
+
+    /// \brief Bookkeeping for an instance whose sertop instance failed, until its new one is in the same state.
+    struct recovery {
+        /// \brief The error that the worker failed with.
+        std::string error_;
+
+        /// \brief The number of forward requests that had not completed when the worker failed.
+        uint64_t dropped_;
+    };
+
+    /// \brief Bookkeeping for an instance whose worker is still being provisioned.
+    struct pending_instance {
+        /// \brief Contents of forward requests that arrived before the worker was ready, in order of arrival.
+        std::queue<std::string> forwards_;
+
+        /// \brief Set if a destroy request arrived before the worker was ready.
+        bool destroy_requested_ = false;
+
+        /// \brief Set if the worker failed before it was ready.
+        std::optional<std::string> failure_;
+
+        /// \brief Set if the worker replaces one that hibernated or failed. No create response is sent for it.
+        bool resuming_ = false;
+
+        /// \brief Set if the instance is cloned from another one. It is provisioned once the journal of the other
+        /// instance arrives.
+        bool cloning_ = false;
+    };
+
+    /// \brief What becomes of a forward request of an instance that Waterproof sent a hint to.
+    enum class verdict {
+        /// \brief It is sent to sertop like any other.
+                unrelated,
+        /// \brief Sertop already ran its command ahead of the user, and it has been answered.
+                answered,
+        /// \brief Sertop is running its command ahead of the user. The rest of the output is its answer.
+                claimed,
+        /// \brief It waits for the guesses that the user moved away from to be cancelled.
+                held
+    };
+
+    /// \brief State kept for every instance.
+    struct instance {
+        /// \brief The instance's worker. Empty while the worker is being provisioned.
+        std::unique_ptr<worker> worker_;
+
+        /// \brief Set while the worker is being provisioned.
+        std::optional<pending_instance> pending_;
+
+        /// \brief The options that the instance was created with, to recycle its worker.
+        std::string options_;
+
+        /// \brief The deadline of forward requests that do not set one.
+        std::optional<std::chrono::milliseconds> default_deadline_;
+
+        /// \brief The memory usage, in bytes, over which Waterproof is warned.
+        std::optional<uint64_t> soft_memory_limit_;
+
+        /// \brief The memory usage, in bytes, over which the worker is recycled.
+        std::optional<uint64_t> hard_memory_limit_;
+
+        /// \brief Set while the worker uses more memory than the soft limit, so that Waterproof is only warned once.
+        bool over_soft_memory_limit_ = false;
+
+        /// \brief The timer that samples the memory usage of the worker, if it is running.
+        std::optional<timer_wheel<timer>::handle> sampler_;
+
+        /// \brief The number of forward requests sent to the instance.
+        uint64_t forwarded_ = 0;
+
+        /// \brief The number of forward requests that sertop reported completed. Requests complete in order.
+        uint64_t completed_ = 0;
+
+        /// \brief For every forward request that has not completed, in order, the number of its SerAPI commands that
+        /// sertop has not completed yet. A request completes once sertop completed all of them.
+        std::deque<std::size_t> unanswered_;
+
+        /// \brief The timers of forward requests with a deadline that have not completed, in order of the requests.
+        std::deque<std::pair<uint64_t, timer_wheel<timer>::handle>> deadlines_;
+
+        /// \brief The number of the last forward request that was not a background request. Zero if there was none.
+        uint64_t last_interactive_ = 0;
+
+        /// \brief The priority that the worker was last given.
+        worker::priority priority_ = worker::priority::interactive;
+
+        /// \brief The commands to replay when the instance resumes or recovers. Only kept if either is enabled.
+        journal journal_;
+
+        /// \brief Set while the instance hibernates: it has no worker, but is resumed by the next forward request.
+        bool hibernating_ = false;
+
+        /// \brief The number of replayed SerAPI commands that sertop has not reported completed yet. Their output is
+        /// dropped.
+        uint64_t replaying_ = 0;
+
+        /// \brief When the instance last received a forward request, or completed one.
+        std::chrono::steady_clock::time_point last_active_;
+
+        /// \brief The timer that checks whether the worker has been idle for long enough, if it is running.
+        std::optional<timer_wheel<timer>::handle> idler_;
+
+        /// \brief Set while the instance recovers from a failed sertop instance.
+        std::optional<recovery> recovery_;
+
+        /// \brief Set while the instance replays the journal of the instance that it was cloned from. Waterproof
+        /// learns about it once the replay is done.
+        bool cloning_ = false;
+
+        /// \brief The number of times the instance recovered.
+        uint64_t recoveries_ = 0;
+
+        /// \brief Set once a new sertop instance assigned other state ids than the one it replaced. Replaying the
+        /// journal again would not help, so the instance does not recover anymore.
+        bool diverged_ = false;
+
+        /// \brief Set if the create options ask for a sidecar.
+        bool wants_sidecar_ = false;
+
+        /// \brief The sidecar of the worker. Empty if there is none, such as while the instance hibernates.
+        std::optional<sidecar> sidecar_;
+
+        /// \brief Set once Waterproof sent a hint.
+        std::optional<speculation> speculation_;
+
+        /// \brief The number of forward requests that were answered by commands that sertop ran ahead of the user.
+        uint64_t hits_ = 0;
+
+        /// \brief The number of commands that sertop ran ahead of the user, but that were cancelled.
+        uint64_t misses_ = 0;
+    };
+
+    /// \brief A disjoint part of the instances, together with the queues through which they are reached.
+    struct shard {
+        /// \brief The instances of this shard, keyed by the instance ids generated by the server. An instance id that
+        /// the server has reused for a new instance no longer finds the old one.
+        /// \note Only accessed by the task that handles the shard.
+        slot_map<instance> instances_;
+
+        /// \brief Requests received by the server thread.
+        mpsc_queue<request> in_queue_;
+        /// \brief Responses received by the worker threads.
+        mpsc_queue<response> out_queue_;
+        /// \brief Events posted by the server, worker and provisioning threads.
+        mpsc_queue<event> event_queue_;
+
+        /// \brief The deadlines, memory samplers and idle timers of the instances of this shard, with a resolution of
+        /// one millisecond.
+        /// \note Only accessed by the task that handles the shard.
+        timer_wheel<timer> timers_{std::chrono::milliseconds(1)};
+
+        /// \brief The moment for which the executor holds a task that schedules this shard. Empty if it holds none.
+        /// \note Only accessed by the task that handles the shard.
+        std::optional<std::chrono::steady_clock::time_point> wakeup_;
+
+        /// \brief The number of times the shard was scheduled since its handler last caught up. A handler task is
+        /// only submitted when this goes from zero to one, so at most one is active at a time.
+        std::atomic<unsigned int> scheduled_{0};
+
+        /// \brief Held while the shard is handled. Only contended when the conductor is destructed.
+        std::mutex mutex_;
+    };
+
     std::shared_ptr<spdlog::logger> logger_;
 
-    uint64_t next_id_;
+    std::atomic<uint64_t> next_id_;
 
     std::atomic<bool> server_failed_;
     std::atomic<bool> signal_received_;
+    /// \brief Set once the stop callbacks have been executed.
+    std::atomic<bool> stopped_;
+
+    std::vector<stop_callback> on_stop_;
 
     std::shared_ptr<api_wrapper> api_;
 
+#ifdef WPWRAPPER_POSIX
+    /// \brief Runs the read and write pipelines of all workers.
+    std::shared_ptr<reactor> reactor_;
+
+    /// \brief The control group below which sertop instances are started. Empty if they are not.
+    std::string cgroup_root_;
+
+    /// \brief The number of control groups created for sertop instances so far.
+    std::atomic<uint64_t> next_cgroup_;
+
+    /// \brief Decides on which core every sertop instance runs. Empty if sertop instances run on any core.
+    std::unique_ptr<placement> placement_;
+#endif
+
     std::unique_ptr<server> server_;
-    std::map<unsigned int, std::unique_ptr<worker>> workers_;
 
-    std::queue<request> in_queue_;
-    std::queue<response> out_queue_;
+    /// \brief All shards. An instance belongs to the shard given by the slot index of its id.
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    /// \brief Executes the shards, and decodes requests for the server.
+    std::shared_ptr<executor> executor_;
+
+    /// \brief Creates and tears down workers. Forking sertop and waiting for it to shut down block, so this happens on
+    /// separate threads, which cannot stall the shards.
+    std::unique_ptr<executor> provisioner_;
+
+    /// \brief How often the memory usage of workers with memory limits is sampled. Zero if it never is.
+    std::chrono::seconds memory_interval_;
+
+    /// \brief The priority of workers without outstanding interactive requests. Empty if priorities are left alone.
+    std::optional<worker::priority> background_priority_;
+
+    /// \brief How long a worker may be idle before it hibernates. Zero if workers never hibernate.
+    std::chrono::seconds hibernate_after_;
+
+    /// \brief Whether workers whose sertop instance fails are recovered.
+    bool recover_;
+
+    /// \brief How many hinted commands may run ahead of the user. Zero if hints are ignored.
+    unsigned int speculate_ahead_;
+
+    /// \brief Unparked whenever a shard handler catches up, so that settle() and release() wait for the shards without
+    /// polling.
+    parker caught_up_;
+
+    /// \brief Returns the shard that owns an instance.
+    /// \param instance_id The instance.
+    /// \return The shard that owns the instance.
+    shard& shard_of(unsigned int instance_id) noexcept;
+
+    /// \brief Makes sure the shard is handled after something was pushed to one of its queues.
+    /// \param s The shard.
+    void schedule(shard& s);
+
+    /// \brief Handles the queues of a shard until they are empty. Executed as a task on the executor.
+    /// \param s The shard.
+    void run(shard& s);
 
-    std::thread run_thread_;
+    /// \brief Waits until no shard is scheduled anymore. Parks in between, until a shard handler catches up.
+    /// \note Only returns if nothing keeps pushing to the shards' queues.
+    void settle();
 
-    mutable std::mutex queue_m_;
-    std::condition_variable queue_cv_;
+    /// \brief Stops the conductor and executes the stop callbacks, if that has not happened yet.
+    void stop();
 
-    void run();
+    /// \brief Tracks the responses of a shard, and hands them to the server.
+    /// \param s The shard.
+    void flush(shard& s);
 
-    void handle_request(const wpwrapper::request& request);
+    void handle_request(shard& s, wpwrapper::request request);
 
-    void handle_response(unsigned int instance_id, const std::string& response);
+    void handle_event(shard& s, event& event);
+
+    /// \brief Parses the create options and starts a worker. Executed on the provisioning executor.
+    /// \param instance_id The instance to create a worker for.
+    /// \param options The content of the create request.
+    /// \param sidecar Set if the worker is the sidecar of the instance. It is not placed on a core of its own.
+    void provision(unsigned int instance_id, const std::string& options, bool sidecar = false);
+
+    /// \brief Destructs a worker on the provisioning executor, as waiting for sertop to shut down may take a while.
+    /// \details The core of the worker is freed right away, which may move another worker to it.
+    /// \param w The worker to destruct.
+    void retire(std::unique_ptr<worker> w);
+
+    void post(event event);
+
+    /// \brief Stores the create options of an instance, together with the deadline and limits that they set.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    /// \param options The create options.
+    void configure(unsigned int instance_id, instance& i, std::string options);
+
+    /// \brief Starts a timer on the shard of the instance that it applies to.
+    /// \param t What the timer is for.
+    /// \param delay How long from now the timer expires.
+    /// \return The handle of the timer.
+    timer_wheel<timer>::handle start_timer(const timer& t, std::chrono::milliseconds delay);
+
+    /// \brief Cancels the timers of all deadlines of an instance, its memory sampler and its idle timer.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void cancel_timers(unsigned int instance_id, instance& i);
+
+    /// \brief Handles the timers of a shard that have expired.
+    /// \param s The shard.
+    void expire(shard& s);
+
+    /// \brief Makes sure the shard is handled again when its next timer expires.
+    /// \param s The shard.
+    void arm(shard& s);
+
+    /// \brief Starts sampling the memory usage of the worker of an instance, if it has memory limits.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void watch_memory(unsigned int instance_id, instance& i);
+
+    /// \brief Samples the memory usage of the worker of an instance, and warns Waterproof or recycles the worker if it
+    /// exceeds the limits.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void check_memory(unsigned int instance_id, instance& i);
+
+    /// \brief Gives the worker of an instance interactive priority while one of the requests that a user waits for is
+    /// outstanding, and background priority otherwise.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void prioritize(unsigned int instance_id, instance& i);
+
+    /// \brief Starts the timer after which the worker of an instance hibernates, if hibernation is enabled and the
+    /// worker is idle.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void watch_idle(unsigned int instance_id, instance& i);
+
+    /// \brief Shuts down the worker of an instance that has been idle for long enough, and keeps its journal.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must have a worker.
+    void hibernate(unsigned int instance_id, instance& i);
+
+    /// \brief Starts a new sidecar for an instance that asks for one, in place of the one it has. The journal of the
+    /// instance is mirrored to it first, so without a journal it starts from scratch.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void start_sidecar(unsigned int instance_id, instance& i);
+
+    /// \brief Retires the sidecar of an instance, if it has one. The queries that it did not answer fail.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    /// \param reason Why the sidecar is retired, which is sent to Waterproof for every query that fails.
+    void stop_sidecar(unsigned int instance_id, instance& i, std::string_view reason);
+
+    /// \brief Gives the sidecar of an instance interactive priority while it answers a query, and background priority
+    /// otherwise.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must have a sidecar.
+    void prioritize_sidecar(unsigned int instance_id, instance& i);
+
+    /// \brief Journals a forward request that may change the state of sertop, and mirrors it to the sidecar, before
+    /// it is sent to sertop.
+    /// \param i The instance.
+    /// \param command The content of the forward request.
+    /// \param forward The number of the forward request.
+    void journal_forward(instance& i, const std::string& command, uint64_t forward);
+
+    /// \brief Replaces the hint of an instance. The guesses that the new hint starts with are kept, the others are
+    /// cancelled.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    /// \param commands The commands that Waterproof expects to forward next, in order.
+    void hint(unsigned int instance_id, instance& i, std::vector<std::string> commands);
+
+    /// \brief Decides what becomes of a forward request of an instance that Waterproof sent a hint to, and answers
+    /// or holds it back if it does not go to sertop as usual.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must have a speculation.
+    /// \param command The content of the forward request.
+    /// \param forward The number of the forward request.
+    /// \return What becomes of the forward request.
+    verdict foresee(unsigned int instance_id, instance& i, const std::string& command, uint64_t forward);
+
+    /// \brief Interrupts the guess that the worker of an instance runs, once it is doomed.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void interrupt_guess(unsigned int instance_id, instance& i);
+
+    /// \brief Takes the next step of the speculation of an instance, if sertop is not running a guess or a Cancel
+    /// command: cancels doomed guesses, sends held forward requests, or runs the next hinted command.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void speculate(unsigned int instance_id, instance& i);
+
+    /// \brief Keeps the output of a guess or a Cancel command, which is not sent to Waterproof.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must be guessing.
+    /// \param r A response read from sertop.
+    void record(unsigned int instance_id, instance& i, const response& r);
+
+    /// \brief Checks whether sertop is running a guess or a Cancel command for an instance.
+    /// \param i The instance.
+    /// \return \c true if it is. The output of sertop then does not answer a forward request.
+    static bool guessing(const instance& i) noexcept;
+
+    /// \brief Starts a new worker for a hibernating instance, which replays the journal once it is ready.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must be hibernating.
+    void resume(unsigned int instance_id, instance& i);
+
+    /// \brief Returns whether the commands that change the state of sertop are journaled.
+    /// \return \c true if hibernation or recovery is enabled.
+    bool journaling() const noexcept;
+
+    /// \brief Replaces the worker of an instance whose sertop instance failed by a new one, which replays the commands
+    /// that completed before the failure.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must have a worker.
+    /// \param error The error that the worker failed with.
+    void recover(unsigned int instance_id, instance& i, std::string error);
+
+    /// \brief Copies what a new instance needs to be cloned from an instance, and hands it to the new instance.
+    /// \param instance_id The instance to clone from.
+    /// \param i The instance to clone from. Null if it does not exist.
+    /// \param clone_id The new instance.
+    void lend(unsigned int instance_id, instance* i, unsigned int clone_id);
+
+    /// \brief Tells Waterproof that an instance recovered or was cloned, once its new sertop instance replayed the
+    /// journal.
+    /// \param instance_id The instance.
+    /// \param i The instance.
+    void finish_replay(unsigned int instance_id, instance& i);
+
+    /// \brief Replaces the worker of an instance by a new one that is created with the same options. Waterproof learns
+    /// about the new worker from the create response.
+    /// \param instance_id The instance.
+    /// \param i The instance. Must have a worker.
+    void recycle(unsigned int instance_id, instance& i);
+
+    /// \brief Takes the next escalation step for a forward request that did not complete before its deadline.
+    /// \details The first step reports the timeout to Waterproof, the second interrupts sertop, and the last one
+    /// replaces the worker by a new one that is created with the same options.
+    /// \param instance_id The instance.
+    /// \param target The instance.
+    /// \param d The deadline.
+    void escalate(unsigned int instance_id, instance& target, deadline d);
+
+    /// \brief Keeps track of the forward requests that sertop reports completed, and cancels their deadlines. Also
+    /// records and checks the state ids that sertop assigns, and drops the output of replayed commands.
+    /// \param s The shard that owns the instance.
+    /// \param r A response read from sertop.
+    /// \return \c false if the response answers a replayed command, and should not be sent to Waterproof.
+    bool track(shard& s, const response& r);
+
+    /// \brief Keeps track of the commands that the sidecar of an instance reports completed.
+    /// \param s The shard that owns the instance.
+    /// \param r A response read from the sidecar.
+    /// \return \c false if the response answers a mirrored command, and should not be sent to Waterproof.
+    bool track_sidecar(shard& s, const response& r);
+
+    void handle_response(unsigned int instance_id, std::string_view response);
+
+    void handle_sidecar_response(unsigned int instance_id, std::string_view response);
 
     void handle_worker_failure(unsigned int instance_id, const api_error& error);
 
+    void handle_sidecar_failure(unsigned int instance_id, const api_error& error);
+
     response create_empty_response(unsigned int instance_id, int priority = 0,
                                    wpwrapper::response::status status = wpwrapper::response::status::success);
 };
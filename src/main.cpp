@@ -14,10 +14,22 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
 #include <spdlog/spdlog.h>
 #include <spdlog/sinks/stdout_color_sinks.h>
 #include <spdlog/sinks/rotating_file_sink.h>
 
+#include <nlohmann/json.hpp>
+
 #include "conductor.h"
 #include "utils/config.h"
 
@@ -27,7 +39,57 @@
 
 #elif WPWRAPPER_POSIX
 
+#include <cerrno>
+#include <climits>
 #include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+#include "posix/handoff.h"
+
+#endif
+
+// Followed by the number of seconds that the workers of a disconnected client wait to be reattached.
+const std::string grace_period_option = "--grace-period=";
+
+// Followed by the number of seconds between two samples of the memory usage of a worker with memory limits.
+const std::string memory_interval_option = "--memory-interval=";
+
+// How often the memory usage of workers is sampled by default. Reading it is cheap, but limits need not be exact.
+constexpr std::chrono::seconds default_memory_interval(5);
+
+// Followed by "background" or "idle", the priority of workers that no user waits for.
+const std::string boost_option = "--boost=";
+
+// Followed by the number of seconds after which an idle sertop instance is shut down until it is needed again.
+const std::string hibernate_after_option = "--hibernate-after=";
+
+// Replaces a sertop instance that fails by a new one in the same state.
+const std::string recover_option = "--recover";
+
+// Followed by the number of hinted commands that a sertop instance may run ahead of the user.
+const std::string speculate_option = "--speculate=";
+
+#ifdef WPWRAPPER_POSIX
+
+// Followed by the path of a delegated cgroup v2 control group, below which sertop instances are started.
+const std::string cgroup_option = "--cgroup=";
+
+// Followed by the number of cores to keep the threads of the wrapper on, away from sertop instances.
+const std::string reserve_cores_option = "--reserve-cores=";
+
+// How long a new wrapper process may take to start, and to take over once it has everything.
+constexpr std::chrono::seconds handoff_timeout(10);
+
+// Set by SIGUSR2, when this process should hand everything over to a new wrapper process.
+volatile std::sig_atomic_t upgrade_requested = 0;
 
 #endif
 
@@ -37,6 +99,14 @@ volatile std::atomic_flag keep_running = ATOMIC_FLAG_INIT;
 
 #ifdef WPWRAPPER_WIN
 
+// Set when the main thread should stop waiting.
+HANDLE stop_event = nullptr;
+
+void request_stop()
+{
+    SetEvent(stop_event);
+}
+
 BOOL WINAPI console_handler(DWORD signal)
 {
 
@@ -45,6 +115,7 @@ BOOL WINAPI console_handler(DWORD signal)
     case CTRL_C_EVENT:
     case CTRL_CLOSE_EVENT:
         keep_running.clear();
+        request_stop();
         return TRUE;
     default:
         break;
@@ -53,22 +124,56 @@ BOOL WINAPI console_handler(DWORD signal)
     return FALSE;
 }
 
+void wait_for_stop()
+{
+    WaitForSingleObject(stop_event, INFINITE);
+}
+
 #elif WPWRAPPER_POSIX
 
+// Self-pipe: written to when the main thread should stop waiting. Writing to a pipe is async-signal-safe.
+int stop_pipe[2] = {-1, -1};
+
+void request_stop()
+{
+    int saved_errno = errno;
+    char c = '\x01';
+    while (write(stop_pipe[1], &c, 1) < 0 && errno == EINTR)
+    {
+    }
+    errno = saved_errno;
+}
+
 extern "C" void signal_handler(int signum)
 {
     keep_running.clear();
+    request_stop();
+}
+
+extern "C" void upgrade_handler(int signum)
+{
+    upgrade_requested = 1;
+    request_stop();
+}
+
+void wait_for_stop()
+{
+    char c;
+    while (read(stop_pipe[0], &c, 1) < 0 && errno == EINTR)
+    {
+    }
 }
 
 #endif
 
-void configure_logger()
+void configure_logger(bool rotate)
 {
     auto console_sink = std::make_shared<spdlog::sinks::stdout_color_sink_mt>();
     console_sink->set_level(spdlog::level::debug);
     console_sink->set_pattern("[%^%8l%$] %n: %v");
 
-    auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>("wpwrapper.log", 5 * 1024 * 1024, 5, true);
+    auto file_sink = std::make_shared<spdlog::sinks::rotating_file_sink_mt>("wpwrapper.log", 5 * 1024 * 1024, 5,
+            rotate);
     file_sink->set_level(spdlog::level::trace);
 
     std::vector<spdlog::sink_ptr> sinks{console_sink, file_sink};
@@ -80,14 +185,149 @@ void configure_logger()
     spdlog::register_logger(logger);
 }
 
+#ifdef WPWRAPPER_POSIX
+
+/// \brief Returns the absolute path of the binary of this process.
+/// \details Resolved once at startup: \c argv[0] may be a bare name that was looked up in \c PATH, or relative to a
+/// working directory that has changed since. An upgrade starts whatever binary is installed at this path by then.
+/// \param argv0 The first argument of this process. Returned if the path cannot be determined otherwise.
+/// \return The path of the binary.
+std::string executable_path(const char* argv0)
+{
+#ifdef __linux__
+    char path[PATH_MAX];
+    ssize_t length = readlink("/proc/self/exe", path, sizeof path - 1);
+    if (length > 0)
+    {
+        return std::string(path, length);
+    }
+#elif defined(__APPLE__)
+    char path[PATH_MAX];
+    uint32_t size = sizeof path;
+    char resolved[PATH_MAX];
+    if (_NSGetExecutablePath(path, &size) == 0 && realpath(path, resolved) != nullptr)
+    {
+        return resolved;
+    }
+#endif
+
+    return argv0;
+}
+
+/// \brief Starts a new wrapper process from the same path and with the same arguments, and hands all instances and
+/// connections over to it.
+/// \details If the new process fails to start, nothing changes. If it fails to take over, it is killed, and this
+/// process takes everything back.
+/// \param conductor The running conductor. Replaced by a new one if everything is taken back.
+/// \param start Constructs a conductor that takes over a snapshot.
+/// \param path The path of the binary of this process, from executable_path().
+/// \param argc The number of arguments of this process.
+/// \param argv The arguments of this process.
+/// \return \c true if the new process took over, \c false if this process keeps running.
+bool upgrade(std::optional<wpwrapper::conductor>& conductor,
+        const std::function<void(wpwrapper::conductor::snapshot)>& start, const std::string& path, int argc,
+        char** argv)
+{
+    auto logger = spdlog::get("main");
+    auto api = std::make_shared<wpwrapper::api_wrapper>();
+
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::string(argv[i]).rfind(wpwrapper::handoff::adopt_option, 0) != 0)
+        {
+            args.emplace_back(argv[i]);
+        }
+    }
+
+    wpwrapper::handoff::successor next{};
+    try
+    {
+        next = wpwrapper::handoff::spawn(api, path, args, handoff_timeout);
+    }
+    catch (const wpwrapper::api_error& e)
+    {
+        logger->error("unable to start new wrapper process: {}", e.what());
+        return false;
+    }
+
+    logger->info("handing over to process {}", next.pid_);
+    wpwrapper::conductor::snapshot state = conductor->release();
+
+    try
+    {
+        wpwrapper::handoff::send(api, next.channel_, state.encode(), state.files());
+        wpwrapper::handoff::wait(api, next.channel_, handoff_timeout);
+        api->close(next.channel_);
+        return true;
+    }
+    catch (const wpwrapper::api_error& e)
+    {
+        logger->error("process {} did not take over, taking everything back: {}", next.pid_, e.what());
+    }
+
+    // Killing the new process makes sure it does not touch anything anymore, without running its destructors.
+    api->kill(next.pid_, SIGKILL);
+    api->waitpid(next.pid_, nullptr, 0);
+    api->close(next.channel_);
+
+    // The released conductor closes its copies of the file descriptors.
+    std::vector<int> copies;
+    for (int fd: state.files())
+    {
+        copies.push_back(api->fcntl(fd, F_DUPFD_CLOEXEC, 0));
+    }
+    state.rebind(copies);
+
+    conductor.reset();
+    start(std::move(state));
+    return false;
+}
+
+/// \brief Receives the instances and connections from the wrapper process that started this one.
+/// \param channel This process's end of the handoff channel.
+/// \return Everything that is needed to take over.
+/// \throw api_error If the snapshot could not be received.
+/// \throw nlohmann::json::exception If the snapshot is invalid.
+wpwrapper::conductor::snapshot take_over(int channel)
+{
+    auto api = std::make_shared<wpwrapper::api_wrapper>();
+
+    // Tell the old process that we are up and running.
+    wpwrapper::handoff::notify(api, channel);
+
+    auto [encoded, files] = wpwrapper::handoff::receive(api, channel);
+    wpwrapper::conductor::snapshot state = wpwrapper::conductor::snapshot::decode(encoded);
+    state.rebind(files);
+
+    return state;
+}
+
+#endif
+
 int main(int argc, char** argv)
 {
 #ifdef WPWRAPPER_WIN
 
+    stop_event = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+    if (stop_event == nullptr)
+    {
+        return static_cast<int>(GetLastError());
+    }
+
     SetConsoleCtrlHandler(console_handler, TRUE);
 
 #elif WPWRAPPER_POSIX
 
+    if (pipe(stop_pipe) < 0)
+    {
+        return errno;
+    }
+
+    // The wrapper should not leak these into sertop instances.
+    fcntl(stop_pipe[0], F_SETFD, FD_CLOEXEC);
+    fcntl(stop_pipe[1], F_SETFD, FD_CLOEXEC);
+
     struct sigaction action{};
     memset(&action, 0, sizeof action);
     action.sa_handler = signal_handler;
@@ -95,11 +335,37 @@ int main(int argc, char** argv)
     sigaction(SIGINT, &action, nullptr);
     sigaction(SIGTERM, &action, nullptr);
 
+    struct sigaction upgrade_action{};
+    memset(&upgrade_action, 0, sizeof upgrade_action);
+    upgrade_action.sa_handler = upgrade_handler;
+
+    sigaction(SIGUSR2, &upgrade_action, nullptr);
+
+    // Before anything can change the working directory.
+    const std::string self = executable_path(argv[0]);
+
+    // Set if this process was started to take over from another wrapper process.
+    int adopt_channel = -1;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument(argv[i]);
+        if (argument.rfind(wpwrapper::handoff::adopt_option, 0) == 0)
+        {
+            adopt_channel = std::atoi(argument.substr(wpwrapper::handoff::adopt_option.length()).c_str());
+            fcntl(adopt_channel, F_SETFD, FD_CLOEXEC);
+        }
+    }
+
 #endif
 
     try
     {
-        configure_logger();
+#ifdef WPWRAPPER_POSIX
+        // The process that is being taken over is still writing to the same log.
+        configure_logger(adopt_channel < 0);
+#else
+        configure_logger(true);
+#endif
     }
     catch (const spdlog::spdlog_ex& e)
     {
@@ -107,31 +373,180 @@ int main(int argc, char** argv)
 
     spdlog::get("main")->info("Started wpwrapper with {} arguments", argc - 1);
 
+    // Every optional feature is off unless enabled below.
+    wpwrapper::conductor::settings settings;
+    // Reading it is cheap, so memory limits are enforced unless disabled.
+    settings.memory_interval_ = default_memory_interval;
+
+    // What to do with the value of each option. Options that end in '=' take a value, the others must match exactly.
+    std::vector<std::pair<std::string, std::function<void(const std::string&)>>> options{
+        {grace_period_option, [&](const std::string& value)
+        {
+            settings.grace_period_ = std::chrono::seconds(std::stoul(value));
+        }},
+        {memory_interval_option, [&](const std::string& value)
+        {
+            settings.memory_interval_ = std::chrono::seconds(std::stoul(value));
+        }},
+        {hibernate_after_option, [&](const std::string& value)
+        {
+            settings.hibernate_after_ = std::chrono::seconds(std::stoul(value));
+        }},
+        {recover_option, [&](const std::string&)
+        {
+            settings.recover_ = true;
+        }},
+        {speculate_option, [&](const std::string& value)
+        {
+            settings.speculate_ahead_ = std::stoul(value);
+        }},
+        {boost_option, [&](const std::string& value)
+        {
+            if (value == "background")
+            {
+                settings.background_priority_ = wpwrapper::worker::priority::background;
+            }
+            else if (value == "idle")
+            {
+                settings.background_priority_ = wpwrapper::worker::priority::idle;
+            }
+            else
+            {
+                throw std::invalid_argument(value);
+            }
+        }},
+    };
+
+#ifdef WPWRAPPER_POSIX
+    options.emplace_back(wpwrapper::handoff::adopt_option, [](const std::string&)
+    {
+        // Handled above.
+    });
+    options.emplace_back(cgroup_option, [&](const std::string& value)
+    {
+        settings.cgroup_root_ = value;
+    });
+    options.emplace_back(reserve_cores_option, [&](const std::string& value)
+    {
+        settings.reserved_cores_ = std::stoul(value);
+    });
+#endif
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string argument(argv[i]);
+        auto option = std::find_if(options.begin(), options.end(), [&](const auto& o)
+        {
+            return o.first.back() == '=' ? argument.rfind(o.first, 0) == 0 : argument == o.first;
+        });
+
+        if (option == options.end())
+        {
+            spdlog::get("main")->warn("ignoring unknown argument {}", argument);
+            continue;
+        }
+
+        try
+        {
+            option->second(argument.substr(option->first.back() == '=' ? option->first.length() : argument.length()));
+        }
+        catch (const std::exception& e)
+        {
+            spdlog::get("main")->warn("ignoring invalid argument {}", argument);
+        }
+    }
+
     keep_running.test_and_set();
 
     std::optional<wpwrapper::conductor> conductor;
 
+#ifdef WPWRAPPER_POSIX
+    // The conductor stops by itself when the server fails or when Waterproof sends a stop request.
+    auto start = [&](std::optional<wpwrapper::conductor::snapshot> adopted)
+    {
+        conductor.emplace(std::vector<wpwrapper::conductor::stop_callback>{request_stop}, settings,
+                std::move(adopted));
+    };
+
     try
     {
-        conductor.emplace();
+        std::optional<wpwrapper::conductor::snapshot> adopted;
+        if (adopt_channel >= 0)
+        {
+            adopted = take_over(adopt_channel);
+        }
+
+        start(std::move(adopted));
+
+        if (adopt_channel >= 0)
+        {
+            // From now on, the old process can exit.
+            wpwrapper::handoff::notify(std::make_shared<wpwrapper::api_wrapper>(), adopt_channel);
+            close(adopt_channel);
+        }
     }
     catch (const wpwrapper::api_error& e)
     {
         return e.error_number_;
     }
+    catch (const nlohmann::json::exception& e)
+    {
+        spdlog::get("main")->error("unable to take over: {}", e.what());
+        return EINVAL;
+    }
 
-    while (keep_running.test_and_set() && !conductor->has_failed())
+    // Block until a signal is received or the conductor stops. Nothing wakes up periodically. An upgrade request
+    // wakes us up too; if it fails, keep waiting.
+    while (true)
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        wait_for_stop();
+
+        if (upgrade_requested && keep_running.test() && !conductor->has_failed())
+        {
+            upgrade_requested = 0;
+            try
+            {
+                if (upgrade(conductor, start, self, argc, argv))
+                {
+                    spdlog::get("main")->info("handed over, exiting...");
+                    return 0;
+                }
+            }
+            catch (const wpwrapper::api_error& e)
+            {
+                // Everything was released, but could not be taken back.
+                return e.error_number_;
+            }
+            continue;
+        }
+
+        if (!keep_running.test() || conductor->has_failed())
+        {
+            break;
+        }
+    }
+#else
+    try
+    {
+        // The conductor stops by itself when the server fails or when Waterproof sends a stop request.
+        conductor.emplace(std::vector<wpwrapper::conductor::stop_callback>{request_stop}, settings);
+    }
+    catch (const wpwrapper::api_error& e)
+    {
+        return e.error_number_;
     }
 
-    conductor->notify();
+    // Block until a signal is received or the conductor stops. Nothing wakes up periodically.
+    wait_for_stop();
+#endif
 
-    if (!conductor->has_failed())
+    if (!keep_running.test_and_set())
     {
         spdlog::get("main")->info("received SIGINT/SIGTERM");
     }
 
+    conductor->notify();
+
     spdlog::get("main")->info("Exiting...");
 
     return 0;
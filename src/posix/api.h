@@ -19,9 +19,13 @@
 
 #include <poll.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <signal.h>
@@ -46,6 +50,10 @@ public:
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/close.2.html
     virtual int close(int fd) const noexcept = 0;
 
+    /// \brief Closes a range of file descriptors at once. Fails with ENOSYS on macOS and on kernels before 5.9.
+    /// \see https://manpages.ubuntu.com/manpages/jammy/en/man2/close_range.2.html
+    virtual int close_range(unsigned int first, unsigned int last, int flags) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/dup2.2.html
     virtual int dup2(int oldfd, int newfd) const noexcept = 0;
 
@@ -58,6 +66,10 @@ public:
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/ioctl.2.html
     virtual int ioctl(int fd, unsigned long request, void* argp) const noexcept = 0;
 
+    /// \brief Sets the I/O scheduling class and priority of a process. Fails with ENOSYS on macOS.
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/ioprio_set.2.html
+    virtual int ioprio_set(int which, int who, int ioprio) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/listen.2.html
     virtual int listen(int sockfd, int backlog) const noexcept = 0;
 
@@ -74,6 +86,21 @@ public:
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/kill.2.html
     virtual int kill(pid_t pid, int sig) const noexcept = 0;
 
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/mkdir.2.html
+    virtual int mkdir(const char* pathname, mode_t mode) const noexcept = 0;
+
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/open.2.html
+    virtual int open(const char* pathname, int flags) const noexcept = 0;
+
+    /// \brief Opens a file descriptor that refers to a process. Fails with ENOSYS on macOS and on kernels before 5.3.
+    /// \see https://manpages.ubuntu.com/manpages/jammy/en/man2/pidfd_open.2.html
+    virtual int pidfd_open(pid_t pid, unsigned int flags) const noexcept = 0;
+
+    /// \brief Sends a signal to the process that a file descriptor from pidfd_open() refers to. Fails with ENOSYS on
+    /// macOS.
+    /// \see https://manpages.ubuntu.com/manpages/jammy/en/man2/pidfd_send_signal.2.html
+    virtual int pidfd_send_signal(int pidfd, int sig, siginfo_t* info, unsigned int flags) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/pipe.2.html
     virtual int pipe(int pipefd[2]) const noexcept = 0;
 
@@ -86,13 +113,34 @@ public:
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/recv.2.html
     virtual ssize_t recv(int sockfd, void* buf, size_t len, int flags) const noexcept = 0;
 
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/recvmsg.2.html
+    virtual ssize_t recvmsg(int sockfd, struct msghdr* msg, int flags) const noexcept = 0;
+
+#ifdef __linux__
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/sched_getaffinity.2.html
+    virtual int sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t* mask) const noexcept = 0;
+
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/sched_setaffinity.2.html
+    virtual int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t* mask) const noexcept = 0;
+#endif
+
+    /// \brief Sets the scheduling policy of a thread. Fails with ENOSYS on macOS.
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/sched_setscheduler.2.html
+    virtual int sched_setscheduler(pid_t pid, int policy, const struct sched_param* param) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/select.2.html
     virtual int
     select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds, struct timeval* timeout) const noexcept = 0;
 
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/rmdir.2.html
+    virtual int rmdir(const char* pathname) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/send.2.html
     virtual ssize_t send(int sockfd, const void* buf, size_t len, int flags) const noexcept = 0;
 
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/sendmsg.2.html
+    virtual ssize_t sendmsg(int sockfd, const struct msghdr* msg, int flags) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/setsockopt.2.html
     virtual int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t optlen) const noexcept = 0;
 
@@ -102,6 +150,9 @@ public:
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/socket.2.html
     virtual int socket(int domain, int type, int protocol) const noexcept = 0;
 
+    /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/socketpair.2.html
+    virtual int socketpair(int domain, int type, int protocol, int sv[2]) const noexcept = 0;
+
     /// \see https://manpages.ubuntu.com/manpages/disco/en/man2/waitpid.2.html
     virtual pid_t waitpid(pid_t pid, int* wstatus, int options) const noexcept = 0;
 
@@ -16,6 +16,14 @@
 
 #include "api_wrapper.h"
 
+#include <cerrno>
+
+#ifdef __linux__
+
+#include <sys/syscall.h>
+
+#endif
+
 namespace wpwrapper {
 
 int api_wrapper::accept(int sockfd, struct sockaddr* addr, socklen_t* addrlen) const noexcept
@@ -38,6 +46,17 @@ int api_wrapper::close(int fd) const noexcept
     return ::close(fd);
 }
 
+int api_wrapper::close_range(unsigned int first, unsigned int last, int flags) const noexcept
+{
+#if defined(__linux__) && defined(SYS_close_range)
+    // Older C libraries have no wrapper.
+    return static_cast<int>(::syscall(SYS_close_range, first, last, flags));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int api_wrapper::dup2(int oldfd, int newfd) const noexcept
 {
     return ::dup2(oldfd, newfd);
@@ -74,6 +93,17 @@ int api_wrapper::ioctl(int fd, unsigned long request, void* argp) const noexcept
     return ::ioctl(fd, request, argp);
 }
 
+int api_wrapper::ioprio_set(int which, int who, int ioprio) const noexcept
+{
+#ifdef __linux__
+    // The C library has no wrapper.
+    return static_cast<int>(::syscall(SYS_ioprio_set, which, who, ioprio));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int api_wrapper::listen(int sockfd, int backlog) const noexcept
 {
     return ::listen(sockfd, backlog);
@@ -84,6 +114,38 @@ int api_wrapper::kill(pid_t pid, int sig) const noexcept
     return ::kill(pid, sig);
 }
 
+int api_wrapper::mkdir(const char* pathname, mode_t mode) const noexcept
+{
+    return ::mkdir(pathname, mode);
+}
+
+int api_wrapper::open(const char* pathname, int flags) const noexcept
+{
+    return ::open(pathname, flags);
+}
+
+int api_wrapper::pidfd_open(pid_t pid, unsigned int flags) const noexcept
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+    // Older C libraries have no wrapper.
+    return static_cast<int>(::syscall(SYS_pidfd_open, pid, flags));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+int api_wrapper::pidfd_send_signal(int pidfd, int sig, siginfo_t* info, unsigned int flags) const noexcept
+{
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+    // Older C libraries have no wrapper.
+    return static_cast<int>(::syscall(SYS_pidfd_send_signal, pidfd, sig, info, flags));
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int api_wrapper::pipe(int pipefd[2]) const noexcept
 {
     return ::pipe(pipefd);
@@ -104,17 +166,54 @@ ssize_t api_wrapper::recv(int sockfd, void* buf, size_t len, int flags) const no
     return ::recv(sockfd, buf, len, flags);
 }
 
+ssize_t api_wrapper::recvmsg(int sockfd, struct msghdr* msg, int flags) const noexcept
+{
+    return ::recvmsg(sockfd, msg, flags);
+}
+
+#ifdef __linux__
+int api_wrapper::sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t* mask) const noexcept
+{
+    return ::sched_getaffinity(pid, cpusetsize, mask);
+}
+
+int api_wrapper::sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t* mask) const noexcept
+{
+    return ::sched_setaffinity(pid, cpusetsize, mask);
+}
+#endif
+
+int api_wrapper::sched_setscheduler(pid_t pid, int policy, const struct sched_param* param) const noexcept
+{
+#ifdef __linux__
+    return ::sched_setscheduler(pid, policy, param);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
 int api_wrapper::select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds,
         struct timeval* timeout) const noexcept
 {
     return ::select(nfds, readfds, writefds, exceptfds, timeout);
 }
 
+int api_wrapper::rmdir(const char* pathname) const noexcept
+{
+    return ::rmdir(pathname);
+}
+
 ssize_t api_wrapper::send(int sockfd, const void* buf, size_t len, int flags) const noexcept
 {
     return ::send(sockfd, buf, len, flags);
 }
 
+ssize_t api_wrapper::sendmsg(int sockfd, const struct msghdr* msg, int flags) const noexcept
+{
+    return ::sendmsg(sockfd, msg, flags);
+}
+
 int api_wrapper::setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t optlen) const noexcept
 {
     return ::setsockopt(sockfd, level, optname, optval, optlen);
@@ -130,6 +229,11 @@ int api_wrapper::socket(int domain, int type, int protocol) const noexcept
     return ::socket(domain, type, protocol);
 }
 
+int api_wrapper::socketpair(int domain, int type, int protocol, int sv[2]) const noexcept
+{
+    return ::socketpair(domain, type, protocol, sv);
+}
+
 pid_t api_wrapper::waitpid(pid_t pid, int* wstatus, int options) const noexcept
 {
     return ::waitpid(pid, wstatus, options);
@@ -32,6 +32,8 @@ public:
 
     int close(int fd) const noexcept override;
 
+    int close_range(unsigned int first, unsigned int last, int flags) const noexcept override;
+
     int dup2(int oldfd, int newfd) const noexcept override;
 
     int execv(const char* path, char* const argv[]) const noexcept override;
@@ -47,10 +49,20 @@ public:
 
     int ioctl(int fd, unsigned long request, void* argp) const noexcept override;
 
+    int ioprio_set(int which, int who, int ioprio) const noexcept override;
+
     int listen(int sockfd, int backlog) const noexcept override;
 
     int kill(pid_t pid, int sig) const noexcept override;
 
+    int mkdir(const char* pathname, mode_t mode) const noexcept override;
+
+    int open(const char* pathname, int flags) const noexcept override;
+
+    int pidfd_open(pid_t pid, unsigned int flags) const noexcept override;
+
+    int pidfd_send_signal(int pidfd, int sig, siginfo_t* info, unsigned int flags) const noexcept override;
+
     int pipe(int pipefd[2]) const noexcept override;
 
     int poll(struct pollfd* fds, nfds_t nfds, int timeout) const noexcept override;
@@ -59,17 +71,33 @@ public:
 
     ssize_t recv(int sockfd, void* buf, size_t len, int flags) const noexcept override;
 
+    ssize_t recvmsg(int sockfd, struct msghdr* msg, int flags) const noexcept override;
+
+#ifdef __linux__
+    int sched_getaffinity(pid_t pid, size_t cpusetsize, cpu_set_t* mask) const noexcept override;
+
+    int sched_setaffinity(pid_t pid, size_t cpusetsize, const cpu_set_t* mask) const noexcept override;
+#endif
+
+    int sched_setscheduler(pid_t pid, int policy, const struct sched_param* param) const noexcept override;
+
     int select(int nfds, fd_set* readfds, fd_set* writefds, fd_set* exceptfds,
             struct timeval* timeout) const noexcept override;
 
+    int rmdir(const char* pathname) const noexcept override;
+
     ssize_t send(int sockfd, const void* buf, size_t len, int flags) const noexcept override;
 
+    ssize_t sendmsg(int sockfd, const struct msghdr* msg, int flags) const noexcept override;
+
     int setsockopt(int sockfd, int level, int optname, const void* optval, socklen_t optlen) const noexcept override;
 
     int shutdown(int sockfd, int how) const noexcept override;
 
     int socket(int domain, int type, int protocol) const noexcept override;
 
+    int socketpair(int domain, int type, int protocol, int sv[2]) const noexcept override;
+
     pid_t waitpid(pid_t pid, int* wstatus, int options) const noexcept override;
 
     ssize_t write(int fd, const void* buf, size_t count) const noexcept override;
@@ -0,0 +1,216 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "cgroup.h"
+
+#include <cerrno>
+#include <sstream>
+#include <utility>
+
+#include "../utils/exceptions.h"
+
+namespace wpwrapper {
+
+cgroup::cgroup(std::shared_ptr<wpwrapper::api> api_instance, const std::string& parent, const std::string& name,
+        const wpwrapper::cgroup::limits& l)
+        :api_(std::move(api_instance)), path_(parent + "/" + name), procs_fd_(-1), released_(false), removed_(false)
+{
+    logger_ = spdlog::get("main")->clone("cgroup");
+
+    if (api_->mkdir(path_.c_str(), 0755) < 0)
+    {
+        throw api_error(fmt::format("unable to create cgroup {}", path_), errno, logger_);
+    }
+
+    try
+    {
+        if (l.cpu_max_)
+        {
+            write("cpu.max", *l.cpu_max_);
+        }
+        if (l.memory_high_)
+        {
+            write("memory.high", std::to_string(*l.memory_high_));
+        }
+        if (l.memory_max_)
+        {
+            write("memory.max", std::to_string(*l.memory_max_));
+        }
+        if (l.pids_max_)
+        {
+            write("pids.max", std::to_string(*l.pids_max_));
+        }
+
+        std::string procs = path_ + "/cgroup.procs";
+        procs_fd_ = api_->open(procs.c_str(), O_WRONLY | O_CLOEXEC);
+        if (procs_fd_ < 0)
+        {
+            throw api_error(fmt::format("unable to open {}", procs), errno, logger_);
+        }
+    }
+    catch (const api_error& e)
+    {
+        api_->rmdir(path_.c_str());
+        throw;
+    }
+
+    logger_->debug("created cgroup {}", path_);
+}
+
+cgroup::cgroup(std::shared_ptr<wpwrapper::api> api_instance, std::string path)
+        :api_(std::move(api_instance)), path_(std::move(path)), procs_fd_(-1), released_(false), removed_(false)
+{
+    logger_ = spdlog::get("main")->clone("cgroup");
+}
+
+cgroup::~cgroup() noexcept
+{
+    if (procs_fd_ >= 0)
+    {
+        api_->close(procs_fd_);
+    }
+
+    if (!released_ && !removed_ && !remove())
+    {
+        logger_->warn("unable to remove cgroup {}, it is still busy", path_);
+    }
+}
+
+bool cgroup::remove() noexcept
+{
+    if (api_->rmdir(path_.c_str()) < 0)
+    {
+        if (errno == EBUSY)
+        {
+            return false;
+        }
+
+        logger_->warn("unable to remove cgroup {} (error code: {})", path_, errno);
+    }
+    else
+    {
+        logger_->debug("removed cgroup {}", path_);
+    }
+
+    removed_ = true;
+    return true;
+}
+
+bool cgroup::enter() const noexcept
+{
+    // Writing zero moves the writing process.
+    return procs_fd_ >= 0 && api_->write(procs_fd_, "0", 1) == 1;
+}
+
+cgroup::usage cgroup::sample() const
+{
+    usage result{0, std::nullopt};
+
+    std::istringstream stat(read("cpu.stat"));
+    std::string key;
+    uint64_t value;
+    while (stat >> key >> value)
+    {
+        if (key == "usage_usec")
+        {
+            result.cpu_usec_ = value;
+            break;
+        }
+    }
+
+    try
+    {
+        result.memory_current_ = std::stoull(read("memory.current"));
+    }
+    catch (const api_error& e)
+    {
+        // The memory controller is not enabled.
+    }
+    catch (const std::logic_error& e)
+    {
+    }
+
+    return result;
+}
+
+std::string cgroup::release() noexcept
+{
+    released_ = true;
+    return path_;
+}
+
+const std::string& cgroup::path() const noexcept
+{
+    return path_;
+}
+
+void cgroup::write(const std::string& file, const std::string& value) const
+{
+    std::string path = path_ + "/" + file;
+    int fd = api_->open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        // Most likely, the controller is not enabled in the parent's cgroup.subtree_control.
+        throw api_error(fmt::format("unable to open {}", path), errno, logger_);
+    }
+
+    ssize_t written = api_->write(fd, value.data(), value.size());
+    int err = errno;
+    api_->close(fd);
+
+    if (written != static_cast<ssize_t>(value.size()))
+    {
+        throw api_error(fmt::format("unable to write {} to {}", value, path), written < 0 ? err : 0, logger_);
+    }
+}
+
+std::string cgroup::read(const std::string& file) const
+{
+    std::string path = path_ + "/" + file;
+    int fd = api_->open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw api_error(fmt::format("unable to open {}", path), errno);
+    }
+
+    std::string contents;
+    char buffer[1024];
+    while (true)
+    {
+        ssize_t length = api_->read(fd, buffer, sizeof(buffer));
+        if (length < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (length < 0)
+        {
+            int err = errno;
+            api_->close(fd);
+            throw api_error(fmt::format("unable to read {}", path), err);
+        }
+        else if (length == 0)
+        {
+            break;
+        }
+
+        contents.append(buffer, length);
+    }
+
+    api_->close(fd);
+    return contents;
+}
+
+} // namespace wpwrapper
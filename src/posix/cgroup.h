@@ -0,0 +1,148 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_CGROUP_H
+#define WPWRAPPER_CGROUP_H
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <spdlog/spdlog.h>
+
+#include "api.h"
+
+namespace wpwrapper {
+
+/// \brief A cgroup v2 control group that holds a single sertop instance, and limits the resources it may use.
+/// \details The control group is created below a control group that was delegated to the wrapper, and removed again on
+/// destruction. The controllers that the limits need must be enabled in the \c cgroup.subtree_control file of that
+/// control group. Only available on Ubuntu.
+class cgroup {
+public:
+    /// \brief How long removal may be retried after the processes in a control group have exited, until the kernel has
+    /// accounted for them.
+    static constexpr std::chrono::milliseconds removal_timeout{100};
+
+    /// \brief Limits on the resources that the processes in a control group may use. Empty limits are not set.
+    struct limits {
+        /// \brief The contents of \c cpu.max: the quota and the period in microseconds, like <tt>50000 100000</tt>.
+        std::optional<std::string> cpu_max_;
+        /// \brief The contents of \c memory.max: the memory usage in bytes at which the kernel reclaims or kills.
+        std::optional<uint64_t> memory_max_;
+        /// \brief The contents of \c memory.high: the memory usage in bytes above which the kernel throttles.
+        std::optional<uint64_t> memory_high_;
+        /// \brief The contents of \c pids.max: the maximum number of processes.
+        std::optional<uint64_t> pids_max_;
+    };
+
+    /// \brief What the processes in a control group have used.
+    struct usage {
+        /// \brief Processor time in microseconds, from \c cpu.stat.
+        uint64_t cpu_usec_;
+        /// \brief Memory usage in bytes, from \c memory.current. Empty if the memory controller is not enabled.
+        std::optional<uint64_t> memory_current_;
+    };
+
+    /// \brief Creates a control group and sets its limits.
+    /// \param api_instance The API instance to use.
+    /// \param parent The path of the delegated control group, like <tt>/sys/fs/cgroup/wpwrapper</tt>.
+    /// \param name The name of the new control group. Must not exist yet.
+    /// \param l The limits to set.
+    /// \throw api_error If the control group could not be created, or a limit could not be set. The control group is
+    /// removed again then.
+    cgroup(std::shared_ptr<api> api_instance, const std::string& parent, const std::string& name, const limits& l);
+
+    /// \brief Takes over a control group that was created by another wrapper process.
+    /// \param api_instance The API instance to use.
+    /// \param path The path of the control group.
+    cgroup(std::shared_ptr<api> api_instance, std::string path);
+
+    /// \brief Removes the control group, unless it was released or removed already.
+    /// \details Does not wait: if the kernel has not noticed yet that the processes in it have exited, the control
+    /// group is left behind. Use remove() to retry until it has.
+    ~cgroup() noexcept;
+
+    // Cgroup is non-copyable.
+    cgroup(const cgroup& other) = delete;
+
+    // Cgroup is non-movable.
+    cgroup(cgroup&& other) = delete;
+
+    // Cgroup is non-copyable.
+    cgroup& operator=(const cgroup& other) = delete;
+
+    // Cgroup is non-movable.
+    cgroup& operator=(cgroup&& other) = delete;
+
+    /// \brief Moves the calling process into the control group.
+    /// \details Only makes a single system call, so it can be used between fork() and exec().
+    /// \return \c true on success.
+    bool enter() const noexcept;
+
+    /// \brief Tries once to remove the control group, without waiting.
+    /// \details The kernel takes a moment to account for processes that have exited, so a control group whose last
+    /// process was just reaped may still be busy.
+    /// \return \c false if the control group is still busy, \c true once it has been removed, or if removing it failed
+    /// for another reason, which is logged.
+    bool remove() noexcept;
+
+    /// \brief Reads what the processes in the control group have used.
+    /// \return The usage.
+    /// \throw api_error If \c cpu.stat could not be read.
+    usage sample() const;
+
+    /// \brief Leaves the control group alone on destruction, so that another wrapper process can take it over.
+    /// \return The path of the control group.
+    std::string release() noexcept;
+
+    /// \brief Returns the path of the control group.
+    /// \return The path.
+    const std::string& path() const noexcept;
+
+private:
+    /// \brief Writes a value to an interface file of the control group.
+    /// \param file The name of the file.
+    /// \param value The value to write.
+    /// \throw api_error If the value could not be written.
+    void write(const std::string& file, const std::string& value) const;
+
+    /// \brief Reads an interface file of the control group.
+    /// \param file The name of the file.
+    /// \return The contents of the file.
+    /// \throw api_error If the file could not be read.
+    std::string read(const std::string& file) const;
+
+    /// \brief Logger used in this control group.
+    std::shared_ptr<spdlog::logger> logger_;
+    /// \brief API instance used for all API calls.
+    std::shared_ptr<api> api_;
+
+    /// \brief The path of the control group.
+    std::string path_;
+    /// \brief The \c cgroup.procs file, opened ahead so that enter() only has to write to it. -1 if taken over.
+    int procs_fd_;
+    /// \brief Set once the control group has been released.
+    bool released_;
+    /// \brief Set once the control group has been removed, or removing it has failed for good.
+    bool removed_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_CGROUP_H
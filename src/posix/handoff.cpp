@@ -0,0 +1,335 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "handoff.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "../utils/buffers.h"
+#include "../utils/exceptions.h"
+
+namespace wpwrapper::handoff {
+
+// The number of file descriptors passed in a single message. Some systems limit the ancillary data per message.
+constexpr std::size_t max_files_per_message = 64;
+
+// Writing to a channel whose other end is gone should fail, not raise SIGPIPE.
+#ifdef MSG_NOSIGNAL
+constexpr int send_flags = MSG_NOSIGNAL;
+#else
+constexpr int send_flags = 0;
+#endif
+
+// Sent by notify().
+constexpr char ack = '\06';
+
+static void send_all(const std::shared_ptr<api>& api, int channel, const char* data, std::size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t result = api->send(channel, data, length, send_flags);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (result < 0)
+        {
+            throw api_error("unable to write to handoff channel", errno);
+        }
+
+        data += result;
+        length -= result;
+    }
+}
+
+static void receive_all(const std::shared_ptr<api>& api, int channel, char* data, std::size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t result = api->recv(channel, data, length, 0);
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (result < 0)
+        {
+            throw api_error("unable to read from handoff channel", errno);
+        }
+        else if (result == 0)
+        {
+            throw api_error("handoff channel closed on other end", 0);
+        }
+
+        data += result;
+        length -= result;
+    }
+}
+
+successor spawn(const std::shared_ptr<api>& api, const std::string& path, const std::vector<std::string>& args,
+        std::chrono::milliseconds timeout)
+{
+    int channel[2];
+    if (api->socketpair(AF_UNIX, SOCK_STREAM, 0, channel) < 0)
+    {
+        throw api_error("unable to create handoff channel", errno);
+    }
+
+    // Our end should not leak into sertop instances started later.
+    if (api->fcntl(channel[0], F_SETFD, FD_CLOEXEC) < 0)
+    {
+        int err = errno;
+        api->close(channel[0]);
+        api->close(channel[1]);
+        throw api_error("unable to set FD_CLOEXEC on handoff channel", err);
+    }
+
+    // Everything that allocates happens before forking: other threads may hold the allocator's locks. The new process
+    // finds its end of the channel right after the standard streams.
+    constexpr int inherited_channel = STDERR_FILENO + 1;
+    std::string adopt = adopt_option + std::to_string(inherited_channel);
+    std::vector<char*> params;
+    params.push_back(const_cast<char*>(path.c_str()));
+    for (const auto& arg: args)
+    {
+        params.push_back(const_cast<char*>(arg.c_str()));
+    }
+    params.push_back(adopt.data());
+    params.push_back(nullptr);
+
+    long max_files = sysconf(_SC_OPEN_MAX);
+    if (max_files < 0)
+    {
+        max_files = 1024;
+    }
+
+    pid_t pid = api->fork();
+    if (pid < 0)
+    {
+        int err = errno;
+        api->close(channel[0]);
+        api->close(channel[1]);
+        throw api_error("unable to fork", err);
+    }
+    else if (pid == 0)
+    {
+        // We're the child process. Everything the wrapper opens is close-on-exec, but libraries need not be. A copy of
+        // a client socket that stays open here would keep its connection alive after the new process closes it, so
+        // everything but the channel is closed. The sockets arrive through the channel instead.
+        if (channel[1] != inherited_channel && api->dup2(channel[1], inherited_channel) < 0)
+        {
+            api->_exit(1);
+        }
+
+        if (api->close_range(inherited_channel + 1, ~0u, 0) < 0)
+        {
+            for (long fd = inherited_channel + 1; fd < max_files; ++fd)
+            {
+                api->close(static_cast<int>(fd));
+            }
+        }
+
+        api->execv(path.c_str(), params.data());
+        api->_exit(1);
+    }
+
+    // We're the parent process.
+    api->close(channel[1]);
+
+    try
+    {
+        wait(api, channel[0], timeout);
+    }
+    catch (const api_error& e)
+    {
+        api->kill(pid, SIGKILL);
+        api->waitpid(pid, nullptr, 0);
+        api->close(channel[0]);
+        throw;
+    }
+
+    return successor{pid, channel[0]};
+}
+
+void send(const std::shared_ptr<api>& api, int channel, const std::string& state, const std::vector<int>& files)
+{
+    // The header holds the length of the state and the number of file descriptors that follow it.
+    std::vector<char> header(2 * sizeof(uint32_t));
+    buffers::write_uint32(state.size(), header, buffers::endianness::big);
+    buffers::write_uint32(files.size(), header, buffers::endianness::big, sizeof(uint32_t));
+
+    send_all(api, channel, header.data(), header.size());
+    send_all(api, channel, state.data(), state.size());
+
+    // Ancillary data needs at least one byte of regular data to travel with.
+    char carrier = 0;
+    std::vector<char> control(CMSG_SPACE(max_files_per_message * sizeof(int)));
+
+    for (std::size_t sent = 0; sent < files.size(); sent += max_files_per_message)
+    {
+        std::size_t count = std::min(max_files_per_message, files.size() - sent);
+
+        iovec iov{&carrier, 1};
+        msghdr msg{};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.data();
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        std::memcpy(CMSG_DATA(cmsg), files.data() + sent, count * sizeof(int));
+
+        ssize_t result;
+        do
+        {
+            result = api->sendmsg(channel, &msg, send_flags);
+        }
+        while (result < 0 && errno == EINTR);
+
+        if (result != 1)
+        {
+            throw api_error("unable to pass file descriptors over handoff channel", result < 0 ? errno : 0);
+        }
+    }
+}
+
+std::pair<std::string, std::vector<int>> receive(const std::shared_ptr<api>& api, int channel)
+{
+    std::vector<char> header(2 * sizeof(uint32_t));
+    receive_all(api, channel, header.data(), header.size());
+    uint32_t length = buffers::read_uint32(header, buffers::endianness::big);
+    uint32_t count = buffers::read_uint32(header, buffers::endianness::big, sizeof(uint32_t));
+
+    std::string state(length, '\0');
+    receive_all(api, channel, state.data(), state.size());
+
+    std::vector<int> files;
+    files.reserve(count);
+
+    char carrier;
+    std::vector<char> control(CMSG_SPACE(max_files_per_message * sizeof(int)));
+
+    try
+    {
+        while (files.size() < count)
+        {
+            std::size_t expected = std::min<std::size_t>(max_files_per_message, count - files.size());
+
+            iovec iov{&carrier, 1};
+            msghdr msg{};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control.data();
+            msg.msg_controllen = control.size();
+
+            ssize_t result;
+            do
+            {
+                result = api->recvmsg(channel, &msg, 0);
+            }
+            while (result < 0 && errno == EINTR);
+
+            if (result != 1)
+            {
+                throw api_error("unable to receive file descriptors over handoff channel", result < 0 ? errno : 0);
+            }
+
+            std::size_t received = 0;
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+                if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                {
+                    continue;
+                }
+
+                std::size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (std::size_t i = 0; i < n; ++i)
+                {
+                    int fd;
+                    std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                    files.push_back(fd);
+
+                    // Like everything else the wrapper opens, these should not leak into sertop instances.
+                    api->fcntl(fd, F_SETFD, FD_CLOEXEC);
+                }
+                received += n;
+            }
+
+            if ((msg.msg_flags & MSG_CTRUNC) != 0 || received != expected)
+            {
+                // Most likely, this process ran out of file descriptors.
+                throw api_error("received an incomplete set of file descriptors over handoff channel", EMFILE);
+            }
+        }
+    }
+    catch (const api_error& e)
+    {
+        for (int fd: files)
+        {
+            api->close(fd);
+        }
+        throw;
+    }
+
+    return {std::move(state), std::move(files)};
+}
+
+void notify(const std::shared_ptr<api>& api, int channel)
+{
+    send_all(api, channel, &ack, 1);
+}
+
+void wait(const std::shared_ptr<api>& api, int channel, std::chrono::milliseconds timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    while (true)
+    {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (left < std::chrono::milliseconds::zero())
+        {
+            throw api_error("timeout while waiting on handoff channel", ETIMEDOUT);
+        }
+
+        pollfd waitfd{channel, POLLIN, 0};
+        int result = api->poll(&waitfd, 1, static_cast<int>(left.count()));
+        if (result < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else if (result < 0)
+        {
+            throw api_error("unable to wait on handoff channel", errno);
+        }
+        else if (result > 0)
+        {
+            break;
+        }
+    }
+
+    char c;
+    receive_all(api, channel, &c, 1);
+    if (c != ack)
+    {
+        throw api_error("read unexpected data from handoff channel", 0);
+    }
+}
+
+} // namespace wpwrapper::handoff
@@ -0,0 +1,90 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_HANDOFF_H
+#define WPWRAPPER_HANDOFF_H
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "api.h"
+
+/// \brief Moves the state and the open file descriptors of a running wrapper process to a new one, so that the wrapper
+/// can be replaced without dropping connections or sertop instances.
+/// \details Both processes share a Unix domain socket pair. The old process starts the new one with spawn(), sends it
+/// its state with send(), and the new process picks that up with receive(). File descriptors are passed as
+/// \c SCM_RIGHTS ancillary data, so the new process gets its own copies of the same open file descriptions.
+namespace wpwrapper::handoff {
+
+/// \brief The argument that tells a wrapper process to take over, followed by its end of the socket pair.
+inline const std::string adopt_option = "--adopt=";
+
+/// \brief A wrapper process that was started to take over from this one.
+struct successor {
+    /// \brief The process id.
+    pid_t pid_;
+
+    /// \brief This process's end of the socket pair.
+    int channel_;
+};
+
+/// \brief Starts a new wrapper process from the binary at \c path, and waits until it reports that it is ready.
+/// \details The new process inherits no file descriptors but its standard streams and its end of the socket pair, which
+/// is passed as an extra \c --adopt=<fd> argument.
+/// \param api The API instance to use.
+/// \param path The path of the wrapper binary.
+/// \param args The arguments for the new process, without the binary path.
+/// \param timeout How long to wait for the new process to become ready.
+/// \return The new process.
+/// \throw api_error If the process could not be started or did not become ready in time. The process is killed then.
+successor spawn(const std::shared_ptr<api>& api, const std::string& path, const std::vector<std::string>& args,
+        std::chrono::milliseconds timeout);
+
+/// \brief Sends a state and a list of file descriptors over a channel.
+/// \param api The API instance to use.
+/// \param channel One end of the socket pair.
+/// \param state The state, in any format that the receiver understands.
+/// \param files The file descriptors. They stay open in this process.
+/// \throw api_error If the state or the file descriptors could not be sent.
+void send(const std::shared_ptr<api>& api, int channel, const std::string& state, const std::vector<int>& files);
+
+/// \brief Receives what the other end of a channel sent with send().
+/// \param api The API instance to use.
+/// \param channel One end of the socket pair.
+/// \return The state, and the file descriptors in the order in which they were sent. The file descriptors are closed
+/// after an exec() call.
+/// \throw api_error If nothing or not everything could be received.
+std::pair<std::string, std::vector<int>> receive(const std::shared_ptr<api>& api, int channel);
+
+/// \brief Tells the other end of a channel that a step has completed.
+/// \param api The API instance to use.
+/// \param channel One end of the socket pair.
+/// \throw api_error If the other end is gone.
+void notify(const std::shared_ptr<api>& api, int channel);
+
+/// \brief Waits until the other end of a channel calls notify().
+/// \param api The API instance to use.
+/// \param channel One end of the socket pair.
+/// \param timeout How long to wait.
+/// \throw api_error If the other end is gone or did not call notify() in time.
+void wait(const std::shared_ptr<api>& api, int channel, std::chrono::milliseconds timeout);
+
+} // namespace wpwrapper::handoff
+
+#endif // WPWRAPPER_HANDOFF_H
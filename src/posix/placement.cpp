@@ -0,0 +1,179 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "placement.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <utility>
+
+#include "../utils/exceptions.h"
+
+namespace wpwrapper {
+
+placement::placement(std::shared_ptr<wpwrapper::api> api_instance, unsigned int reserved)
+        :api_(std::move(api_instance))
+{
+    logger_ = spdlog::get("main")->clone("placement");
+
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (api_->sched_getaffinity(0, sizeof(mask), &mask) < 0)
+    {
+        throw api_error("unable to determine the cores to run on", errno, logger_);
+    }
+
+    for (unsigned int core = 0; core < CPU_SETSIZE; ++core)
+    {
+        if (CPU_ISSET(core, &mask))
+        {
+            allowed_.push_back(core);
+        }
+    }
+#else
+    throw api_error("pinning sertop instances to cores is not supported on macOS", ENOSYS, logger_);
+#endif
+
+    if (allowed_.size() <= reserved)
+    {
+        throw api_error(fmt::format("unable to reserve {} of {} cores", reserved, allowed_.size()), EINVAL, logger_);
+    }
+
+    reserved_.assign(allowed_.begin(), allowed_.begin() + reserved);
+    shared_.assign(allowed_.begin() + reserved, allowed_.end());
+    for (unsigned int core: shared_)
+    {
+        instances_[core];
+    }
+
+    logger_->info("reserved {} cores, placing sertop instances on {}", reserved_.size(), instances_.size());
+}
+
+void placement::confine() const
+{
+    pin(reserved_);
+}
+
+void placement::restore() const
+{
+    pin(allowed_);
+}
+
+const std::vector<unsigned int>& placement::shared() const noexcept
+{
+    return shared_;
+}
+
+unsigned int placement::assign(unsigned int instance_id)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+
+    // Ties go to the lowest core, which keeps a lightly loaded host on few cores.
+    auto quietest = std::min_element(instances_.begin(), instances_.end(), [](const auto& lhs, const auto& rhs)
+    {
+        return lhs.second.size() < rhs.second.size();
+    });
+    quietest->second.insert(instance_id);
+
+    logger_->debug("placed instance {} on core {}", instance_id, quietest->first);
+    return quietest->first;
+}
+
+bool placement::adopt(unsigned int instance_id, unsigned int core)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+
+    auto found = instances_.find(core);
+    if (found == instances_.end())
+    {
+        return false;
+    }
+
+    found->second.insert(instance_id);
+    return true;
+}
+
+std::optional<placement::move> placement::release(unsigned int instance_id, unsigned int core)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+
+    auto found = instances_.find(core);
+    if (found == instances_.end() || found->second.erase(instance_id) == 0)
+    {
+        return std::nullopt;
+    }
+
+    // Cores only get out of balance one instance at a time, so moving a single instance restores it.
+    auto [quietest, busiest] = std::minmax_element(instances_.begin(), instances_.end(),
+            [](const auto& lhs, const auto& rhs)
+            {
+                return lhs.second.size() < rhs.second.size();
+            });
+    if (busiest->second.size() < quietest->second.size() + 2)
+    {
+        return std::nullopt;
+    }
+
+    return move{*busiest->second.begin(), busiest->first, quietest->first};
+}
+
+bool placement::relocate(const placement::move& m)
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+
+    auto from = instances_.find(m.from_);
+    auto to = instances_.find(m.to_);
+    if (from == instances_.end() || to == instances_.end() || from->second.erase(m.instance_id_) == 0)
+    {
+        return false;
+    }
+
+    to->second.insert(m.instance_id_);
+    logger_->debug("moved instance {} from core {} to core {}", m.instance_id_, m.from_, m.to_);
+    return true;
+}
+
+std::map<unsigned int, unsigned int> placement::loads() const
+{
+    std::lock_guard<std::mutex> guard(mutex_);
+
+    std::map<unsigned int, unsigned int> result;
+    for (const auto& [core, instances]: instances_)
+    {
+        result[core] = instances.size();
+    }
+    return result;
+}
+
+void placement::pin(const std::vector<unsigned int>& cores) const
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (unsigned int core: cores)
+    {
+        CPU_SET(core, &mask);
+    }
+
+    if (api_->sched_setaffinity(0, sizeof(mask), &mask) < 0)
+    {
+        throw api_error("unable to pin thread to cores", errno, logger_);
+    }
+#endif
+}
+
+} // namespace wpwrapper
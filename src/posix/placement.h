@@ -0,0 +1,133 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_PLACEMENT_H
+#define WPWRAPPER_PLACEMENT_H
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "api.h"
+
+namespace wpwrapper {
+
+/// \brief Decides on which core every sertop instance runs, and keeps the threads of the wrapper on cores of their own.
+/// \details The first cores that the wrapper may run on are reserved for its own threads, every sertop instance is
+/// pinned to one of the others: the one with the fewest instances. When instances go away and the cores get out of
+/// balance, an instance is moved from the busiest core to the quietest one. Only available on Ubuntu.
+/// \note Thread-safe.
+class placement {
+public:
+    /// \brief An instance that should move to another core, to even out the load.
+    struct move {
+        /// \brief The instance.
+        unsigned int instance_id_;
+        /// \brief The core that the instance runs on.
+        unsigned int from_;
+        /// \brief The core that the instance should run on.
+        unsigned int to_;
+    };
+
+    /// \brief Constructs a placement over the cores that the calling thread may run on.
+    /// \param api_instance The API instance to use.
+    /// \param reserved The number of cores to reserve for the threads of the wrapper.
+    /// \throw api_error If the cores could not be determined, or if no core would be left for sertop instances.
+    placement(std::shared_ptr<api> api_instance, unsigned int reserved);
+
+    // Placement is non-copyable.
+    placement(const placement& other) = delete;
+
+    // Placement is non-movable.
+    placement(placement&& other) = delete;
+
+    // Placement is non-copyable.
+    placement& operator=(const placement& other) = delete;
+
+    // Placement is non-movable.
+    placement& operator=(placement&& other) = delete;
+
+    /// \brief Restricts the calling thread to the reserved cores. Threads that it starts from then on inherit that.
+    /// \throw api_error If the thread could not be restricted.
+    void confine() const;
+
+    /// \brief Lets the calling thread run on all cores that it could run on when the placement was constructed.
+    /// \throw api_error If the thread could not be released.
+    void restore() const;
+
+    /// \brief Returns the cores that instances are placed on, that is, all but the reserved ones.
+    /// \return The cores.
+    const std::vector<unsigned int>& shared() const noexcept;
+
+    /// \brief Picks the core with the fewest instances for a new instance.
+    /// \param instance_id The instance.
+    /// \return The core.
+    unsigned int assign(unsigned int instance_id);
+
+    /// \brief Counts an instance that already runs on a core, such as one that was taken over.
+    /// \param instance_id The instance.
+    /// \param core The core.
+    /// \return \c false if the core is not one that instances are placed on, and the instance was not counted.
+    bool adopt(unsigned int instance_id, unsigned int core);
+
+    /// \brief Forgets about an instance that went away.
+    /// \param instance_id The instance.
+    /// \param core The core that it ran on.
+    /// \return An instance to move if the cores got out of balance, that is, if the busiest core has at least two
+    /// instances more than the quietest one.
+    std::optional<move> release(unsigned int instance_id, unsigned int core);
+
+    /// \brief Records that an instance moved, unless it is no longer where the move expects it to be.
+    /// \param m The move, as returned by release().
+    /// \return \c true if the move was recorded.
+    bool relocate(const move& m);
+
+    /// \brief Returns the number of instances on every core that instances are placed on.
+    /// \return The number of instances, by core.
+    std::map<unsigned int, unsigned int> loads() const;
+
+private:
+    /// \brief Restricts the calling thread to some cores.
+    /// \param cores The cores.
+    /// \throw api_error If the thread could not be restricted.
+    void pin(const std::vector<unsigned int>& cores) const;
+
+    /// \brief Logger used in this placement.
+    std::shared_ptr<spdlog::logger> logger_;
+    /// \brief API instance used for all API calls.
+    std::shared_ptr<api> api_;
+
+    /// \brief The cores that the calling thread could run on at construction.
+    std::vector<unsigned int> allowed_;
+    /// \brief The cores for the threads of the wrapper.
+    std::vector<unsigned int> reserved_;
+    /// \brief The cores that instances are placed on.
+    std::vector<unsigned int> shared_;
+
+    /// \brief Guards the instances.
+    mutable std::mutex mutex_;
+    /// \brief The instances on every core that instances are placed on.
+    std::map<unsigned int, std::set<unsigned int>> instances_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_PLACEMENT_H
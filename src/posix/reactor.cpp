@@ -0,0 +1,219 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "reactor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <limits>
+
+#include "../utils/exceptions.h"
+
+namespace wpwrapper {
+
+reactor::reactor(std::shared_ptr<api> api_instance)
+        :api_(std::move(api_instance)), stopping_(false), active_(0)
+{
+    if (api_->pipe(wake_) < 0)
+    {
+        throw api_error("failed to create reactor wakeup pipe", errno);
+    }
+
+    // Posting never blocks: if the pipe is full, the reactor thread is going to wake up anyway.
+    for (int fd: wake_)
+    {
+        if (api_->fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || api_->fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+        {
+            int err = errno;
+            api_->close(wake_[0]);
+            api_->close(wake_[1]);
+            throw api_error("failed to configure reactor wakeup pipe", err);
+        }
+    }
+
+    thread_ = std::thread(&reactor::run, this);
+}
+
+reactor::~reactor() noexcept
+{
+    post([this]
+    {
+        stopping_ = true;
+    });
+
+    if (thread_.joinable())
+    {
+        thread_.join();
+    }
+
+    api_->close(wake_[0]);
+    api_->close(wake_[1]);
+}
+
+reactor::awaiter reactor::readable(int fd) noexcept
+{
+    return awaiter(*this, fd, POLLIN, std::chrono::steady_clock::time_point::max());
+}
+
+reactor::awaiter reactor::readable(int fd, std::chrono::milliseconds timeout) noexcept
+{
+    return awaiter(*this, fd, POLLIN, std::chrono::steady_clock::now() + timeout);
+}
+
+reactor::awaiter reactor::sleep(std::chrono::milliseconds timeout) noexcept
+{
+    // poll() ignores negative file descriptors, so only the timeout resumes the coroutine.
+    return awaiter(*this, -1, 0, std::chrono::steady_clock::now() + timeout);
+}
+
+reactor::awaiter reactor::writable(int fd) noexcept
+{
+    return awaiter(*this, fd, POLLOUT, std::chrono::steady_clock::time_point::max());
+}
+
+void reactor::cancel(int fd)
+{
+    std::vector<awaiter*> cancelled;
+
+    waiting_.erase(std::remove_if(waiting_.begin(), waiting_.end(), [&](awaiter* a)
+    {
+        if (a->fd_ != fd)
+        {
+            return false;
+        }
+        cancelled.push_back(a);
+        return true;
+    }), waiting_.end());
+
+    for (awaiter* a: cancelled)
+    {
+        a->revents_ = 0;
+        a->handle_.resume();
+    }
+}
+
+void reactor::post(std::function<void()> f)
+{
+    bool first;
+
+    {
+        std::lock_guard<std::mutex> guard(posted_mutex_);
+        first = posted_.empty();
+        posted_.push_back(std::move(f));
+    }
+
+    // Only the first function needs to wake the reactor thread, it executes all of them.
+    if (first)
+    {
+        char c = '\01';
+        api_->write(wake_[1], &c, 1);
+    }
+}
+
+void reactor::spawn(wpwrapper::detached coroutine)
+{
+    post([this, handle = coroutine.handle_]
+    {
+        ++active_;
+        handle.promise().active_ = &active_;
+        handle.resume();
+    });
+}
+
+void reactor::watch(awaiter* a)
+{
+    waiting_.push_back(a);
+}
+
+void reactor::run() noexcept
+{
+    std::vector<pollfd> fds;
+    std::vector<std::function<void()>> posted;
+    std::vector<awaiter*> ready;
+    char buffer[64];
+
+    while (!stopping_ || active_ > 0)
+    {
+        fds.clear();
+        fds.push_back(pollfd{wake_[0], POLLIN, 0});
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (awaiter* a: waiting_)
+        {
+            fds.push_back(pollfd{a->fd_, a->events_, 0});
+            deadline = std::min(deadline, a->deadline_);
+        }
+
+        int timeout = -1;
+        if (deadline != std::chrono::steady_clock::time_point::max())
+        {
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            timeout = static_cast<int>(std::clamp<std::chrono::milliseconds::rep>(left.count(), 0,
+                    std::numeric_limits<int>::max()));
+        }
+
+        if (api_->poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+        {
+            // Nothing sensible to do but try again; the next error is most likely the same, so don't spin.
+            std::this_thread::yield();
+            continue;
+        }
+
+        // Resume coroutines whose file descriptor is ready or whose wait timed out. They may register and cancel other
+        // waits, so take all of them out of the list first. The list has not changed since poll() was called.
+        ready.clear();
+        std::size_t kept = 0;
+        auto now = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < waiting_.size(); ++i)
+        {
+            short revents = fds[i + 1].revents;
+            if (revents != 0 || waiting_[i]->deadline_ <= now)
+            {
+                waiting_[i]->revents_ = revents;
+                ready.push_back(waiting_[i]);
+            }
+            else
+            {
+                waiting_[kept++] = waiting_[i];
+            }
+        }
+        waiting_.resize(kept);
+
+        for (awaiter* a: ready)
+        {
+            a->handle_.resume();
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            while (api_->read(wake_[0], buffer, sizeof(buffer)) > 0)
+            {
+            }
+
+            {
+                std::lock_guard<std::mutex> guard(posted_mutex_);
+                posted.swap(posted_);
+            }
+
+            for (auto& f: posted)
+            {
+                f();
+            }
+            posted.clear();
+        }
+    }
+}
+
+} // namespace wpwrapper
@@ -0,0 +1,219 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_REACTOR_H
+#define WPWRAPPER_REACTOR_H
+
+#include <chrono>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "api.h"
+
+namespace wpwrapper {
+
+/// \brief The return type of a coroutine that runs on its own: nobody awaits its result.
+/// \details The coroutine is suspended when it is created, and should be started with reactor::spawn(). Its frame is
+/// destroyed when it finishes. Exceptions must not escape it.
+struct detached {
+    struct promise_type {
+        ~promise_type()
+        {
+            if (active_ != nullptr)
+            {
+                --*active_;
+            }
+        }
+
+        detached get_return_object() noexcept
+        {
+            return detached{std::coroutine_handle<promise_type>::from_promise(*this)};
+        }
+
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        std::suspend_never final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void return_void() noexcept
+        {
+        }
+
+        void unhandled_exception() noexcept
+        {
+            std::terminate();
+        }
+
+        /// \brief The number of coroutines that the reactor that runs this one is waiting for. Set by spawn().
+        std::size_t* active_ = nullptr;
+    };
+
+    /// \brief The suspended coroutine.
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/// \brief Runs coroutines that wait for file descriptors to become ready, all on a single thread.
+/// \details A coroutine suspends with <tt>co_await r.readable(fd)</tt> or <tt>co_await r.writable(fd)</tt>. The reactor
+/// thread waits for all registered file descriptors at once with poll(), and resumes a coroutine when its file
+/// descriptor is ready, or when its wait times out. Coroutines are only ever resumed on the reactor thread, so state
+/// that is only accessed by them needs no synchronization. Other threads hand work to the reactor thread with post().
+class reactor {
+public:
+    /// \brief Suspends the awaiting coroutine until a file descriptor is ready.
+    class awaiter {
+    public:
+        bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            reactor_.watch(this);
+        }
+
+        /// \return The poll() events that occurred, or 0 if the wait was cancelled or timed out.
+        short await_resume() const noexcept
+        {
+            return revents_;
+        }
+
+    private:
+        friend class reactor;
+
+        awaiter(reactor& r, int fd, short events, std::chrono::steady_clock::time_point deadline) noexcept
+                :reactor_(r), fd_(fd), events_(events), revents_(0), deadline_(deadline)
+        {
+        }
+
+        reactor& reactor_;
+        int fd_;
+        short events_;
+        short revents_;
+        std::chrono::steady_clock::time_point deadline_;
+        std::coroutine_handle<> handle_;
+    };
+
+    /// \brief Constructs a reactor and starts the reactor thread.
+    /// \param api_instance The API instance to use.
+    /// \throw api_error If the wakeup pipe could not be created.
+    explicit reactor(std::shared_ptr<api> api_instance);
+
+    /// \brief Destructs this reactor.
+    /// \details Executes the functions that have already been posted, waits until every coroutine that was started
+    /// with spawn() has finished, and stops the reactor thread.
+    /// \warning Coroutines that wait without a timeout must be resumed by the functions that were posted before.
+    ~reactor() noexcept;
+
+    // Reactor is non-copyable.
+    reactor(const reactor& other) = delete;
+
+    // Reactor is non-movable.
+    reactor(reactor&& other) = delete;
+
+    // Reactor is non-copyable.
+    reactor& operator=(const reactor& other) = delete;
+
+    // Reactor is non-movable.
+    reactor& operator=(reactor&& other) = delete;
+
+    /// \brief Waits until \c fd can be read from without blocking, or until the other end hangs up.
+    /// \param fd The file descriptor to wait for.
+    /// \return An awaitable. Must be awaited on the reactor thread.
+    awaiter readable(int fd) noexcept;
+
+    /// \brief Waits until \c fd can be read from without blocking, until the other end hangs up, or until \c timeout
+    /// has passed.
+    /// \param fd The file descriptor to wait for.
+    /// \param timeout How long to wait at most.
+    /// \return An awaitable. Must be awaited on the reactor thread.
+    awaiter readable(int fd, std::chrono::milliseconds timeout) noexcept;
+
+    /// \brief Waits until \c timeout has passed, without holding up the reactor thread.
+    /// \param timeout How long to wait.
+    /// \return An awaitable. Must be awaited on the reactor thread.
+    awaiter sleep(std::chrono::milliseconds timeout) noexcept;
+
+    /// \brief Waits until \c fd can be written to without blocking.
+    /// \param fd The file descriptor to wait for.
+    /// \return An awaitable. Must be awaited on the reactor thread.
+    awaiter writable(int fd) noexcept;
+
+    /// \brief Resumes all coroutines waiting for \c fd, as if the wait was cancelled.
+    /// \note May only be called on the reactor thread.
+    /// \param fd The file descriptor to stop waiting for.
+    void cancel(int fd);
+
+    /// \brief Executes \c f on the reactor thread, after the functions that were posted before.
+    /// \note May be called from any thread.
+    /// \param f The function to execute.
+    void post(std::function<void()> f);
+
+    /// \brief Starts a coroutine on the reactor thread.
+    /// \note May be called from any thread.
+    /// \param coroutine The coroutine to start.
+    void spawn(detached coroutine);
+
+private:
+    /// \brief Waits for file descriptors and executes posted functions until the reactor is destructed.
+    /// \note Should be executed on a separate thread.
+    void run() noexcept;
+
+    /// \brief Registers a suspended coroutine. Executed on the reactor thread.
+    /// \param a The awaiter of the coroutine.
+    void watch(awaiter* a);
+
+    /// \brief API instance used for all API calls.
+    std::shared_ptr<api> api_;
+
+    /// \brief Set once the reactor is destructed. The reactor thread stops once no coroutines are active anymore.
+    /// \note Only accessed on the reactor thread.
+    bool stopping_;
+    /// \brief The number of coroutines that were started with spawn() and have not finished yet.
+    /// \note Only accessed on the reactor thread.
+    std::size_t active_;
+
+    /// \brief All suspended coroutines.
+    /// \note Only accessed on the reactor thread.
+    std::vector<awaiter*> waiting_;
+
+    /// \brief Functions that have been posted but not executed yet.
+    std::vector<std::function<void()>> posted_;
+    /// \brief Guards the posted functions.
+    std::mutex posted_mutex_;
+
+    /// \brief Self-pipe that wakes the reactor thread when a function is posted.
+    int wake_[2];
+
+    /// \brief Thread on which coroutines are resumed.
+    std::thread thread_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_REACTOR_H
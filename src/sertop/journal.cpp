@@ -0,0 +1,131 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "journal.h"
+
+#include <utility>
+
+namespace wpwrapper {
+
+journal::journal(std::vector<std::string> commands, std::vector<uint64_t> states, std::deque<uint64_t> running,
+        std::size_t completed_states)
+        :commands_(std::move(commands)), states_(std::move(states)), running_(std::move(running)),
+         completed_states_(completed_states)
+{
+}
+
+const std::vector<std::string>& journal::commands() const noexcept
+{
+    return commands_;
+}
+
+const std::vector<uint64_t>& journal::states() const noexcept
+{
+    return states_;
+}
+
+const std::deque<uint64_t>& journal::running() const noexcept
+{
+    return running_;
+}
+
+std::size_t journal::completed_states() const noexcept
+{
+    return completed_states_;
+}
+
+std::size_t journal::replayable() const noexcept
+{
+    return commands_.size() - running_.size();
+}
+
+void journal::add(std::string command, uint64_t forward, const std::vector<uint64_t>& states)
+{
+    commands_.push_back(std::move(command));
+    running_.push_back(forward);
+    states_.insert(states_.end(), states.begin(), states.end());
+}
+
+void journal::append(std::string command, const std::vector<uint64_t>& states)
+{
+    commands_.push_back(std::move(command));
+    states_.insert(states_.end(), states.begin(), states.end());
+    completed_states_ = states_.size();
+}
+
+void journal::assign(uint64_t forward, uint64_t state)
+{
+    // Sertop runs one command at a time: the one of the first forward request that has not completed.
+    if (!running_.empty() && running_.front() == forward)
+    {
+        states_.push_back(state);
+    }
+}
+
+void journal::confirm(uint64_t forward)
+{
+    if (running_.empty() || running_.front() != forward)
+    {
+        return;
+    }
+
+    running_.pop_front();
+    completed_states_ = states_.size();
+}
+
+void journal::abandon()
+{
+    commands_.resize(replayable());
+    states_.resize(completed_states_);
+    running_.clear();
+}
+
+journal journal::completed() const
+{
+    journal j;
+    j.commands_.assign(commands_.begin(), commands_.begin() + static_cast<std::ptrdiff_t>(replayable()));
+    j.states_.assign(states_.begin(), states_.begin() + static_cast<std::ptrdiff_t>(completed_states_));
+    j.completed_states_ = completed_states_;
+    return j;
+}
+
+void journal::truncate(std::size_t commands, std::size_t states)
+{
+    commands_.resize(commands);
+    states_.resize(states);
+    completed_states_ = states;
+}
+
+void journal::renumber(uint64_t completed)
+{
+    for (auto& forward: running_)
+    {
+        forward -= completed;
+    }
+}
+
+void journal::rewind() noexcept
+{
+    replayed_states_ = 0;
+}
+
+bool journal::replayed(uint64_t state) noexcept
+{
+    // A new sertop instance hands out state ids in the same order.
+    return replayed_states_ < completed_states_ && states_[replayed_states_++] == state;
+}
+
+} // namespace wpwrapper
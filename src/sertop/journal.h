@@ -0,0 +1,135 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_JOURNAL_H
+#define WPWRAPPER_JOURNAL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace wpwrapper {
+
+/// \brief The commands that brought sertop in its current state, to bring a new sertop instance in the same state.
+/// \details Commands are journaled when they are sent to sertop. The ones of forward requests that sertop has not
+/// reported completed yet are running: they may never complete, so they are not replayed. While a new sertop instance
+/// replays the journal, it should assign the same state ids as the one it replaces.
+class journal {
+public:
+    /// \brief Constructs an empty journal.
+    journal() = default;
+
+    /// \brief Constructs a journal that another wrapper process handed over.
+    /// \param commands The commands, in order.
+    /// \param states The state ids that sertop assigned while executing the commands, in order.
+    /// \param running The numbers of the forward requests that carried the last commands, which did not complete.
+    /// \param completed_states The number of state ids that sertop assigned while executing completed commands.
+    journal(std::vector<std::string> commands, std::vector<uint64_t> states, std::deque<uint64_t> running,
+            std::size_t completed_states);
+
+    /// \brief Returns the commands that may have changed the state of sertop: those of forward requests, and those
+    /// that sertop ran ahead of the user.
+    /// \return The commands, in order.
+    const std::vector<std::string>& commands() const noexcept;
+
+    /// \brief Returns the state ids that sertop assigned while executing the commands.
+    /// \return The state ids, in order.
+    const std::vector<uint64_t>& states() const noexcept;
+
+    /// \brief Returns the numbers of the forward requests that carried the last commands, which sertop has not
+    /// reported completed yet.
+    /// \return The numbers, in order.
+    const std::deque<uint64_t>& running() const noexcept;
+
+    /// \brief Returns the number of state ids that sertop assigned while executing completed commands.
+    /// \return The number of state ids.
+    std::size_t completed_states() const noexcept;
+
+    /// \brief Returns the number of commands that completed, which are the first ones. Only these are replayed.
+    /// \return The number of commands.
+    std::size_t replayable() const noexcept;
+
+    /// \brief Journals the command of a forward request, which runs until the request completes.
+    /// \param command The command.
+    /// \param forward The number of the forward request.
+    /// \param states The state ids that sertop assigned already, if it ran the command ahead of the user.
+    void add(std::string command, uint64_t forward, const std::vector<uint64_t>& states = {});
+
+    /// \brief Journals a command that completed without a forward request running, such as one that sertop ran ahead
+    /// of the user.
+    /// \param command The command.
+    /// \param states The state ids that sertop assigned while executing it.
+    void append(std::string command, const std::vector<uint64_t>& states);
+
+    /// \brief Records a state id that sertop assigned while running the command of a forward request.
+    /// \param forward The number of the forward request. The state id is ignored unless this is the first request in
+    /// the journal that has not completed: other requests did not change the state of sertop.
+    /// \param state The state id.
+    void assign(uint64_t forward, uint64_t state);
+
+    /// \brief Marks the command of a forward request completed, so that it is replayed.
+    /// \param forward The number of the forward request, which completed.
+    void confirm(uint64_t forward);
+
+    /// \brief Drops the commands that are running, and the state ids that they assigned. A new sertop instance will
+    /// not run them.
+    void abandon();
+
+    /// \brief Returns the part of the journal that is replayed.
+    /// \return A journal with the commands that completed, and the state ids that they assigned.
+    journal completed() const;
+
+    /// \brief Drops the last commands, which all completed.
+    /// \param commands The number of commands to keep.
+    /// \param states The number of state ids to keep.
+    void truncate(std::size_t commands, std::size_t states);
+
+    /// \brief Numbers the running forward requests from the first one that has not completed, for another wrapper
+    /// process that numbers them that way.
+    /// \param completed The number of forward requests that completed.
+    void renumber(uint64_t completed);
+
+    /// \brief Starts checking the state ids that a new sertop instance assigns while replaying the journal.
+    void rewind() noexcept;
+
+    /// \brief Checks the next state id that a new sertop instance assigned while replaying the journal.
+    /// \param state The state id.
+    /// \return \c false if the sertop instance that ran the commands before assigned another one, or none at all.
+    bool replayed(uint64_t state) noexcept;
+
+private:
+    /// \brief The commands, in order.
+    std::vector<std::string> commands_;
+
+    /// \brief The state ids that sertop assigned while executing the commands, in order.
+    std::vector<uint64_t> states_;
+
+    /// \brief The numbers of the forward requests that carried the last commands, which sertop has not reported
+    /// completed yet.
+    std::deque<uint64_t> running_;
+
+    /// \brief The number of state ids that sertop assigned while executing completed commands.
+    std::size_t completed_states_ = 0;
+
+    /// \brief The number of state ids that were checked while replaying.
+    std::size_t replayed_states_ = 0;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_JOURNAL_H
@@ -0,0 +1,97 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "serapi.h"
+
+#include <algorithm>
+#include <charconv>
+#include <iterator>
+#include <vector>
+
+#include "../utils/sexp.h"
+
+namespace wpwrapper::serapi {
+
+// SerAPI commands that only read the state of sertop. They are not journaled, nor mirrored to sidecars.
+static constexpr std::string_view read_only_commands[] = {"Query", "Print", "Parse", "Tokenize", "Noop", "Help"};
+
+std::size_t count_commands(std::string_view content)
+{
+    return sexp::split(content).size();
+}
+
+bool ends_command(std::string_view answer)
+{
+    auto fields = sexp::elements(answer);
+    if (fields.empty())
+    {
+        return false;
+    }
+
+    if (fields.front() == "Answer")
+    {
+        return fields.size() >= 3 && fields.back() == "Completed";
+    }
+    return fields.front() == "Of_sexp_error";
+}
+
+bool changes_state(std::string_view command)
+{
+    auto is_read_only = [](std::string_view name)
+    {
+        return std::find(std::begin(read_only_commands), std::end(read_only_commands), name)
+               != std::end(read_only_commands);
+    };
+
+    // The name of the command is the first element of the list, or of the nested list that follows a tag.
+    auto fields = sexp::elements(command);
+    if (fields.empty())
+    {
+        return true;
+    }
+
+    if (is_read_only(fields.front()))
+    {
+        return false;
+    }
+
+    auto tagged = fields.size() > 1 ? sexp::elements(fields[1]) : std::vector<std::string_view>{};
+    return tagged.empty() || !is_read_only(tagged.front());
+}
+
+std::optional<uint64_t> added_state(std::string_view answer)
+{
+    auto fields = sexp::elements(answer);
+    if (fields.size() < 3 || fields.front() != "Answer")
+    {
+        return std::nullopt;
+    }
+
+    auto added = sexp::elements(fields.back());
+    if (added.size() < 2 || added.front() != "Added")
+    {
+        return std::nullopt;
+    }
+
+    uint64_t state;
+    if (std::from_chars(added[1].data(), added[1].data() + added[1].size(), state).ec != std::errc())
+    {
+        return std::nullopt;
+    }
+    return state;
+}
+
+} // namespace wpwrapper::serapi
@@ -0,0 +1,53 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_SERAPI_H
+#define WPWRAPPER_SERAPI_H
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+/// \brief What the wrapper needs to know about the SerAPI commands that it forwards to sertop, and the answers that
+/// sertop sends back.
+namespace wpwrapper::serapi {
+
+/// \brief Counts the SerAPI commands in the content of a forward request. Sertop reads one command per s-expression,
+/// wherever the lines break.
+/// \param content The content, like <tt>(Add () "Lemma a : True.")\n(Exec 2)\n</tt>.
+/// \return The number of top-level atoms and lists.
+std::size_t count_commands(std::string_view content);
+
+/// \brief Checks whether sertop is done with a command.
+/// \param answer An answer read from sertop.
+/// \return \c true if it is the Completed answer to the command, like <tt>(Answer 3 Completed)</tt>, or an
+/// <tt>Of_sexp_error</tt>, which sertop sends instead of any answer if it cannot read the command.
+bool ends_command(std::string_view answer);
+
+/// \brief Checks whether a SerAPI command may change the state of sertop.
+/// \param command The command, like <tt>(Query () Goals)</tt>, possibly tagged, like <tt>(q1 (Query () Goals))</tt>.
+/// \return \c false if it is known not to.
+bool changes_state(std::string_view command);
+
+/// \brief Returns the state id in an Added answer, which SerAPI sends for every sentence of an Add command.
+/// \param answer An answer read from sertop, like <tt>(Answer 2 (Added 3 loc NewTip))</tt>.
+/// \return The state id, or an empty optional if this is not an Added answer.
+std::optional<uint64_t> added_state(std::string_view answer);
+
+} // namespace wpwrapper::serapi
+
+#endif // WPWRAPPER_SERAPI_H
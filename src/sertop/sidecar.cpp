@@ -0,0 +1,113 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "sidecar.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "serapi.h"
+
+namespace wpwrapper {
+
+bool sidecar::ready() const noexcept
+{
+    return static_cast<bool>(worker_);
+}
+
+std::size_t sidecar::waiting() const noexcept
+{
+    return waiting_.size();
+}
+
+void sidecar::mirror(std::string command, bool query)
+{
+    if (!worker_)
+    {
+        waiting_.push(std::move(command));
+        return;
+    }
+
+    running_.insert(running_.end(), serapi::count_commands(command), query);
+    worker_->enqueue(std::move(command));
+}
+
+void sidecar::attach(std::unique_ptr<worker> w)
+{
+    worker_ = std::move(w);
+    while (!waiting_.empty())
+    {
+        running_.insert(running_.end(), serapi::count_commands(waiting_.front()), false);
+        worker_->enqueue(std::move(waiting_.front()));
+        waiting_.pop();
+    }
+}
+
+std::unique_ptr<worker> sidecar::detach() noexcept
+{
+    return std::move(worker_);
+}
+
+std::size_t sidecar::queries() const noexcept
+{
+    return static_cast<std::size_t>(std::count(running_.begin(), running_.end(), true));
+}
+
+bool sidecar::answering() const noexcept
+{
+    return worker_ && !running_.empty() && running_.front();
+}
+
+bool sidecar::idle() const noexcept
+{
+    return running_.empty();
+}
+
+bool sidecar::track(std::string_view answer)
+{
+    bool query = running_.front();
+    if (serapi::ends_command(answer))
+    {
+        running_.pop_front();
+    }
+    return query;
+}
+
+void sidecar::prioritize(worker::priority background)
+{
+    if (!worker_)
+    {
+        return;
+    }
+
+    // The commands before a query need to run before it can.
+    bool querying = std::find(running_.begin(), running_.end(), true) != running_.end();
+    auto wanted = querying ? worker::priority::interactive : background;
+    if (wanted == priority_)
+    {
+        return;
+    }
+
+    worker_->prioritize(wanted);
+    priority_ = wanted;
+}
+
+void sidecar::interrupt()
+{
+    worker_->interrupt();
+}
+
+} // namespace wpwrapper
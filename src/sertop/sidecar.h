@@ -0,0 +1,103 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_SIDECAR_H
+#define WPWRAPPER_SIDECAR_H
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <queue>
+#include <string>
+#include <string_view>
+
+#include "worker.h"
+
+namespace wpwrapper {
+
+/// \brief A second sertop instance next to the worker of an instance, which answers queries so that they do not hold up
+/// the commands that follow them. It mirrors every command that changes the state of the worker.
+/// \details Commands that are mirrored before the sidecar's worker is ready wait for it. Only the output of queries is
+/// sent to Waterproof.
+class sidecar {
+public:
+    /// \brief Checks whether the sidecar's worker is ready.
+    /// \return \c true if it was attached.
+    bool ready() const noexcept;
+
+    /// \brief Returns the number of mirrored commands that wait for the sidecar's worker.
+    /// \return The number of commands.
+    std::size_t waiting() const noexcept;
+
+    /// \brief Sends a command to the sidecar's worker, or keeps it until the worker is ready.
+    /// \param command The command.
+    /// \param query Set if the command is a query, whose output is sent to Waterproof. Queries are only sent once the
+    /// worker is ready.
+    void mirror(std::string command, bool query);
+
+    /// \brief Attaches the sidecar's worker once it is ready, and sends it the commands that wait for it.
+    /// \param w The worker.
+    void attach(std::unique_ptr<worker> w);
+
+    /// \brief Detaches the sidecar's worker, to retire it.
+    /// \return The worker. Empty if it was not ready.
+    std::unique_ptr<worker> detach() noexcept;
+
+    /// \brief Counts the queries that the sidecar did not answer.
+    /// \return The number of SerAPI commands in queries that did not complete.
+    std::size_t queries() const noexcept;
+
+    /// \brief Checks whether the sidecar is running a query, rather than a command that it mirrors.
+    /// \return \c true if the first command that did not complete is a query.
+    bool answering() const noexcept;
+
+    /// \brief Checks whether the sidecar has completed every command that it was sent.
+    /// \return \c true if no command is running.
+    bool idle() const noexcept;
+
+    /// \brief Keeps track of the commands that the sidecar reports completed.
+    /// \param answer A response read from the sidecar. The sidecar must not be idle.
+    /// \return \c true if the response belongs to a query, and should be sent to Waterproof.
+    bool track(std::string_view answer);
+
+    /// \brief Gives the sidecar's worker interactive priority while a query waits for it, and background priority
+    /// otherwise. Does nothing if the worker is not ready, or already has that priority.
+    /// \param background The priority to give the worker while it only mirrors commands.
+    /// \throw api_error If the priority could not be changed.
+    void prioritize(worker::priority background);
+
+    /// \brief Interrupts the command that the sidecar's worker runs.
+    /// \throw api_error If sertop could not be interrupted.
+    void interrupt();
+
+private:
+    /// \brief The sidecar's worker. Empty while it is being provisioned.
+    std::unique_ptr<worker> worker_;
+
+    /// \brief Mirrored commands that arrived before the worker was ready, in order of arrival.
+    std::queue<std::string> waiting_;
+
+    /// \brief For every SerAPI command sent to the worker that did not complete, in order, whether it is part of a
+    /// query.
+    std::deque<bool> running_;
+
+    /// \brief The priority that the worker was last given.
+    worker::priority priority_ = worker::priority::interactive;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_SIDECAR_H
@@ -0,0 +1,262 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "speculation.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include <fmt/format.h>
+
+#include "serapi.h"
+
+namespace wpwrapper {
+
+bool speculation::hint(std::vector<std::string> commands)
+{
+    // The guesses that the new hint starts with are still useful.
+    std::size_t kept = 0;
+    std::size_t candidates = std::min(doomed_from_.value_or(guesses_.size()), commands.size());
+    while (kept < candidates && guesses_[kept].command_ == commands[kept])
+    {
+        ++kept;
+    }
+    bool interrupt = doom(kept);
+
+    hint_.assign(std::make_move_iterator(commands.begin() + static_cast<std::ptrdiff_t>(kept)),
+            std::make_move_iterator(commands.end()));
+    return interrupt;
+}
+
+std::optional<speculation::guess> speculation::claim(const std::string& command)
+{
+    std::size_t kept = doomed_from_.value_or(guesses_.size());
+    if (kept == 0 || guesses_.front().command_ != command)
+    {
+        return std::nullopt;
+    }
+
+    guess g = std::move(guesses_.front());
+    guesses_.pop_front();
+    if (doomed_from_)
+    {
+        --*doomed_from_;
+    }
+    return g;
+}
+
+bool speculation::follow(const std::string& command)
+{
+    if (!guesses_.empty() || cancelling_ || !held_.empty())
+    {
+        return false;
+    }
+
+    // Sertop did not get ahead of the user. The hint follows the user as long as it is right.
+    if (!hint_.empty() && hint_.front() == command)
+    {
+        hint_.pop_front();
+    }
+    else
+    {
+        hint_.clear();
+    }
+    return true;
+}
+
+bool speculation::hold(uint64_t forward, std::string command)
+{
+    // None of the guesses that are left are useful, and neither is the rest of the hint.
+    hint_.clear();
+    bool interrupt = doom(0);
+    held_.emplace(forward, std::move(command));
+    return interrupt;
+}
+
+bool speculation::doom(std::size_t from)
+{
+    if (from >= guesses_.size() || (doomed_from_ && *doomed_from_ <= from))
+    {
+        return false;
+    }
+
+    // The guess that runs was interrupted already if it was doomed before.
+    bool interrupt = !guesses_.back().done_ && !doomed_from_;
+    doomed_from_ = from;
+    return interrupt;
+}
+
+std::optional<std::string> speculation::cancel()
+{
+    if (!doomed_from_)
+    {
+        return std::nullopt;
+    }
+
+    auto doomed = guesses_.begin() + static_cast<std::ptrdiff_t>(*doomed_from_);
+    auto assigned = std::find_if(doomed, guesses_.end(), [](const guess& g)
+    {
+        return !g.states_.empty();
+    });
+    if (assigned == guesses_.end())
+    {
+        return std::nullopt;
+    }
+
+    cancelling_ = fmt::format("(Cancel ({}))\n", assigned->states_.front());
+    return cancelling_;
+}
+
+std::size_t speculation::drop()
+{
+    if (!doomed_from_)
+    {
+        return 0;
+    }
+
+    auto doomed = guesses_.begin() + static_cast<std::ptrdiff_t>(*doomed_from_);
+    auto dropped = static_cast<std::size_t>(guesses_.end() - doomed);
+    guesses_.erase(doomed, guesses_.end());
+    doomed_from_.reset();
+    return dropped;
+}
+
+std::queue<std::pair<uint64_t, std::string>> speculation::release()
+{
+    return std::exchange(held_, {});
+}
+
+const speculation::guess* speculation::next(std::size_t ahead)
+{
+    while (!hint_.empty() && guesses_.size() < ahead)
+    {
+        guess g;
+        g.command_ = std::move(hint_.front());
+        hint_.pop_front();
+        g.unanswered_ = serapi::count_commands(g.command_);
+        if (g.unanswered_ == 0)
+        {
+            // Never forwarded either.
+            continue;
+        }
+
+        g.changes_state_ = serapi::changes_state(g.command_);
+        guesses_.push_back(std::move(g));
+        return &guesses_.back();
+    }
+    return nullptr;
+}
+
+std::optional<std::size_t> speculation::record(std::string_view answer, journal* j)
+{
+    bool done = serapi::ends_command(answer);
+
+    if (cancelling_)
+    {
+        if (!done)
+        {
+            return std::nullopt;
+        }
+
+        // Replaying the cancelled guesses and the Cancel command hands out state ids like sertop did.
+        if (j != nullptr)
+        {
+            j->append(*cancelling_, {});
+        }
+        cancelling_.reset();
+        return drop();
+    }
+
+    guess& g = guesses_.back();
+    if (auto state = serapi::added_state(answer))
+    {
+        g.states_.push_back(*state);
+    }
+    g.answers_.emplace_back(answer);
+    if (!done || --g.unanswered_ > 0)
+    {
+        return std::nullopt;
+    }
+
+    // A guess that was interrupted before it assigned a state id is not cancelled, and so not replayed either.
+    g.done_ = true;
+    bool doomed = doomed_from_ && *doomed_from_ < guesses_.size();
+    if (j != nullptr && g.changes_state_ && !(doomed && g.states_.empty()))
+    {
+        g.journaled_commands_ = j->commands().size();
+        g.journaled_states_ = j->states().size();
+        j->append(g.command_, g.states_);
+        g.journaled_ = true;
+    }
+    return 0;
+}
+
+void speculation::forget(journal& j) const
+{
+    auto first = std::find_if(guesses_.begin(), guesses_.end(), [](const guess& g)
+    {
+        return g.journaled_;
+    });
+    if (first == guesses_.end())
+    {
+        return;
+    }
+
+    j.truncate(first->journaled_commands_, first->journaled_states_);
+}
+
+void speculation::rewind(journal& j)
+{
+    forget(j);
+    for (auto g = guesses_.rbegin(); g != guesses_.rend(); ++g)
+    {
+        hint_.push_front(std::move(g->command_));
+    }
+    guesses_.clear();
+}
+
+bool speculation::running() const noexcept
+{
+    return cancelling_ || (!guesses_.empty() && !guesses_.back().done_);
+}
+
+bool speculation::settled() const noexcept
+{
+    return guesses_.empty() && held_.empty();
+}
+
+std::optional<std::string> speculation::in_flight() const
+{
+    if (cancelling_)
+    {
+        return cancelling_;
+    }
+    if (running() && guesses_.back().changes_state_)
+    {
+        return guesses_.back().command_;
+    }
+    return std::nullopt;
+}
+
+std::size_t speculation::ahead() const noexcept
+{
+    return static_cast<std::size_t>(std::count_if(guesses_.begin(), guesses_.end(), [](const guess& g)
+    {
+        return g.done_;
+    }));
+}
+
+} // namespace wpwrapper
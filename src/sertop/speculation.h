@@ -0,0 +1,170 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_SPECULATION_H
+#define WPWRAPPER_SPECULATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "journal.h"
+
+namespace wpwrapper {
+
+/// \brief Bookkeeping for an instance that Waterproof sent a hint to.
+/// \details Sertop runs one hinted command at a time while it is idle. Once the user moves elsewhere, the guesses past
+/// that point are cancelled. The forward requests that arrive in the meantime are held back until then. This class
+/// only decides what sertop should run; sending it is up to the caller.
+class speculation {
+public:
+    /// \brief A command that sertop ran ahead of the user, because Waterproof hinted that it comes next.
+    struct guess {
+        /// \brief The command, exactly as it is expected to be forwarded.
+        std::string command_;
+
+        /// \brief What sertop answered so far.
+        std::vector<std::string> answers_;
+
+        /// \brief The state ids that sertop assigned while executing the command.
+        std::vector<uint64_t> states_;
+
+        /// \brief Set if the command may change the state of sertop, like forward requests that are journaled.
+        bool changes_state_ = false;
+
+        /// \brief The number of SerAPI commands in the command that sertop has not completed yet.
+        std::size_t unanswered_ = 0;
+
+        /// \brief Set once sertop reported the command completed.
+        bool done_ = false;
+
+        /// \brief Set once the command was journaled, which happens when it completed.
+        bool journaled_ = false;
+
+        /// \brief The number of commands in the journal before this one was appended to it.
+        std::size_t journaled_commands_ = 0;
+
+        /// \brief The number of state ids in the journal before the ones of this command were appended to it.
+        std::size_t journaled_states_ = 0;
+    };
+
+    /// \brief Replaces the hint. The guesses that the new hint starts with are kept, the others are doomed.
+    /// \param commands The commands that Waterproof expects to forward next, in order.
+    /// \return \c true if the guess that sertop runs is doomed, and should be interrupted.
+    bool hint(std::vector<std::string> commands);
+
+    /// \brief Takes the first guess if the user forwards its command.
+    /// \param command The content of the forward request.
+    /// \return The guess, which sertop may still run. Empty if the forward request does not match it, or it is doomed.
+    std::optional<guess> claim(const std::string& command);
+
+    /// \brief Checks whether a forward request that was not claimed can go to sertop right away, and moves the hint
+    /// along with the user.
+    /// \param command The content of the forward request.
+    /// \return \c true if sertop did not get ahead of the user, \c false if the forward request should be held.
+    bool follow(const std::string& command);
+
+    /// \brief Holds a forward request back until the guesses are cancelled, dooming them all, as the user moved
+    /// elsewhere. The rest of the hint is dropped.
+    /// \param forward The number of the forward request.
+    /// \param command The content of the forward request.
+    /// \return \c true if the guess that sertop runs was doomed, and should be interrupted.
+    bool hold(uint64_t forward, std::string command);
+
+    /// \brief Marks guesses to be cancelled.
+    /// \param from The first guess to cancel.
+    /// \return \c true if the guess that sertop runs was doomed, and should be interrupted.
+    bool doom(std::size_t from);
+
+    /// \brief Starts cancelling the doomed guesses, if sertop assigned a state id to any of them. Cancelling the first
+    /// state that sertop assigned past the point the user moved to cancels the ones after it.
+    /// \return The Cancel command to send to sertop. Empty if there is nothing to cancel.
+    std::optional<std::string> cancel();
+
+    /// \brief Drops the doomed guesses, which sertop did not assign a state id to, or whose state was cancelled.
+    /// \return The number of guesses dropped.
+    std::size_t drop();
+
+    /// \brief Releases the forward requests that were held back.
+    /// \return The numbers and contents of the forward requests, in order.
+    std::queue<std::pair<uint64_t, std::string>> release();
+
+    /// \brief Starts the next hinted command, if sertop is not too far ahead of the user already.
+    /// \param ahead The number of guesses that sertop may run ahead of the user.
+    /// \return The guess, whose command is to be sent to sertop. Empty if there is none.
+    const guess* next(std::size_t ahead);
+
+    /// \brief Keeps the output of the guess or the Cancel command that sertop runs, which is not sent to Waterproof.
+    /// \param answer A response read from sertop.
+    /// \param j The journal to append the command to once it completed. Null if there is none.
+    /// \return The number of guesses that were cancelled, zero for a guess, once the command completed. Empty while it
+    /// runs.
+    std::optional<std::size_t> record(std::string_view answer, journal* j);
+
+    /// \brief Drops the guesses that sertop completed from a journal, for a sertop instance that will not run them.
+    /// Only guesses, and the Cancel commands of those that were cancelled, follow the first one in the journal.
+    /// \param j The journal of the instance, or a copy of it.
+    void forget(journal& j) const;
+
+    /// \brief Forgets the guesses, and puts their commands back in front of the hint, for a new sertop instance to run
+    /// them again once it replayed the journal.
+    /// \param j The journal of the instance.
+    void rewind(journal& j);
+
+    /// \brief Checks whether sertop is running a guess or a Cancel command.
+    /// \return \c true if it is. The output of sertop then does not answer a forward request.
+    bool running() const noexcept;
+
+    /// \brief Checks whether no guesses and held forward requests are left.
+    /// \return \c true if none are.
+    bool settled() const noexcept;
+
+    /// \brief Returns the command that sertop runs ahead of the user, if it may change the state of sertop.
+    /// \return The guess or the Cancel command. Empty if there is none.
+    std::optional<std::string> in_flight() const;
+
+    /// \brief Counts the guesses that sertop completed, which wait for the user.
+    /// \return The number of guesses.
+    std::size_t ahead() const noexcept;
+
+private:
+    /// \brief The hinted commands that sertop did not run yet, in order.
+    std::deque<std::string> hint_;
+
+    /// \brief The commands that sertop ran ahead of the user, and that were not forwarded yet, in order. Only the last
+    /// one may still be running.
+    std::deque<guess> guesses_;
+
+    /// \brief The first guess that the user moved away from, if any. It and the ones after it are cancelled once no
+    /// guess is running.
+    std::optional<std::size_t> doomed_from_;
+
+    /// \brief The Cancel command that sertop is running, if any. Its output is dropped.
+    std::optional<std::string> cancelling_;
+
+    /// \brief The numbers and contents of the forward requests that wait for the guesses to be cancelled.
+    std::queue<std::pair<uint64_t, std::string>> held_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_SPECULATION_H
@@ -16,121 +16,54 @@
 
 #include "worker.h"
 
-#include <optional>
+#include <array>
+#include <cstddef>
+#include <memory_resource>
 
 namespace wpwrapper {
 
-void worker::enqueue(const std::string& message)
+unsigned int worker::id() const noexcept
 {
-    {
-        std::lock_guard<std::mutex> guard(message_queue_mutex_);
-        message_queue_.push(message);
-    }
-    cv_.notify_one();
+    return id_;
 }
 
-std::string worker::parse(std::vector<char> buffer, int read, const std::string& prefix)
+std::string worker::parse(const std::vector<char>& buffer, int read, const std::string& prefix)
 {
-    std::vector<std::string> result;
-    std::string raw_result = prefix;
-
-    // Read buffer into a raw string clear it.
-    raw_result.append(buffer.data(), read);
-    std::fill(buffer.begin(), buffer.end(), 0);
-
-    // Fixes search issue
-    read += prefix.length();
-
-    // Every response is terminated with a null-terminator, so we can count the number of full messages in the buffer.
-    int count = std::count(raw_result.begin(), raw_result.end(), '\0');
-
-    if (count > 0)
+    // The messages are only needed until the callbacks have been executed. They are kept in an arena on the stack,
+    // which is released in one step when parse() returns. Only a message that spans several reads spills to the heap.
+    std::array<std::byte, 1024> storage;
+    std::pmr::monotonic_buffer_resource arena(storage.data(), storage.size());
+
+    // Messages are read straight from the buffer, unless the first one started in a previous read.
+    std::string_view raw(buffer.data(), read);
+    std::pmr::string joined(&arena);
+    if (!prefix.empty())
     {
-        // Worker read at least one full message. We will now read all full messages into the result vector.
-        const char* ptr = raw_result.c_str();
-        for (int i = 0; i < count; ++i)
-        {
-            result.emplace_back(std::string(ptr));
-
-            // Move the pointer to the start of the next message.
-            ptr += result.back().size() + 1;
-            read -= result.back().size() + 1;
-        }
-
-        for (const auto& response: result)
-        {
-            for (const auto& callback: on_response_)
-            {
-                callback(id_, response);
-            }
-        }
-
-        // Return the remaining chars, which will be prefixed the next time parse() is called.
-        return read == 0 ? "" : std::string(ptr, read);
+        joined.reserve(prefix.length() + raw.length());
+        joined.append(prefix).append(raw);
+        raw = joined;
     }
-    else
+
+    // Every response is terminated with a null-terminator, so we can split the buffer into full messages.
+    std::pmr::vector<std::string_view> result(&arena);
+    std::size_t start = 0;
+    for (std::size_t end = raw.find('\0'); end != std::string_view::npos; end = raw.find('\0', start))
     {
-        // Worker did not read any full messages. This happens if the message is longer than the buffer. We return
-        // the full buffer as a prefix for the next parse() call.
-        return raw_result;
+        result.push_back(raw.substr(start, end - start));
+        start = end + 1;
     }
-}
-
-void worker::write_loop() noexcept
-{
-    logger_->debug("started write loop");
 
-    while (running_)
+    for (const auto& response: result)
     {
-        std::optional<std::unique_lock<std::mutex>> lock;
-
-        try
-        {
-            lock.emplace(message_queue_mutex_);
-        }
-        catch (const std::system_error& e)
-        {
-            fail(api_error("failed to acquire lock", 0, logger_));
-            break;
-        }
-
-        // Wait until a new message can be written or we're told to stop.
-        cv_.wait(*lock, [&message_queue = message_queue_, &running = running_]
-        {
-            return !message_queue.empty() || !running;
-        });
-
-        if (!running_)
-        {
-            break;
-        }
-
-        auto message = message_queue_.front();
-        message_queue_.pop();
-
-        try
-        {
-            lock->unlock();
-        }
-        catch (const std::system_error& e)
-        {
-            fail(api_error("failed to unlock lock", 0, logger_));
-            break;
-        }
-
-        try
-        {
-            write(message);
-        }
-        catch (const api_error& e)
+        for (const auto& callback: on_response_)
         {
-            logger_->error(e.what());
-            fail(e);
-            break;
+            callback(id_, response);
         }
     }
 
-    logger_->debug("stopped write loop");
+    // Return the remaining chars, which will be prefixed the next time parse() is called. If the worker did not read
+    // any full message, which happens if the message is longer than the buffer, this is everything read so far.
+    return std::string(raw.substr(start));
 }
 
 } // namespace wpwrapper
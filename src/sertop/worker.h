@@ -18,10 +18,15 @@
 #define WPWRAPPER_WORKER_H
 
 #include <condition_variable>
+#include <cstdint>
 #include <functional>
+#include <future>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -36,6 +41,8 @@
 #elif WPWRAPPER_POSIX
 
 #include "../posix/api.h"
+#include "../posix/cgroup.h"
+#include "../posix/reactor.h"
 
 #endif
 
@@ -46,12 +53,74 @@ class worker {
 public:
     /// \brief A failure callback takes the notifying worker's id and the error that lead to failure as arguments.
     using failure_callback = std::function<void(unsigned int, const api_error&)>;
-    /// \brief A response callback takes the notifying worker's is and the received message as argument.
-    using response_callback = std::function<void(unsigned int, const std::string&)>;
+    /// \brief A response callback takes the notifying worker's is and the received message as argument. The message
+    /// is only valid during the call.
+    using response_callback = std::function<void(unsigned int, std::string_view)>;
+
+    /// \brief How much memory a sertop instance uses, in bytes.
+    struct memory_usage {
+        /// \brief The resident set size.
+        uint64_t resident_;
+        /// \brief The part of the resident set that is backed by files, such as the binary and shared libraries.
+        uint64_t shared_;
+    };
+
+    /// \brief How eagerly the operating system schedules a sertop instance.
+    enum class priority {
+        /// \brief Sertop runs a request that a user waits for. Sertop starts with this priority.
+                interactive,
+        /// \brief Sertop is idle or runs background requests, and gives way to interactive instances when the
+        /// processors are busy.
+                background,
+        /// \brief Sertop only runs when no other process wants to.
+                idle
+    };
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief What another wrapper process needs to take over a running sertop instance.
+    struct snapshot {
+        /// \brief Sertop process id.
+        pid_t sertop_instance_;
+        /// \brief The write end of the pipe to sertop.
+        int stdin_fd_;
+        /// \brief The read end of the pipe from sertop.
+        int stdout_fd_;
+        /// \brief The start of a message that sertop has not finished writing yet.
+        std::string remainder_;
+        /// \brief The path of the control group that holds sertop. Empty if it has none.
+        std::string cgroup_;
+        /// \brief The core that sertop is pinned to. Empty if it is not.
+        std::optional<unsigned int> core_;
+        /// \brief A file descriptor that refers to the sertop process, or -1 if the system does not support them.
+        int pidfd_;
+    };
+#endif
+
+    /// \brief Where sertop runs, and what its pipes are served by. Empty on Windows, where every worker reads and
+    /// writes on threads of its own.
+    struct environment {
+#ifdef WPWRAPPER_POSIX
+        /// \brief The reactor on which the worker's coroutines run.
+        std::shared_ptr<reactor> reactor_;
+
+        /// \brief The control group to start sertop in, which the worker removes once sertop has shut down. Only on
+        /// Ubuntu. Empty to start sertop in the control group of the wrapper.
+        std::unique_ptr<cgroup> group_;
+
+        /// \brief The core to pin sertop to. Only on Ubuntu. Empty to let sertop run on any of the shared cores.
+        std::optional<unsigned int> core_;
+
+        /// \brief The cores that sertop may run on if it is not pinned to one. Only on Ubuntu. Sertop starts out on the
+        /// cores of the thread that constructs the worker, so this keeps it off cores that are reserved for that
+        /// thread. Empty to let sertop run wherever that thread may run.
+        std::vector<unsigned int> shared_;
+#endif
+    };
 
     /// \brief Constructs a worker with an unique identifier \c id.
     /// \details A child process will be created, running a binary \c sertop_path with arguments \c sertop_args.
-    /// Subsequently, two worker threads will be started. If an error occurs in one of those worker threads, the
+    /// Subsequently, reading from and writing to sertop starts: on Windows on two worker threads, on macOS and Ubuntu
+    /// as two coroutines on the reactor of \c env. If an error occurs while reading or writing, the
     /// \c failure_callbacks will be called. If this worker receives a message from sertop, the \c response_callbacks
     /// will be called.
     /// \param id An unique identifier for this worker.
@@ -60,14 +129,33 @@ public:
     /// \param api_instance The API instance to use.
     /// \param failure_callbacks A list of callbacks to execute when an error occurs in any of the worker threads.
     /// \param response_callbacks A list of callbacks to execute when a message is received from sertop.
+    /// \param env Where sertop runs.
     /// \throw api_error If the child process, or the pipe to it, could not be created.
     worker(unsigned int id, const std::string& sertop_path, const std::vector<std::string>& sertop_args,
             std::shared_ptr<api> api_instance, std::vector<failure_callback> failure_callbacks,
-            std::vector<response_callback> response_callbacks);
+            std::vector<response_callback> response_callbacks, environment env);
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief Constructs a worker with an unique identifier \c id for a sertop instance that was started by another
+    /// wrapper process, and starts reading from and writing to it.
+    /// \details Sertop is usually not a child of this process, and then cannot be waited for. On destruction, this
+    /// worker only checks whether the process still exists in that case.
+    /// \param id An unique identifier for this worker.
+    /// \param adopted The sertop instance, as released by the other process. This worker takes ownership of its file
+    /// descriptors.
+    /// \param api_instance The API instance to use.
+    /// \param failure_callbacks A list of callbacks to execute when an error occurs in any of the worker threads.
+    /// \param response_callbacks A list of callbacks to execute when a message is received from sertop.
+    /// \param reactor_instance The reactor on which the worker's coroutines run.
+    /// \throw api_error If the pipes to sertop could not be made non-blocking.
+    worker(unsigned int id, snapshot adopted, std::shared_ptr<api> api_instance,
+            std::vector<failure_callback> failure_callbacks, std::vector<response_callback> response_callbacks,
+            std::shared_ptr<reactor> reactor_instance);
+#endif
 
     /// \brief Destructs this worker.
-    /// \details Stops the worker threads. Attempts to gracefully close the sertop process. If that fails, the process
-    /// will be terminated.
+    /// \details Stops reading from and writing to sertop. Attempts to gracefully close the sertop process. If that
+    /// fails, the process will be terminated. A worker that was released only closes its file descriptors.
     ~worker() noexcept;
 
     // Worker is non-copyable.
@@ -82,9 +170,69 @@ public:
     // Worker is non-movable.
     worker& operator=(worker&& other) = delete;
 
+    /// \brief Returns the unique identifier of this worker.
+    /// \return The identifier.
+    unsigned int id() const noexcept;
+
     /// \brief Add a message to be sent to the sertop instance.
     /// \param message The message to add.
-    void enqueue(const std::string& message);
+    void enqueue(std::string message);
+
+    /// \brief Interrupts the computation that sertop is running, which Coq handles as a user break.
+    /// \details On macOS and Ubuntu, sertop receives SIGINT. Not supported on Windows, where sertop has no console to
+    /// send a break to.
+    /// \throw api_error If sertop could not be interrupted.
+    void interrupt();
+
+    /// \brief Samples how much memory sertop uses.
+    /// \details On Ubuntu, reads <tt>/proc/[pid]/statm</tt>, which takes constant time, no matter how large sertop
+    /// grows. Not supported on macOS and Windows.
+    /// \return The memory usage.
+    /// \throw api_error If the memory usage could not be read.
+    memory_usage memory() const;
+
+    /// \brief Changes how eagerly the operating system schedules sertop.
+    /// \details On Ubuntu, sets the scheduling policy of sertop to \c SCHED_OTHER, \c SCHED_BATCH or \c SCHED_IDLE,
+    /// and its I/O priority to the highest best-effort level, the lowest best-effort level or the idle class. Leaving
+    /// \c SCHED_IDLE needs \c CAP_SYS_NICE or a high \c RLIMIT_NICE, see can_leave(). On Windows, sets the priority
+    /// class of sertop to normal, below normal or idle. Not supported on macOS.
+    /// \param p The priority.
+    /// \throw api_error If the priority could not be changed.
+    void prioritize(priority p);
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief Checks whether this process may raise the priority of a sertop instance back to interactive after it
+    /// was lowered to \c p.
+    /// \details Tries it on a short-lived thread of this process.
+    /// \param api_instance The API instance to use.
+    /// \param p The priority.
+    /// \return \c true if it may.
+    static bool can_leave(const std::shared_ptr<api>& api_instance, priority p);
+
+    /// \brief Moves sertop to another core.
+    /// \details Threads that sertop has started already stay where they are, but Coq checks proofs on the main thread.
+    /// \param core The core.
+    /// \throw api_error If sertop could not be moved. Always on macOS.
+    void pin(unsigned int core);
+
+    /// \brief Returns the core that sertop is pinned to.
+    /// \return The core, or an empty optional if sertop may run on any core.
+    std::optional<unsigned int> core() const noexcept;
+
+    /// \brief Reads what the control group of sertop has used.
+    /// \return The usage, or an empty optional if sertop has no control group of its own.
+    /// \throw api_error If the usage could not be read.
+    std::optional<cgroup::usage> cgroup_usage() const;
+#endif
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief Stops reading from sertop, writes the messages that are still queued, and gives up the sertop instance so
+    /// that another wrapper process can take it over.
+    /// \details Output that sertop writes from now on stays in the pipe, and is read by the process that takes over.
+    /// Messages that are enqueued after this call are dropped.
+    /// \return The sertop instance. Its file descriptors stay open until this worker is destructed.
+    snapshot release();
+#endif
 
 private:
 
@@ -96,7 +244,7 @@ private:
 
 #endif
 
-    /// \brief Executes on_failure callbacks and stops all worker threads.
+    /// \brief Executes on_failure callbacks and stops reading from and writing to sertop.
     /// \param error The error that lead to failure.
     void fail(const api_error& error);
 
@@ -112,7 +260,9 @@ private:
     /// \param read The number of bytes read into the buffer.
     /// \param prefix The first part of a message which was not fully read in the previous parse call.
     /// \return The first part of a not-null-terminated, and hence incomplete, message.
-    std::string parse(std::vector<char> buffer, int read, const std::string& prefix);
+    std::string parse(const std::vector<char>& buffer, int read, const std::string& prefix);
+
+#ifdef WPWRAPPER_WIN
 
     /// \brief Writes a string to sertop.
     /// \param s The string to write.
@@ -127,6 +277,71 @@ private:
     /// \note Should be executed on a separate thread.
     void write_loop() noexcept;
 
+#elif WPWRAPPER_POSIX
+
+    /// \brief Suspends the write pipeline until a message is queued or the worker stops.
+    struct message_awaiter {
+        worker& worker_;
+
+        bool await_ready() const noexcept
+        {
+            return worker_.stopping_ || worker_.releasing_ != nullptr || !worker_.message_queue_.empty();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) noexcept
+        {
+            worker_.writer_idle_ = handle;
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    /// \brief Performs subsequent reads from sertop, whenever its output becomes readable.
+    /// \note Runs on the reactor thread.
+    detached read_pipeline();
+
+    /// \brief Writes messages to sertop whenever they become available and sertop's input can accept them.
+    /// \note Runs on the reactor thread.
+    detached write_pipeline();
+
+    /// \brief Makes both pipelines finish. Executed on the reactor thread.
+    void stop_pipelines();
+
+    /// \brief Sends a signal to sertop, through its pidfd if it has one.
+    /// \param sig The signal to send.
+    /// \return 0 on success, -1 on failure, with \c errno set.
+    int send_signal(int sig) const noexcept;
+
+    /// \brief Checks whether sertop has exited, without reaping it.
+    /// \details Without a pidfd, an adopted sertop process is considered gone once it cannot be signalled anymore,
+    /// which is not reliable if its pid has been reused.
+    /// \return \c true if sertop has exited.
+    bool exited() const noexcept;
+
+    /// \brief How long sertop gets to shut down once its stdin is closed, and again after each signal that follows.
+    static constexpr std::chrono::milliseconds shutdown_step{500};
+
+    /// \brief How often a sertop process without a pidfd is checked while it shuts down.
+    static constexpr std::chrono::milliseconds shutdown_poll_interval{1};
+
+    /// \brief Waits for a sertop process whose pipes were closed to shut down, reaps it, and removes its control group.
+    /// \details If sertop does not shut down in time, it is sent SIGTERM, and then SIGKILL. Runs on the reactor thread,
+    /// so that the thread that destructs the worker is not held up: the reactor waits for the pidfd, or, without one,
+    /// checks every shutdown_poll_interval. Owns everything it needs, so the worker may be gone in the meantime.
+    /// \param r The reactor that runs the coroutine.
+    /// \param api The API instance to use.
+    /// \param logger The logger of the worker.
+    /// \param pid The sertop process id.
+    /// \param pidfd A pidfd for the sertop process, which is closed once done. -1 if there is none.
+    /// \param adopted Whether sertop was started by another wrapper process, and is reaped by its new parent.
+    /// \param group The control group that holds sertop. Empty if there is none.
+    static detached reap(reactor& r, std::shared_ptr<api> api, std::shared_ptr<spdlog::logger> logger, pid_t pid,
+            int pidfd, bool adopted, std::unique_ptr<cgroup> group);
+
+#endif
+
     /// \brief An unique identifier for this worker.
     unsigned int id_;
     /// \brief \c true if the worker threads should be running, \c false if they should not be.
@@ -143,7 +358,10 @@ private:
     std::vector<response_callback> on_response_;
 
     /// \brief FIFO queue containing all messages that have been added but not sent.
+    /// \note On macOS and Ubuntu, only accessed on the reactor thread.
     std::queue<std::string> message_queue_;
+
+#ifdef WPWRAPPER_WIN
     /// \brief Guards the message queue.
     mutable std::mutex message_queue_mutex_;
 
@@ -155,7 +373,6 @@ private:
     /// \brief Thread on which the write loop is executed.
     std::thread write_thread_;
 
-#ifdef WPWRAPPER_WIN
     /// \brief Handle to sertop's end of the pipe.
     HANDLE pipe_worker_end_;
     /// \brief Handle to the worker's end of the pipe.
@@ -179,10 +396,35 @@ private:
     int stdin_fd_[2];
     /// \brief File descriptors for the read and write ends of the pipe from sertop.
     int stdout_fd_[2];
-    /// \brief File descriptors for the read and write ends of the interrupt pipe.
-    int interrupt_fd_[2];
     /// \brief Sertop process id.
     pid_t sertop_instance_;
+    /// \brief Refers to the sertop process, so that it is signalled and watched even if sertop is not a child of this
+    /// process, and its pid could be reused once it has exited. -1 if the system does not support pidfds.
+    int pidfd_;
+
+    /// \brief The reactor on which the read and write pipelines run.
+    std::shared_ptr<reactor> reactor_;
+    /// \brief Set when the pipelines should finish.
+    /// \note Only accessed on the reactor thread.
+    bool stopping_;
+    /// \brief The write pipeline, while it waits for a message.
+    /// \note Only accessed on the reactor thread.
+    std::coroutine_handle<> writer_idle_;
+    /// \brief The start of a message that sertop has not finished writing yet.
+    /// \note Only accessed on the reactor thread.
+    std::string remainder_;
+    /// \brief Set while the worker is being released. Fulfilled by the write pipeline once the queue is empty.
+    /// \note Only accessed on the reactor thread.
+    std::promise<void>* releasing_;
+    /// \brief Set once the worker has been released. Sertop is then left alone on destruction.
+    bool released_;
+    /// \brief Set if sertop was started by another wrapper process.
+    bool adopted_;
+    /// \brief The core that sertop is pinned to, if any.
+    std::optional<unsigned int> core_;
+    /// \brief The control group that holds sertop. Handed to reap() on destruction, which removes it once sertop has
+    /// shut down.
+    std::unique_ptr<cgroup> cgroup_;
 #endif
 };
 
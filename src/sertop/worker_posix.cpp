@@ -17,27 +17,36 @@
 #include "worker.h"
 
 #include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <future>
+#include <utility>
 
 #include "../utils/buffers.h"
 
 namespace wpwrapper {
 
+#ifdef __linux__
+
+// From linux/ioprio.h, which older kernel headers do not have.
+constexpr int ioprio_who_process = 1;
+constexpr int ioprio_class_shift = 13;
+constexpr int ioprio_class_be = 2;
+constexpr int ioprio_class_idle = 3;
+
+#endif
+
 worker::worker(unsigned int id, const std::string& sertop_path, const std::vector<std::string>& sertop_args,
         std::shared_ptr<wpwrapper::api> api_instance,
         std::vector<wpwrapper::worker::failure_callback> failure_callbacks,
-        std::vector<wpwrapper::worker::response_callback> response_callbacks)
+        std::vector<wpwrapper::worker::response_callback> response_callbacks, wpwrapper::worker::environment env)
         :id_(id), running_(false), api_(std::move(api_instance)),
-         on_failure_(std::move(failure_callbacks)), on_response_(std::move(response_callbacks))
+         on_failure_(std::move(failure_callbacks)), on_response_(std::move(response_callbacks)), pidfd_(-1),
+         reactor_(std::move(env.reactor_)), stopping_(false), releasing_(nullptr), released_(false),
+         adopted_(false), core_(env.core_), cgroup_(std::move(env.group_))
 {
     logger_ = spdlog::get("main")->clone(fmt::format("worker{}", id));
 
-    // Create interrupt pipe.
-    if (api_->pipe(interrupt_fd_) < 0)
-    {
-        throw api_error("failed to create interrupt pipe", errno);
-    }
-
     // Create pipes from and to sertop.
     if (api_->pipe(stdin_fd_) < 0)
     {
@@ -51,6 +60,40 @@ worker::worker(unsigned int id, const std::string& sertop_path, const std::vecto
         throw api_error("failed to create pipe to sertop", errno);
     }
 
+    // Close the pipe handles after an exec() call. Otherwise, sertop instances started later inherit them, and this
+    // sertop instance never sees its stdin being closed by the worker. The child's stdin and stdout are dup2() copies,
+    // which do not inherit the flag.
+    for (int fd: {stdin_fd_[0], stdin_fd_[1], stdout_fd_[0], stdout_fd_[1]})
+    {
+        if (api_->fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+        {
+            int err = errno;
+            for (int other: {stdin_fd_[0], stdin_fd_[1], stdout_fd_[0], stdout_fd_[1]})
+            {
+                api_->close(other);
+            }
+            throw api_error("failed to set FD_CLOEXEC on pipe to sertop", err);
+        }
+    }
+
+#ifdef __linux__
+    // Built before forking, so that the child only needs a single system call. Without one, sertop would stay on the
+    // cores of the thread that forks it.
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (core_)
+    {
+        CPU_SET(*core_, &mask);
+    }
+    else
+    {
+        for (unsigned int c: env.shared_)
+        {
+            CPU_SET(c, &mask);
+        }
+    }
+#endif
+
     // Create sertop instance.
     sertop_instance_ = api_->fork();
 
@@ -69,8 +112,6 @@ worker::worker(unsigned int id, const std::string& sertop_path, const std::vecto
         // We're the child process.
 
         // We can't / won't read from our stdout nor write to our stdin.
-        api_->close(interrupt_fd_[0]);
-        api_->close(interrupt_fd_[1]);
         api_->close(stdin_fd_[1]);
         api_->close(stdout_fd_[0]);
 
@@ -82,6 +123,19 @@ worker::worker(unsigned int id, const std::string& sertop_path, const std::vecto
         api_->close(stdin_fd_[0]);
         api_->close(stdout_fd_[1]);
 
+        // Sertop must not escape its limits.
+        if (cgroup_ && !cgroup_->enter())
+        {
+            api_->_exit(1);
+        }
+
+#ifdef __linux__
+        if (CPU_COUNT(&mask) > 0 && api_->sched_setaffinity(0, sizeof(mask), &mask) < 0)
+        {
+            api_->_exit(1);
+        }
+#endif
+
         // 0: path
         // 1: --print0
         // 2..n-1: sertop_params
@@ -112,218 +166,543 @@ worker::worker(unsigned int id, const std::string& sertop_path, const std::vecto
     api_->close(stdin_fd_[0]);
     api_->close(stdout_fd_[1]);
 
-    // Start the worker threads.
-    running_ = true;
-    read_thread_ = std::thread(&worker::read_loop, this);
-    write_thread_ = std::thread(&worker::write_loop, this);
-}
+    // Sertop is not reaped before the worker is destructed, so its pid cannot have been reused yet. Without pidfds, it
+    // is signalled by its pid.
+    pidfd_ = api_->pidfd_open(sertop_instance_, 0);
 
-worker::~worker() noexcept
-{
-    // Signal worker threads to stop.
-    if (running_)
+    // The pipelines wait for the reactor instead of blocking. Sertop's ends of the pipes are separate open file
+    // descriptions, so sertop is not affected.
+    for (int fd: {stdin_fd_[1], stdout_fd_[0]})
     {
+        int flags = api_->fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || api_->fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
         {
-            std::lock_guard<std::mutex> guard(message_queue_mutex_);
-            running_ = false;
+            int err = errno;
+            api_->close(stdin_fd_[1]);
+            api_->close(stdout_fd_[0]);
+            api_->kill(sertop_instance_, SIGTERM);
+            api_->waitpid(sertop_instance_, nullptr, 0);
+            if (pidfd_ >= 0)
+            {
+                api_->close(pidfd_);
+            }
+            throw api_error("failed to make pipe to sertop non-blocking", err);
         }
-        cv_.notify_one();
+    }
 
-        // Closing the write end of the interrupt pipe will cause an POLLUP event in the read thread.
-        char c = '\01';
-        int written = 0;
-        while (written == 0)
-        {
-            written = api_->write(interrupt_fd_[1], &c, 1);
+    // Start the pipelines.
+    running_ = true;
+    reactor_->spawn(read_pipeline());
+    reactor_->spawn(write_pipeline());
+}
 
-            if (written < 0)
-            {
-                logger_->error("unable to write to interrupt pipe (error code: {})", errno);
-                break;
-            }
+worker::worker(unsigned int id, wpwrapper::worker::snapshot adopted, std::shared_ptr<wpwrapper::api> api_instance,
+        std::vector<wpwrapper::worker::failure_callback> failure_callbacks,
+        std::vector<wpwrapper::worker::response_callback> response_callbacks,
+        std::shared_ptr<wpwrapper::reactor> reactor_instance)
+        :id_(id), running_(false), api_(std::move(api_instance)),
+         on_failure_(std::move(failure_callbacks)), on_response_(std::move(response_callbacks)),
+         stdin_fd_{-1, adopted.stdin_fd_}, stdout_fd_{adopted.stdout_fd_, -1},
+         sertop_instance_(adopted.sertop_instance_), pidfd_(adopted.pidfd_), reactor_(std::move(reactor_instance)),
+         stopping_(false),
+         remainder_(std::move(adopted.remainder_)), releasing_(nullptr), released_(false), adopted_(true),
+         core_(adopted.core_),
+         cgroup_(adopted.cgroup_.empty() ? nullptr : std::make_unique<wpwrapper::cgroup>(api_, adopted.cgroup_))
+{
+    logger_ = spdlog::get("main")->clone(fmt::format("worker{}", id));
 
-            logger_->debug(written);
+    // The flags live in the open file descriptions, which are shared with the other process, but it does not hurt to
+    // make sure.
+    for (int fd: {stdin_fd_[1], stdout_fd_[0]})
+    {
+        int flags = api_->fcntl(fd, F_GETFL, 0);
+        if (flags < 0 || api_->fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            int err = errno;
+            api_->close(stdin_fd_[1]);
+            api_->close(stdout_fd_[0]);
+            throw api_error("failed to make pipe to sertop non-blocking", err);
         }
     }
 
-    // Wait until worker threads have finished execution.
-    if (read_thread_.joinable())
+    if (pidfd_ < 0)
     {
-        read_thread_.join();
+        // Handed over by an older wrapper process. That process has not reaped sertop, so its pid still refers to it.
+        pidfd_ = api_->pidfd_open(sertop_instance_, 0);
     }
 
-    if (write_thread_.joinable())
+    logger_->debug("adopted sertop process {}", sertop_instance_);
+
+    // Start the pipelines.
+    running_ = true;
+    reactor_->spawn(read_pipeline());
+    reactor_->spawn(write_pipeline());
+}
+
+worker::~worker() noexcept
+{
+    // Make the pipelines finish. They only run on the reactor thread, so once this has been executed there, they are
+    // done, and so is a failure that is being reported. This also holds if the pipelines already stopped by themselves.
+    std::promise<void> stopped;
+    reactor_->post([this, &stopped]
     {
-        write_thread_.join();
-    }
+        stop_pipelines();
+        stopped.set_value();
+    });
+    stopped.get_future().wait();
 
-    logger_->debug("threads joined");
+    logger_->debug("pipelines stopped");
 
     // Close pipe handles to sertop. This will cause the sertop process to shut down gracefully.
     api_->close(stdin_fd_[1]);
     api_->close(stdout_fd_[0]);
 
-    // Verify that the sertop process has shut down. If it is still open after 500ms, terminate it.
-    bool should_terminate = false;
+    if (released_)
+    {
+        // Another wrapper process holds the pipes now, so sertop keeps running.
+        if (pidfd_ >= 0)
+        {
+            api_->close(pidfd_);
+        }
+        return;
+    }
 
-    // This future continuously checks if the sertop process has shut down yet.
-    std::future<bool> future = std::async(std::launch::async,
-            [&logger = logger_, &api = api_, &sertop_instance = sertop_instance_]()
-            {
-                int status;
+    // Sertop shuts down by itself now that its stdin is closed. The reactor waits for that, so that destructing a
+    // worker does not hold up the calling thread, and escalates if sertop takes too long.
+    reactor_->spawn(reap(*reactor_, api_, logger_, sertop_instance_, std::exchange(pidfd_, -1), adopted_,
+            std::move(cgroup_)));
+}
 
-                do
-                {
-                    // This does not block!
-                    if (api->waitpid(sertop_instance, &status, 0) < 0)
-                    {
-                        logger->error("unable to wait for sertop process shutdown (error code: {})", errno);
-                        return false;
-                    }
-                }
-                while (!(WIFEXITED(status) || WIFSIGNALED(status)));
+void worker::enqueue(std::string message)
+{
+    reactor_->post([this, message = std::move(message)]() mutable
+    {
+        message_queue_.push(std::move(message));
+
+        // Wake the write pipeline if it is waiting for a message.
+        if (writer_idle_)
+        {
+            std::exchange(writer_idle_, nullptr).resume();
+        }
+    });
+}
+
+void worker::interrupt()
+{
+    if (send_signal(SIGINT) < 0)
+    {
+        throw api_error("unable to interrupt sertop process", errno, logger_);
+    }
+
+    logger_->debug("interrupted sertop process {}", sertop_instance_);
+}
+
+worker::memory_usage worker::memory() const
+{
+    // Unlike smaps_rollup, which walks the page tables of the process, statm holds counters the kernel keeps anyway.
+    std::string path = fmt::format("/proc/{}/statm", sertop_instance_);
+    int fd = api_->open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw api_error("unable to open memory statistics of sertop process", errno, logger_);
+    }
 
-                return true;
-            });
+    char buffer[256];
+    ssize_t length;
+    do
+    {
+        length = api_->read(fd, buffer, sizeof(buffer) - 1);
+    }
+    while (length < 0 && errno == EINTR);
+
+    int err = errno;
+    api_->close(fd);
+    if (length < 0)
+    {
+        throw api_error("unable to read memory statistics of sertop process", err, logger_);
+    }
+    buffer[length] = '\0';
 
-    switch (future.wait_for(std::chrono::milliseconds(500)))
+    // Sizes in pages: total, resident, shared, text, library (unused), data and dirty (unused).
+    unsigned long long size, resident, shared;
+    if (std::sscanf(buffer, "%llu %llu %llu", &size, &resident, &shared) != 3)
     {
-    case std::future_status::ready:
-        logger_->debug("sertop process shut down gracefully");
+        throw api_error("unable to parse memory statistics of sertop process", 0, logger_);
+    }
+
+    uint64_t page_size = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    return memory_usage{resident * page_size, shared * page_size};
+}
+
+void worker::prioritize(priority p)
+{
+#ifdef __linux__
+    int policy;
+    int ioprio;
+    switch (p)
+    {
+    case priority::interactive:
+        policy = SCHED_OTHER;
+        ioprio = ioprio_class_be << ioprio_class_shift;
         break;
-    case std::future_status::timeout:
-        logger_->warn("timeout while waiting for sertop process shutdown");
-        should_terminate = true;
+    case priority::background:
+        policy = SCHED_BATCH;
+        ioprio = (ioprio_class_be << ioprio_class_shift) | 7;
         break;
-    case std::future_status::deferred:
-        logger_->error("unable to wait for sertop process shutdown");
-        should_terminate = true;
+    default:
+        policy = SCHED_IDLE;
+        ioprio = ioprio_class_idle << ioprio_class_shift;
         break;
     }
 
-    if (should_terminate)
+    // Scheduling calls only take a pid, which may have been reused if an adopted sertop process has exited.
+    if (exited())
     {
-        logger_->info("terminating sertop process");
+        throw api_error("unable to change the priority of sertop process", ESRCH, logger_);
+    }
 
-        // Send sigterm top
-        if (api_->kill(sertop_instance_, SIGTERM) < 0)
-        {
-            logger_->error("unable to terminate sertop instance (error code: {})", errno);
-        }
+    // Only applies to the main thread of sertop, which is the one that checks proofs.
+    sched_param param{};
+    if (api_->sched_setscheduler(sertop_instance_, policy, &param) < 0)
+    {
+        throw api_error("unable to change the scheduling policy of sertop process", errno, logger_);
+    }
+    if (api_->ioprio_set(ioprio_who_process, sertop_instance_, ioprio) < 0)
+    {
+        throw api_error("unable to change the I/O priority of sertop process", errno, logger_);
     }
 
-    // Close remaining open file descriptors.
-    api_->close(interrupt_fd_[0]);
-    api_->close(interrupt_fd_[1]);
+    logger_->debug("changed priority of sertop process {} to {}", sertop_instance_, static_cast<int>(p));
+#else
+    throw api_error("changing the priority of sertop is not supported on macOS", ENOSYS, logger_);
+#endif
 }
 
-void worker::fail(const wpwrapper::api_error& error)
+bool worker::can_leave(const std::shared_ptr<api>& api_instance, priority p)
 {
-    logger_->error("aborting");
-    // Notify worker threads.
+#ifdef __linux__
+    if (p != priority::idle)
     {
-        std::lock_guard<std::mutex> guard(message_queue_mutex_);
-        running_ = false;
+        // Switching between SCHED_OTHER and SCHED_BATCH, and between best-effort I/O levels, is always allowed.
+        return true;
     }
-    cv_.notify_one();
 
-    // Closing the write end of the interrupt pipe will cause an POLLUP event in the read thread.
-    api_->close(interrupt_fd_[1]);
+    bool allowed = false;
+    std::thread probe([&]
+    {
+        // Zero is the calling thread, so the rest of this process is left alone.
+        sched_param param{};
+        allowed = api_instance->sched_setscheduler(0, SCHED_IDLE, &param) == 0
+                  && api_instance->sched_setscheduler(0, SCHED_OTHER, &param) == 0;
+    });
+    probe.join();
+
+    return allowed;
+#else
+    return false;
+#endif
+}
 
-    // Notify subscribers.
-    for (const auto& callback: on_failure_)
+void worker::pin(unsigned int core)
+{
+#ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(core, &mask);
+
+    // Like sched_setscheduler(), this only takes a pid.
+    if (exited())
     {
-        callback(id_, error);
+        throw api_error(fmt::format("unable to pin sertop process to core {}", core), ESRCH, logger_);
+    }
+
+    if (api_->sched_setaffinity(sertop_instance_, sizeof(mask), &mask) < 0)
+    {
+        throw api_error(fmt::format("unable to pin sertop process to core {}", core), errno, logger_);
+    }
+
+    core_ = core;
+    logger_->debug("pinned sertop process {} to core {}", sertop_instance_, core);
+#else
+    throw api_error("pinning sertop to a core is not supported on macOS", ENOSYS, logger_);
+#endif
+}
+
+std::optional<unsigned int> worker::core() const noexcept
+{
+    return core_;
+}
+
+std::optional<cgroup::usage> worker::cgroup_usage() const
+{
+    if (!cgroup_)
+    {
+        return {};
     }
+
+    return cgroup_->sample();
 }
 
-void worker::write(const std::string& s)
+wpwrapper::worker::snapshot worker::release()
 {
-    auto data = s.c_str();
-    ssize_t written;
+    std::promise<void> released;
 
-    ssize_t to_write = s.length();
-    while (to_write > 0)
+    reactor_->post([this, &released]
     {
-        written = api_->write(stdin_fd_[1], data, to_write);
+        if (stopping_)
+        {
+            // Both pipelines already finished.
+            released.set_value();
+            return;
+        }
+
+        releasing_ = &released;
+
+        // Whatever sertop writes from now on is left in the pipe.
+        reactor_->cancel(stdout_fd_[0]);
 
-        if (written < 0)
+        // The write pipeline fulfills the promise once it has written everything.
+        if (writer_idle_)
         {
-            throw api_error("unable to write to sertop", errno);
+            std::exchange(writer_idle_, nullptr).resume();
         }
+    });
+    released.get_future().wait();
+
+    // The pipelines are done, so the reactor thread no longer touches anything.
+    released_ = true;
+    logger_->debug("released sertop process {}", sertop_instance_);
+
+    return snapshot{sertop_instance_, stdin_fd_[1], stdout_fd_[0], remainder_, cgroup_ ? cgroup_->release() : "",
+            core_, pidfd_};
+}
 
-        to_write -= written;
-        // Move pointer to point at next character to write.
-        data += written;
+int worker::send_signal(int sig) const noexcept
+{
+    if (pidfd_ >= 0)
+    {
+        return api_->pidfd_send_signal(pidfd_, sig, nullptr, 0);
     }
+
+    return api_->kill(sertop_instance_, sig);
 }
 
-void worker::read_loop() noexcept
+bool worker::exited() const noexcept
 {
-    logger_->debug("started read loop");
+    if (pidfd_ >= 0)
+    {
+        // A pidfd becomes readable once the process has exited.
+        pollfd waitfd{pidfd_, POLLIN, 0};
+        return api_->poll(&waitfd, 1, 0) > 0;
+    }
 
-    std::vector<char> buffer(4096);
-    std::string remainder;
+    return adopted_ && api_->kill(sertop_instance_, 0) < 0 && errno == ESRCH;
+}
 
-    struct pollfd fds[2];
-    int result;
-    int read;
+detached worker::reap(reactor& r, std::shared_ptr<api> api, std::shared_ptr<spdlog::logger> logger, pid_t pid,
+        int pidfd, bool adopted, std::unique_ptr<cgroup> group)
+{
+    // Checks without blocking, and reaps sertop if it is our child.
+    auto gone = [&]
+    {
+        if (!adopted)
+        {
+            int status;
+            pid_t result = api->waitpid(pid, &status, WNOHANG);
+            if (result < 0)
+            {
+                logger->error("unable to wait for sertop process shutdown (error code: {})", errno);
+            }
+            return result != 0;
+        }
 
-    // Listen for hangups on the interrupt pipe. This happens by default, the events value is ignored.
-    fds[0].fd = interrupt_fd_[0];
-    fds[0].events = POLLIN | POLLHUP | POLLERR;
+        if (pidfd >= 0)
+        {
+            pollfd waitfd{pidfd, POLLIN, 0};
+            return api->poll(&waitfd, 1, 0) > 0;
+        }
 
-    // Listen for readability on the stdout pipe.
-    fds[1].fd = stdout_fd_[0];
-    fds[1].events = POLLIN;
+        return api->kill(pid, 0) < 0 && errno == ESRCH;
+    };
 
-    while (running_)
+    bool exited = false;
+    for (int sig: {0, SIGTERM, SIGKILL})
     {
-        result = api_->poll(fds, 2, -1);
-        if (result < 0)
+        if (sig != 0)
         {
-            fail(api_error("unable to poll pipes", errno, logger_));
-            break;
+            logger->info("{} sertop process {}", sig == SIGTERM ? "terminating" : "killing", pid);
+            if ((pidfd >= 0 ? api->pidfd_send_signal(pidfd, sig, nullptr, 0) : api->kill(pid, sig)) < 0)
+            {
+                logger->error("unable to signal sertop process (error code: {})", errno);
+            }
         }
-        else if (result == 0)
+
+        auto deadline = std::chrono::steady_clock::now() + shutdown_step;
+        while (!(exited = gone()) && std::chrono::steady_clock::now() < deadline)
         {
-            // Spurious wakeup, move to next iteration.
-            continue;
+            if (pidfd >= 0)
+            {
+                // A pidfd becomes readable once the process has exited.
+                co_await r.readable(pidfd, std::chrono::ceil<std::chrono::milliseconds>(
+                        deadline - std::chrono::steady_clock::now()));
+            }
+            else
+            {
+                co_await r.sleep(shutdown_poll_interval);
+            }
         }
 
-        if (fds[0].revents & (POLLIN | POLLHUP | POLLERR))
+        if (exited)
         {
-            // Hangup occurred on interrupt pipe, write end has been closed.
-            logger_->debug("received interrupt");
+            logger->debug(sig == 0 ? "sertop process shut down gracefully" : "sertop process shut down");
             break;
         }
 
-        if (fds[1].revents & POLLIN)
+        logger->warn("timeout while waiting for sertop process shutdown");
+    }
+
+    if (pidfd >= 0)
+    {
+        api->close(pidfd);
+    }
+
+    // The kernel takes a moment to account for the processes that have exited. The destructor logs if it still has
+    // not by then.
+    if (group && exited)
+    {
+        auto deadline = std::chrono::steady_clock::now() + cgroup::removal_timeout;
+        while (!group->remove() && std::chrono::steady_clock::now() < deadline)
         {
-            // There is data to be read on the stdout pipe.
+            co_await r.sleep(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void worker::stop_pipelines()
+{
+    stopping_ = true;
+    running_ = false;
 
-            // Read from the stdout pipe.
-            read = api_->read(stdout_fd_[0], buffer.data(), buffer.size());
+    // Resume whichever pipeline is waiting, so it sees that it needs to stop.
+    reactor_->cancel(stdout_fd_[0]);
+    reactor_->cancel(stdin_fd_[1]);
 
-            if (read < 0)
+    if (writer_idle_)
+    {
+        std::exchange(writer_idle_, nullptr).resume();
+    }
+}
+
+void worker::fail(const wpwrapper::api_error& error)
+{
+    logger_->error("aborting");
+
+    // Stop the other pipeline as well.
+    stop_pipelines();
+
+    // Notify subscribers.
+    for (const auto& callback: on_failure_)
+    {
+        callback(id_, error);
+    }
+}
+
+detached worker::read_pipeline()
+{
+    logger_->debug("started read loop");
+
+    std::vector<char> buffer(4096);
+    ssize_t read;
+
+    while (!stopping_)
+    {
+        if (co_await reactor_->readable(stdout_fd_[0]) == 0 || stopping_)
+        {
+            // Cancelled.
+            break;
+        }
+
+        read = api_->read(stdout_fd_[0], buffer.data(), buffer.size());
+
+        if (read < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
             {
-                fail(api_error("unable to read from sertop", errno, logger_));
-                break;
+                continue;
             }
 
-            // Read message strings from the buffer.
-            remainder = parse(buffer, read, remainder);
-            buffers::clear(buffer);
+            fail(api_error("unable to read from sertop", errno, logger_));
+            break;
         }
-
-        if ((fds[0].revents | fds[1].revents) & POLLERR)
+        else if (read == 0)
         {
-            fail(api_error("unknown error occurred in pipes", 0, logger_));
+            // Sertop closed its output, it is not going to answer anymore.
+            fail(api_error("sertop closed its output", 0, logger_));
             break;
         }
+
+        // Read message strings from the buffer.
+        remainder_ = parse(buffer, read, remainder_);
+        buffers::clear(buffer);
     }
 
     logger_->debug("stopped read loop");
 }
 
+detached worker::write_pipeline()
+{
+    logger_->debug("started write loop");
+
+    while (true)
+    {
+        co_await message_awaiter{*this};
+
+        if (stopping_ || message_queue_.empty())
+        {
+            // Stopped, or released and done writing.
+            break;
+        }
+
+        std::string message = std::move(message_queue_.front());
+        message_queue_.pop();
+
+        const char* data = message.c_str();
+        ssize_t to_write = message.length();
+        ssize_t written;
+
+        while (to_write > 0 && !stopping_)
+        {
+            written = api_->write(stdin_fd_[1], data, to_write);
+
+            if (written < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    // The pipe is full, wait until sertop has read from it.
+                    co_await reactor_->writable(stdin_fd_[1]);
+                    continue;
+                }
+                else if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                fail(api_error("unable to write to sertop", errno, logger_));
+                break;
+            }
+
+            to_write -= written;
+            // Move pointer to point at next character to write.
+            data += written;
+        }
+    }
+
+    logger_->debug("stopped write loop");
+
+    if (releasing_)
+    {
+        std::exchange(releasing_, nullptr)->set_value();
+    }
+}
+
 } // namespace wpwrapper
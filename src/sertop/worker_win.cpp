@@ -16,12 +16,14 @@
 
 #include "worker.h"
 
+#include <optional>
+
 namespace wpwrapper {
 
 worker::worker(unsigned int id, const std::string& sertop_path, const std::vector<std::string>& sertop_args,
         std::shared_ptr<wpwrapper::api> api_instance,
         std::vector<wpwrapper::worker::failure_callback> failure_callbacks,
-        std::vector<wpwrapper::worker::response_callback> response_callbacks)
+        std::vector<wpwrapper::worker::response_callback> response_callbacks, wpwrapper::worker::environment env)
         :id_(id), running_(false), api_(std::move(api_instance)),
          on_failure_(std::move(failure_callbacks)), on_response_(std::move(response_callbacks))
 {
@@ -308,4 +310,104 @@ void worker::read_loop() noexcept
     logger_->debug("stopped read loop");
 }
 
+void worker::enqueue(std::string message)
+{
+    {
+        std::lock_guard<std::mutex> guard(message_queue_mutex_);
+        message_queue_.push(std::move(message));
+    }
+    cv_.notify_one();
+}
+
+void worker::interrupt()
+{
+    throw api_error("interrupting sertop is not supported on Windows", ERROR_NOT_SUPPORTED, logger_);
+}
+
+worker::memory_usage worker::memory() const
+{
+    throw api_error("sampling the memory usage of sertop is not supported on Windows", ERROR_NOT_SUPPORTED, logger_);
+}
+
+void worker::prioritize(priority p)
+{
+    DWORD priority_class;
+    switch (p)
+    {
+    case priority::interactive:
+        priority_class = NORMAL_PRIORITY_CLASS;
+        break;
+    case priority::background:
+        priority_class = BELOW_NORMAL_PRIORITY_CLASS;
+        break;
+    default:
+        priority_class = IDLE_PRIORITY_CLASS;
+        break;
+    }
+
+    if (!api_->SetPriorityClass(sertop_instance_, priority_class))
+    {
+        throw api_error("unable to change the priority class of sertop process", api_->GetLastError(), logger_);
+    }
+
+    logger_->debug("changed priority of sertop process to {}", static_cast<int>(p));
+}
+
+void worker::write_loop() noexcept
+{
+    logger_->debug("started write loop");
+
+    while (running_)
+    {
+        std::optional<std::unique_lock<std::mutex>> lock;
+
+        try
+        {
+            lock.emplace(message_queue_mutex_);
+        }
+        catch (const std::system_error& e)
+        {
+            fail(api_error("failed to acquire lock", 0, logger_));
+            break;
+        }
+
+        // Wait until a new message can be written or we're told to stop.
+        cv_.wait(*lock, [&message_queue = message_queue_, &running = running_]
+        {
+            return !message_queue.empty() || !running;
+        });
+
+        if (!running_)
+        {
+            break;
+        }
+
+        auto message = message_queue_.front();
+        message_queue_.pop();
+
+        try
+        {
+            lock->unlock();
+        }
+        catch (const std::system_error& e)
+        {
+            fail(api_error("failed to unlock lock", 0, logger_));
+            break;
+        }
+
+        try
+        {
+            write(message);
+        }
+        catch (const api_error& e)
+        {
+            logger_->error(e.what());
+            fail(e);
+            break;
+        }
+    }
+
+    logger_->debug("stopped write loop");
+}
+
 } // namespace wpwrapper
@@ -16,6 +16,8 @@
 
 #include "config.h"
 
+#include <algorithm>
+
 namespace wpwrapper {
 
 const uint16_t config::port = 51613;
@@ -41,6 +43,35 @@ config::config(std::string raw_create_options) {
             sertop_path = entered_path;
         }
         sertop_args = j.at("args").get<std::vector<std::string>>();
+
+        if(j.contains("deadline")) {
+            deadline = std::chrono::milliseconds(std::max<int64_t>(j.at("deadline").get<int64_t>(), 0));
+        }
+
+        // Limits are given in MiB.
+        if(j.contains("soft_memory_limit")) {
+            soft_memory_limit = j.at("soft_memory_limit").get<uint64_t>() << 20;
+        }
+        if(j.contains("hard_memory_limit")) {
+            hard_memory_limit = j.at("hard_memory_limit").get<uint64_t>() << 20;
+        }
+
+        if(j.contains("cpu_max")) {
+            cpu_max = j.at("cpu_max").get<std::string>();
+        }
+        if(j.contains("memory_max")) {
+            memory_max = j.at("memory_max").get<uint64_t>() << 20;
+        }
+        if(j.contains("memory_high")) {
+            memory_high = j.at("memory_high").get<uint64_t>() << 20;
+        }
+        if(j.contains("pids_max")) {
+            pids_max = j.at("pids_max").get<uint64_t>();
+        }
+
+        if(j.contains("sidecar")) {
+            sidecar = j.at("sidecar").get<bool>();
+        }
     }
 }
 
@@ -17,6 +17,9 @@
 #ifndef WPWRAPPER_CONFIG_H
 #define WPWRAPPER_CONFIG_H
 
+#include <chrono>
+#include <cstdint>
+#include <optional>
 #include <string>
 #include <vector>
 
@@ -38,6 +41,22 @@ std::string sertop_path;
 
 std::vector<std::string> sertop_args;
 
+// How long forward requests may take by default. Zero or absent means no deadline.
+std::optional<std::chrono::milliseconds> deadline;
+
+// How much memory sertop may use, in bytes, before the client is warned, and before sertop is replaced.
+std::optional<uint64_t> soft_memory_limit;
+std::optional<uint64_t> hard_memory_limit;
+
+// Limits for the control group of sertop, if the wrapper places sertop in one. Memory limits are in bytes.
+std::optional<std::string> cpu_max;
+std::optional<uint64_t> memory_max;
+std::optional<uint64_t> memory_high;
+std::optional<uint64_t> pids_max;
+
+// Whether a second sertop, the sidecar, mirrors the commands that change the state of the first one, to answer queries.
+bool sidecar = false;
+
 };
 
 } // namespace wpwrapper::config
@@ -0,0 +1,223 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "executor.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace wpwrapper {
+
+thread_local executor* executor::current_ = nullptr;
+thread_local std::size_t executor::current_index_ = 0;
+
+executor::executor(unsigned int thread_count)
+        :running_(true), pending_(0), next_queue_(0), next_due_(std::numeric_limits<clock::rep>::max())
+{
+    thread_count = std::max(thread_count, 1u);
+
+    for (unsigned int i = 0; i < thread_count; ++i)
+    {
+        queues_.push_back(std::make_unique<local_queue>());
+    }
+
+    for (std::size_t i = 0; i < thread_count; ++i)
+    {
+        threads_.emplace_back(&executor::run, this, i);
+    }
+}
+
+executor::~executor() noexcept
+{
+    running_ = false;
+
+    for (auto& queue: queues_)
+    {
+        queue->sleeping_ = false;
+        queue->parker_.unpark();
+    }
+
+    for (auto& thread: threads_)
+    {
+        if (thread.joinable())
+        {
+            thread.join();
+        }
+    }
+}
+
+void executor::submit(task t)
+{
+    std::size_t index = current_ == this ? current_index_ : next_queue_++ % queues_.size();
+
+    {
+        std::lock_guard<std::mutex> guard(queues_[index]->mutex_);
+        queues_[index]->tasks_.push_back(std::move(t));
+    }
+
+    pending_.fetch_add(1);
+    wake_one();
+}
+
+void executor::submit_at(clock::time_point when, task t)
+{
+    bool earliest;
+
+    {
+        std::lock_guard<std::mutex> guard(delayed_mutex_);
+        auto delayed = delayed_.emplace(when, std::move(t));
+        earliest = delayed == delayed_.begin();
+        if (earliest)
+        {
+            next_due_ = when.time_since_epoch().count();
+        }
+    }
+
+    // Sleeping threads may be waiting for a later moment. One of them needs to wait for this one instead.
+    if (earliest)
+    {
+        wake_one();
+    }
+}
+
+void executor::run(std::size_t index) noexcept
+{
+    current_ = this;
+    current_index_ = index;
+
+    local_queue& own = *queues_[index];
+
+    while (true)
+    {
+        submit_due();
+
+        task t;
+
+        if (take(index, t))
+        {
+            t();
+            continue;
+        }
+
+        // Remaining tasks are still executed when the executor is stopping.
+        if (!running_ && pending_ == 0)
+        {
+            break;
+        }
+
+        // Announce that we are about to sleep, then check again: a task submitted in the meantime either sees the
+        // announcement and wakes us, or is seen here.
+        own.sleeping_ = true;
+        if (pending_ > 0 || !running_)
+        {
+            own.sleeping_ = false;
+            continue;
+        }
+
+        clock::rep due = next_due_;
+        if (due == std::numeric_limits<clock::rep>::max())
+        {
+            own.parker_.park();
+        }
+        else
+        {
+            own.parker_.park_for(clock::time_point(clock::duration(due)) - clock::now());
+        }
+        own.sleeping_ = false;
+    }
+}
+
+bool executor::take(std::size_t index, task& t)
+{
+    if (pending_ == 0)
+    {
+        return false;
+    }
+
+    // Newest task from our own deque first: its data is most likely still in our cache.
+    {
+        local_queue& own = *queues_[index];
+        std::lock_guard<std::mutex> guard(own.mutex_);
+
+        if (!own.tasks_.empty())
+        {
+            t = std::move(own.tasks_.back());
+            own.tasks_.pop_back();
+            pending_.fetch_sub(1);
+            return true;
+        }
+    }
+
+    // Otherwise, steal the oldest task of another thread.
+    for (std::size_t i = 1; i < queues_.size(); ++i)
+    {
+        local_queue& victim = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> guard(victim.mutex_);
+
+        if (!victim.tasks_.empty())
+        {
+            t = std::move(victim.tasks_.front());
+            victim.tasks_.pop_front();
+            pending_.fetch_sub(1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void executor::submit_due()
+{
+    if (next_due_ > clock::now().time_since_epoch().count())
+    {
+        return;
+    }
+
+    std::vector<task> due;
+
+    {
+        std::lock_guard<std::mutex> guard(delayed_mutex_);
+        auto end = delayed_.upper_bound(clock::now());
+        for (auto delayed = delayed_.begin(); delayed != end; ++delayed)
+        {
+            due.push_back(std::move(delayed->second));
+        }
+        delayed_.erase(delayed_.begin(), end);
+
+        next_due_ = delayed_.empty() ? std::numeric_limits<clock::rep>::max()
+                                     : delayed_.begin()->first.time_since_epoch().count();
+    }
+
+    for (auto& t: due)
+    {
+        submit(std::move(t));
+    }
+}
+
+void executor::wake_one() noexcept
+{
+    for (auto& queue: queues_)
+    {
+        if (queue->sleeping_.exchange(false))
+        {
+            queue->parker_.unpark();
+            return;
+        }
+    }
+}
+
+} // namespace wpwrapper
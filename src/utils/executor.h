@@ -0,0 +1,146 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_EXECUTOR_H
+#define WPWRAPPER_EXECUTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parker.h"
+
+namespace wpwrapper {
+
+/// \brief A fixed-size pool of threads that executes submitted tasks, balancing them with work stealing.
+/// \details Every thread has its own task deque. A task submitted from an executor thread goes to that thread's deque,
+/// other tasks are spread over the deques round-robin. A thread takes the newest task from its own deque, and when that
+/// is empty, steals the oldest task from another thread's deque, so idle threads pick up bursts submitted elsewhere.
+/// Threads without work sleep until a task is submitted, or until the earliest task that was submitted for a later
+/// moment is due.
+/// \note Tasks are not necessarily executed in the order in which they were submitted. Tasks that must not run
+/// concurrently or out of order need to be serialized by the caller.
+class executor {
+public:
+    /// \brief A task takes no arguments and returns nothing. Tasks should not throw.
+    using task = std::function<void()>;
+
+    /// \brief The clock that delayed tasks are scheduled on.
+    using clock = std::chrono::steady_clock;
+
+    /// \brief Constructs an executor and starts \c thread_count threads.
+    /// \param thread_count The number of threads on which tasks are executed. At least one thread is started.
+    explicit executor(unsigned int thread_count);
+
+    /// \brief Destructs this executor.
+    /// \details Tasks that have already been submitted, and tasks that they submit, are executed before the threads
+    /// are joined. Delayed tasks that are not due yet are dropped.
+    ~executor() noexcept;
+
+    // Executor is non-copyable.
+    executor(const executor& other) = delete;
+
+    // Executor is non-movable.
+    executor(executor&& other) = delete;
+
+    // Executor is non-copyable.
+    executor& operator=(const executor& other) = delete;
+
+    // Executor is non-movable.
+    executor& operator=(executor&& other) = delete;
+
+    /// \brief Schedules a task for execution on one of the executor threads.
+    /// \param t The task to execute.
+    void submit(task t);
+
+    /// \brief Schedules a task for execution on one of the executor threads once a moment has come.
+    /// \details The task is submitted as soon as an executor thread notices that it is due. Threads without work sleep
+    /// until the earliest delayed task is due, so no separate thread keeps time.
+    /// \param when The moment at which the task is due. A moment in the past submits the task right away.
+    /// \param t The task to execute.
+    void submit_at(clock::time_point when, task t);
+
+private:
+    /// \brief The task deque of a single executor thread.
+    struct local_queue {
+        /// \brief Tasks that have been submitted to this thread but not yet started.
+        std::deque<task> tasks_;
+        /// \brief Guards the task deque. Only contended when another thread steals.
+        std::mutex mutex_;
+
+        /// \brief Set while the thread is (about to be) parked without work.
+        std::atomic<bool> sleeping_{false};
+        /// \brief Wakes the thread when a task is submitted.
+        parker parker_;
+    };
+
+    /// \brief Executes tasks whenever they become available.
+    /// \note Should be executed on a separate thread.
+    /// \param index The index of the thread's task deque.
+    void run(std::size_t index) noexcept;
+
+    /// \brief Takes a task from a thread's own deque, or steals one from another thread.
+    /// \param index The index of the thread's task deque.
+    /// \param t Receives the task.
+    /// \return \c true if a task was taken.
+    bool take(std::size_t index, task& t);
+
+    /// \brief Wakes one sleeping thread, if any.
+    void wake_one() noexcept;
+
+    /// \brief Submits the delayed tasks that are due.
+    void submit_due();
+
+    /// \brief \c true if the executor threads should be running, \c false if they should finish the remaining tasks
+    /// and stop.
+    std::atomic<bool> running_;
+
+    /// \brief The number of tasks that have been submitted but not yet taken.
+    std::atomic<std::size_t> pending_;
+
+    /// \brief Used to spread tasks submitted from other threads over the deques.
+    std::atomic<std::size_t> next_queue_;
+
+    /// \brief Tasks that were submitted with submit_at() and are not due yet, by the moment they are due.
+    std::multimap<clock::time_point, task> delayed_;
+    /// \brief Guards the delayed tasks.
+    std::mutex delayed_mutex_;
+    /// \brief The moment at which the earliest delayed task is due, as a count of clock ticks, or the largest count if
+    /// there is none. Lets threads check for due tasks without the lock.
+    std::atomic<clock::rep> next_due_;
+
+    /// \brief One task deque per thread.
+    std::vector<std::unique_ptr<local_queue>> queues_;
+
+    /// \brief Threads on which tasks are executed.
+    std::vector<std::thread> threads_;
+
+    /// \brief The executor that owns the current thread, if any.
+    static thread_local executor* current_;
+    /// \brief The index of the current thread's task deque, if it is an executor thread.
+    static thread_local std::size_t current_index_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_EXECUTOR_H
@@ -0,0 +1,118 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_MPSC_QUEUE_H
+#define WPWRAPPER_MPSC_QUEUE_H
+
+#include <atomic>
+#include <optional>
+#include <utility>
+
+namespace wpwrapper {
+
+/// \brief An unbounded, lock-free FIFO queue that supports any number of producers but only a single consumer.
+/// \details Producers link a new node in with a single atomic exchange, so they never wait for each other or for the
+/// consumer. The queue does not block: consumers that need to wait for new elements should combine it with a
+/// \c parker.
+/// \see http://www.1024cores.net/home/lock-free-algorithms/queues/non-intrusive-mpsc-node-based-queue
+template<typename T>
+class mpsc_queue {
+public:
+    /// \brief Constructs an empty queue.
+    mpsc_queue()
+            :head_(new node), tail_(head_.load(std::memory_order_relaxed))
+    {
+    }
+
+    /// \brief Destructs this queue and all elements that are still in it.
+    ~mpsc_queue() noexcept
+    {
+        while (tail_ != nullptr)
+        {
+            node* next = tail_->next_.load(std::memory_order_relaxed);
+            delete tail_;
+            tail_ = next;
+        }
+    }
+
+    // Queue is non-copyable.
+    mpsc_queue(const mpsc_queue& other) = delete;
+
+    // Queue is non-movable.
+    mpsc_queue(mpsc_queue&& other) = delete;
+
+    // Queue is non-copyable.
+    mpsc_queue& operator=(const mpsc_queue& other) = delete;
+
+    // Queue is non-movable.
+    mpsc_queue& operator=(mpsc_queue&& other) = delete;
+
+    /// \brief Adds an element to the back of the queue.
+    /// \note May be called from any thread.
+    /// \param value The element to add.
+    void push(T value)
+    {
+        node* n = new node;
+        n->value_.emplace(std::move(value));
+
+        node* previous = head_.exchange(n, std::memory_order_acq_rel);
+        previous->next_.store(n, std::memory_order_release);
+    }
+
+    /// \brief Removes the element at the front of the queue.
+    /// \details An element of which the push is still in progress may not be visible yet. The producer notifies the
+    /// consumer after its push has completed, so the consumer will see it after waking up.
+    /// \note May only be called from the consumer thread.
+    /// \return The element at the front of the queue. Empty if the queue is empty.
+    std::optional<T> pop()
+    {
+        node* next = tail_->next_.load(std::memory_order_acquire);
+
+        if (next == nullptr)
+        {
+            return {};
+        }
+
+        // The next node becomes the new stub, so its value is moved out and the old stub is freed.
+        std::optional<T> value(std::move(next->value_));
+        next->value_.reset();
+
+        delete tail_;
+        tail_ = next;
+
+        return value;
+    }
+
+private:
+    /// \brief A queue node. The node at the tail is a stub which does not hold a value.
+    struct node {
+        /// \brief The node that was pushed after this one.
+        std::atomic<node*> next_{nullptr};
+
+        /// \brief The element held by this node.
+        std::optional<T> value_;
+    };
+
+    /// \brief The most recently pushed node. Shared by all producers.
+    std::atomic<node*> head_;
+
+    /// \brief The stub node preceding the front element. Owned by the consumer.
+    node* tail_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_MPSC_QUEUE_H
@@ -0,0 +1,138 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "parker.h"
+
+#ifdef __linux__
+
+#include <ctime>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#endif
+
+namespace wpwrapper {
+
+parker::parker() noexcept
+        :state_(empty)
+{
+}
+
+void parker::park() noexcept
+{
+    while (state_.exchange(empty, std::memory_order_acq_rel) != notified)
+    {
+        // Announce that we are about to sleep. If a notification arrived in the meantime, don't.
+        uint32_t expected = empty;
+        if (state_.compare_exchange_strong(expected, parked, std::memory_order_acq_rel))
+        {
+            wait(std::chrono::nanoseconds(-1));
+        }
+    }
+}
+
+bool parker::park_for(std::chrono::nanoseconds timeout) noexcept
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    while (state_.exchange(empty, std::memory_order_acq_rel) != notified)
+    {
+        auto remaining = deadline - std::chrono::steady_clock::now();
+        if (remaining <= std::chrono::nanoseconds::zero())
+        {
+            return false;
+        }
+
+        uint32_t expected = empty;
+        if (state_.compare_exchange_strong(expected, parked, std::memory_order_acq_rel))
+        {
+            wait(std::chrono::duration_cast<std::chrono::nanoseconds>(remaining));
+        }
+    }
+
+    return true;
+}
+
+void parker::unpark() noexcept
+{
+    // Only make a system call if the consumer is (about to be) asleep.
+    if (state_.exchange(notified, std::memory_order_acq_rel) == parked)
+    {
+        wake();
+    }
+}
+
+#ifdef __linux__
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits");
+
+void parker::wait(std::chrono::nanoseconds timeout) noexcept
+{
+    timespec ts{};
+    timespec* tsp = nullptr;
+
+    if (timeout >= std::chrono::nanoseconds::zero())
+    {
+        ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+        ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+        tsp = &ts;
+    }
+
+    // Returns immediately if the state is no longer parked. Spurious wakeups are handled by the caller.
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state_), FUTEX_WAIT_PRIVATE, parked, tsp, nullptr, 0);
+}
+
+void parker::wake() noexcept
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&state_), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+}
+
+#else
+
+void parker::wait(std::chrono::nanoseconds timeout) noexcept
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    auto woken = [&]
+    {
+        return state_.load(std::memory_order_acquire) != parked;
+    };
+
+    if (timeout < std::chrono::nanoseconds::zero())
+    {
+        cv_.wait(lock, woken);
+    }
+    else
+    {
+        cv_.wait_for(lock, timeout, woken);
+    }
+}
+
+void parker::wake() noexcept
+{
+    // Taking the lock ensures that the consumer is either waiting on the condition variable or has not checked the
+    // state yet, so the notification cannot get lost.
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+    }
+    cv_.notify_one();
+}
+
+#endif
+
+} // namespace wpwrapper
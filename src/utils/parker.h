@@ -0,0 +1,100 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_PARKER_H
+#define WPWRAPPER_PARKER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#ifndef __linux__
+
+#include <condition_variable>
+#include <mutex>
+
+#endif
+
+namespace wpwrapper {
+
+/// \brief Lets a single consumer thread sleep until one of any number of producer threads has new work for it.
+/// \details A notification is remembered until the consumer parks, so notifications are never lost. Notifications are
+/// not counted: many notifications before a single park result in one wakeup. On Linux, parking is implemented with a
+/// futex, and notifying a consumer that is not parked does not make a system call. Other platforms use a condition
+/// variable.
+class parker {
+public:
+    /// \brief Constructs a parker without a pending notification.
+    parker() noexcept;
+
+    // Parker is non-copyable.
+    parker(const parker& other) = delete;
+
+    // Parker is non-movable.
+    parker(parker&& other) = delete;
+
+    // Parker is non-copyable.
+    parker& operator=(const parker& other) = delete;
+
+    // Parker is non-movable.
+    parker& operator=(parker&& other) = delete;
+
+    /// \brief Blocks until a notification is pending, and consumes it.
+    /// \note May only be called from the consumer thread.
+    void park() noexcept;
+
+    /// \brief Blocks until a notification is pending or until \c timeout has passed.
+    /// \note May only be called from the consumer thread.
+    /// \param timeout The maximum amount of time to block.
+    /// \return \c true if a notification was consumed, \c false if the timeout expired.
+    bool park_for(std::chrono::nanoseconds timeout) noexcept;
+
+    /// \brief Wakes the consumer, or makes its next park return immediately if it is not parked.
+    /// \note May be called from any thread.
+    void unpark() noexcept;
+
+private:
+    /// \brief Possible values of the parker state.
+    enum : uint32_t {
+        /// \brief No notification is pending and the consumer is not parked.
+                empty = 0,
+        /// \brief A notification is pending.
+                notified = 1,
+        /// \brief The consumer is (about to be) parked.
+                parked = 2
+    };
+
+    /// \brief Blocks while the state is \c parked, or until \c timeout has passed.
+    /// \param timeout The maximum amount of time to block, or a negative duration to block indefinitely.
+    void wait(std::chrono::nanoseconds timeout) noexcept;
+
+    /// \brief Wakes the consumer if it is blocked in wait().
+    void wake() noexcept;
+
+    /// \brief Either \c empty, \c notified or \c parked.
+    std::atomic<uint32_t> state_;
+
+#ifndef __linux__
+    /// \brief Guards the transition to and from the \c parked state.
+    std::mutex mutex_;
+    /// \brief Notified when the state changes from \c parked to \c notified.
+    std::condition_variable cv_;
+#endif
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_PARKER_H
@@ -0,0 +1,144 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_RCU_H
+#define WPWRAPPER_RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace wpwrapper {
+
+/// \brief Holds a read-mostly value that readers on any thread can access without taking a lock.
+/// \details Readers see an immutable snapshot. Writers copy the current snapshot, modify the copy and publish it with
+/// a single atomic store (read-copy-update). The old snapshot is freed after a grace period: every reader that might
+/// still see it has finished.
+///
+/// Readers announce themselves by incrementing one of two counters, chosen by the parity of the current epoch. After
+/// publishing a new snapshot, a writer flips the epoch and waits until the counter of the old parity drains, twice, so
+/// both counters have drained since the snapshot was replaced. Writers are serialized
+/// with a mutex, and waiting for a grace period only involves readers, so it is short as long as readers are.
+template<typename T>
+class rcu {
+public:
+    /// \brief Constructs a cell holding \c initial.
+    /// \param initial The initial value.
+    explicit rcu(T initial = T{})
+            :current_(new T(std::move(initial))), readers_{{0}, {0}}, epoch_(0)
+    {
+    }
+
+    /// \brief Destructs this cell and the current snapshot.
+    /// \warning No reader or writer may be active.
+    ~rcu() noexcept
+    {
+        delete current_.load();
+    }
+
+    // Cell is non-copyable.
+    rcu(const rcu& other) = delete;
+
+    // Cell is non-movable.
+    rcu(rcu&& other) = delete;
+
+    // Cell is non-copyable.
+    rcu& operator=(const rcu& other) = delete;
+
+    // Cell is non-movable.
+    rcu& operator=(rcu&& other) = delete;
+
+    /// \brief Executes \c f on the current snapshot, without taking a lock.
+    /// \details The snapshot is only guaranteed to stay alive while \c f executes, so \c f should copy out whatever it
+    /// needs. \c f should be short, as writers wait for it.
+    /// \param f A function that takes a const reference to the snapshot.
+    /// \return Whatever \c f returns.
+    template<typename F>
+    auto read(F&& f) const
+    {
+        auto& readers = readers_[epoch_.load() & 1u];
+        readers.fetch_add(1);
+
+        // Decrements the reader counter, even if f throws.
+        struct guard {
+            std::atomic<uint32_t>& readers_;
+
+            ~guard()
+            {
+                readers_.fetch_sub(1);
+            }
+        } g{readers};
+
+        return f(*current_.load());
+    }
+
+    /// \brief Executes \c f on a copy of the current snapshot, publishes the copy, and frees the old snapshot once no
+    /// reader can see it anymore.
+    /// \param f A function that takes a reference to the copy and modifies it.
+    template<typename F>
+    void update(F&& f)
+    {
+        std::lock_guard<std::mutex> guard(writer_mutex_);
+
+        const T* old = current_.load();
+        T* next = new T(*old);
+
+        try
+        {
+            f(*next);
+        }
+        catch (...)
+        {
+            delete next;
+            throw;
+        }
+
+        current_.store(next);
+
+        // Readers that register after a flip use the other counter. A reader may have read the epoch before an earlier
+        // flip and registered late, so drain both counters, flipping before each wait so new readers do not keep it
+        // from draining. Any reader that saw the old snapshot was counted in one of them before it was replaced.
+        for (int phase = 0; phase < 2; ++phase)
+        {
+            uint32_t previous = epoch_.fetch_add(1);
+            while (readers_[previous & 1u].load() != 0)
+            {
+                std::this_thread::yield();
+            }
+        }
+
+        delete old;
+    }
+
+private:
+    /// \brief The current snapshot.
+    std::atomic<const T*> current_;
+
+    /// \brief Number of active readers, per epoch parity.
+    mutable std::atomic<uint32_t> readers_[2];
+
+    /// \brief Incremented by every writer after publishing a snapshot.
+    std::atomic<uint32_t> epoch_;
+
+    /// \brief Serializes writers.
+    std::mutex writer_mutex_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_RCU_H
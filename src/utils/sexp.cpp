@@ -0,0 +1,147 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "sexp.h"
+
+#include <algorithm>
+
+namespace wpwrapper::sexp {
+
+static constexpr std::string_view whitespace = " \t\r\n";
+
+/// \brief Moves past a quoted string.
+/// \param text The text.
+/// \param at The position of the opening quote.
+/// \return The position after the closing quote, or the size of the text if there is none.
+static std::size_t skip_string(std::string_view text, std::size_t at) noexcept
+{
+    for (++at; at < text.size() && text[at] != '"'; ++at)
+    {
+        at += text[at] == '\\' ? 1 : 0;
+    }
+    return std::min(at + 1, text.size());
+}
+
+/// \brief Moves past whitespace and comments.
+/// \param text The text.
+/// \param at The position to start at.
+/// \return The position of the next s-expression or closing parenthesis, or the size of the text if there is none.
+static std::size_t skip_space(std::string_view text, std::size_t at) noexcept
+{
+    while (at < text.size())
+    {
+        if (text[at] == ';')
+        {
+            at = std::min(text.find('\n', at), text.size());
+        }
+        else if (whitespace.find(text[at]) != std::string_view::npos)
+        {
+            ++at;
+        }
+        else
+        {
+            break;
+        }
+    }
+    return at;
+}
+
+/// \brief Moves past an s-expression.
+/// \param text The text.
+/// \param at The position at which the s-expression starts.
+/// \return The position after the s-expression.
+static std::size_t skip_expression(std::string_view text, std::size_t at) noexcept
+{
+    if (text[at] == '"')
+    {
+        return skip_string(text, at);
+    }
+
+    if (text[at] != '(')
+    {
+        return std::min(text.find_first_of(" \t\r\n();\"", at), text.size());
+    }
+
+    std::size_t nesting = 0;
+    while (at < text.size())
+    {
+        char next = text[at];
+        if (next == '"')
+        {
+            at = skip_string(text, at);
+            continue;
+        }
+
+        if (next == ';')
+        {
+            at = std::min(text.find('\n', at), text.size());
+            continue;
+        }
+
+        ++at;
+        if (next == '(')
+        {
+            ++nesting;
+        }
+        else if (next == ')' && --nesting == 0)
+        {
+            break;
+        }
+    }
+    return at;
+}
+
+std::vector<std::string_view> split(std::string_view text)
+{
+    std::vector<std::string_view> expressions;
+
+    for (std::size_t at = 0; (at = skip_space(text, at)) < text.size();)
+    {
+        // Stray closing parentheses are skipped, like sertop skips them.
+        if (text[at] == ')')
+        {
+            ++at;
+            continue;
+        }
+
+        std::size_t end = skip_expression(text, at);
+        expressions.push_back(text.substr(at, end - at));
+        at = end;
+    }
+    return expressions;
+}
+
+std::vector<std::string_view> elements(std::string_view list)
+{
+    std::size_t open = skip_space(list, 0);
+    if (open == list.size() || list[open] != '(')
+    {
+        return {};
+    }
+
+    std::vector<std::string_view> expressions;
+
+    // The elements end at the closing parenthesis of the list.
+    for (std::size_t at = open + 1; (at = skip_space(list, at)) < list.size() && list[at] != ')';)
+    {
+        std::size_t end = skip_expression(list, at);
+        expressions.push_back(list.substr(at, end - at));
+        at = end;
+    }
+    return expressions;
+}
+
+} // namespace wpwrapper::sexp
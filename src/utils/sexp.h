@@ -0,0 +1,41 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_SEXP_H
+#define WPWRAPPER_SEXP_H
+
+#include <string_view>
+#include <vector>
+
+/// \brief Reads the s-expressions that SerAPI commands and answers consist of, without copying them.
+/// \details An s-expression is a list in parentheses, a quoted string, which may hold parentheses and escaped quotes,
+/// or an atom. Whitespace separates them, and a semicolon starts a comment up to the end of the line. A list that is
+/// not closed extends to the end of the text.
+namespace wpwrapper::sexp {
+
+/// \brief Splits a text into its top-level s-expressions.
+/// \param text The text, like <tt>(Add () "Lemma a : True.")\n(Exec 2)\n</tt>.
+/// \return The s-expressions, in order, like <tt>(Add () "Lemma a : True.")</tt> and <tt>(Exec 2)</tt>.
+std::vector<std::string_view> split(std::string_view text);
+
+/// \brief Returns the elements of a list.
+/// \param list The list, like <tt>(Answer 3 Completed)</tt>. Leading and trailing whitespace is ignored.
+/// \return The elements, in order, like \c Answer, \c 3 and \c Completed. Empty if \c list is not a list.
+std::vector<std::string_view> elements(std::string_view list);
+
+} // namespace wpwrapper::sexp
+
+#endif // WPWRAPPER_SEXP_H
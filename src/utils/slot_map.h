@@ -0,0 +1,245 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_SLOT_MAP_H
+#define WPWRAPPER_SLOT_MAP_H
+
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace wpwrapper {
+
+/// \brief A map from generated keys to values, stored in a dense array.
+/// \details A key consists of a slot index in the lower \c index_bits bits and the generation of that slot in the
+/// remaining bits. Lookups index the array directly and compare generations. When a value is erased, the generation of
+/// its slot is increased, so the old key no longer finds anything, even after the slot has been reused. Free slots are
+/// reused first-in first-out, so a key stays stale for as long as possible. A slot whose generation would wrap around
+/// is retired instead of being reused, so a stale key never finds a newer value.
+///
+/// Keys are normally generated by insert(). A second slot map can mirror the keys of the first one with assign().
+template<typename T>
+class slot_map {
+public:
+    /// \brief A key identifying a value in the slot map.
+    using key = unsigned int;
+
+    /// \brief The number of key bits used for the slot index.
+    static constexpr unsigned int index_bits = 20;
+
+    /// \brief Returns the slot index of a key.
+    /// \param k The key.
+    /// \return The slot index of \c k.
+    static constexpr std::size_t index(key k) noexcept
+    {
+        return k & index_mask;
+    }
+
+    /// \brief Returns the generation of a key.
+    /// \param k The key.
+    /// \return The generation of \c k.
+    static constexpr unsigned int generation(key k) noexcept
+    {
+        return k >> index_bits;
+    }
+
+    /// \brief Stores a value in a free slot.
+    /// \param value The value to store.
+    /// \return The key under which the value was stored.
+    /// \throw std::length_error Thrown if all 2^\c index_bits slots are in use or retired.
+    key insert(T value)
+    {
+        std::size_t i = slots_.size();
+
+        // Slots on the free list may have been taken by assign() in the meantime.
+        while (!free_.empty())
+        {
+            std::size_t candidate = free_.front();
+            free_.pop_front();
+            slots_[candidate].listed_ = false;
+
+            if (!slots_[candidate].value_)
+            {
+                i = candidate;
+                break;
+            }
+        }
+
+        if (i == slots_.size())
+        {
+            if (i > index_mask)
+            {
+                throw std::length_error("slot map is full");
+            }
+
+            slots_.emplace_back();
+        }
+
+        slots_[i].value_.emplace(std::move(value));
+        ++size_;
+
+        return make_key(i, slots_[i].generation_);
+    }
+
+    /// \brief Stores a value under a key that was generated by another slot map.
+    /// \details Whatever the slot held before is replaced. As the other slot map only reuses a slot after erasing its
+    /// value, a value that is replaced this way belongs to an older generation and is stale.
+    /// \param k The key to store the value under.
+    /// \param value The value to store.
+    /// \return The value that was replaced, if any.
+    std::optional<T> assign(key k, T value)
+    {
+        std::size_t i = index(k);
+
+        if (i >= slots_.size())
+        {
+            slots_.resize(i + 1);
+        }
+
+        slot& s = slots_[i];
+        std::optional<T> displaced(std::move(s.value_));
+
+        if (displaced)
+        {
+            --size_;
+        }
+
+        s.generation_ = generation(k);
+        s.value_.emplace(std::move(value));
+        ++size_;
+
+        return displaced;
+    }
+
+    /// \brief Looks up the value stored under a key.
+    /// \param k The key to look up.
+    /// \return A pointer to the value, or \c nullptr if no value is stored under \c k.
+    T* find(key k) noexcept
+    {
+        std::size_t i = index(k);
+
+        if (i >= slots_.size() || !slots_[i].value_ || slots_[i].generation_ != generation(k))
+        {
+            return nullptr;
+        }
+
+        return &*slots_[i].value_;
+    }
+
+    /// \brief Looks up the value stored under a key.
+    /// \param k The key to look up.
+    /// \return A pointer to the value, or \c nullptr if no value is stored under \c k.
+    const T* find(key k) const noexcept
+    {
+        return const_cast<slot_map*>(this)->find(k);
+    }
+
+    /// \brief Removes the value stored under a key, if any.
+    /// \details The generation of the slot is increased, so \c k does not find any value anymore. If the generation
+    /// would wrap around, the slot is not reused by insert() anymore.
+    /// \param k The key of the value to remove.
+    /// \return The removed value. Empty if no value was stored under \c k.
+    std::optional<T> erase(key k)
+    {
+        if (find(k) == nullptr)
+        {
+            return {};
+        }
+
+        slot& s = slots_[index(k)];
+        std::optional<T> removed(std::move(s.value_));
+        s.value_.reset();
+        s.generation_ = (s.generation_ + 1) & generation_mask;
+        --size_;
+
+        if (!s.listed_ && s.generation_ != 0)
+        {
+            free_.push_back(index(k));
+            s.listed_ = true;
+        }
+
+        return removed;
+    }
+
+    /// \brief Removes all values.
+    void clear()
+    {
+        for (std::size_t i = 0; i < slots_.size(); ++i)
+        {
+            if (slots_[i].value_)
+            {
+                erase(make_key(i, slots_[i].generation_));
+            }
+        }
+    }
+
+    /// \brief Executes \c f for every stored value, in slot order.
+    /// \details \c f takes the key and a reference to the value as arguments. It must not insert or erase values.
+    /// \param f The function to execute.
+    template<typename F>
+    void for_each(F&& f)
+    {
+        for (std::size_t i = 0; i < slots_.size(); ++i)
+        {
+            if (slots_[i].value_)
+            {
+                f(make_key(i, slots_[i].generation_), *slots_[i].value_);
+            }
+        }
+    }
+
+    /// \brief Returns the number of stored values.
+    /// \return The number of stored values.
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+private:
+    static constexpr key index_mask = (1u << index_bits) - 1;
+    static constexpr key generation_mask = (1u << (32 - index_bits)) - 1;
+
+    /// \brief A slot in the dense array.
+    struct slot {
+        /// \brief The generation of the value stored in this slot, or of the next value if the slot is free.
+        unsigned int generation_ = 0;
+
+        /// \brief The stored value. Empty if the slot is free.
+        std::optional<T> value_;
+
+        /// \brief \c true if this slot is on the free list.
+        bool listed_ = false;
+    };
+
+    static constexpr key make_key(std::size_t i, unsigned int generation) noexcept
+    {
+        return (generation << index_bits) | static_cast<key>(i);
+    }
+
+    /// \brief The dense array of slots.
+    std::vector<slot> slots_;
+    /// \brief Indices of free slots, reused first-in first-out. Contains every slot at most once.
+    std::deque<std::size_t> free_;
+    /// \brief The number of stored values.
+    std::size_t size_ = 0;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_SLOT_MAP_H
@@ -0,0 +1,363 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_TIMER_WHEEL_H
+#define WPWRAPPER_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <vector>
+
+namespace wpwrapper {
+
+/// \brief Keeps timers, and finds the ones that have expired.
+/// \details Time is divided into ticks, counted from the moment the wheel was constructed. The wheel has \c levels
+/// levels of \c slot_count slots each. A slot on level \c L covers \c slot_count^L ticks. A timer is linked into the
+/// lowest level that reaches its expiry, and moves down a level whenever the slot that holds it comes up. A timer that
+/// expires beyond the reach of the highest level waits in that level until it comes within reach.
+///
+/// Scheduling and cancelling a timer take constant time. Advancing the wheel takes constant time per timer that
+/// expires or moves down, and skips ticks at which nothing happens. Every timer gets a new 64-bit id, which is part of
+/// its handle, so a handle of a timer that has expired or was cancelled does not find anything anymore, even once its
+/// storage is reused.
+/// \note Not thread-safe.
+template<typename T>
+class timer_wheel {
+public:
+    /// \brief The clock that timers are scheduled on.
+    using clock = std::chrono::steady_clock;
+
+    /// \brief Identifies a scheduled timer.
+    struct handle {
+        /// \brief Where the timer is stored.
+        uint32_t index_;
+        /// \brief The id of the timer. Ids are never reused.
+        uint64_t id_;
+    };
+
+    /// \brief The number of bits of a tick count that select a slot on a single level.
+    static constexpr unsigned int slot_bits = 6;
+
+    /// \brief The number of slots on every level.
+    static constexpr std::size_t slot_count = std::size_t(1) << slot_bits;
+
+    /// \brief The number of levels.
+    static constexpr unsigned int levels = 4;
+
+    /// \brief Constructs an empty wheel.
+    /// \param tick The resolution of the wheel. Timers expire at the first tick at or after the moment they were
+    /// scheduled for.
+    /// \param start The moment at which tick zero starts.
+    explicit timer_wheel(std::chrono::nanoseconds tick, clock::time_point start = clock::now())
+            :tick_(tick), start_(start), now_(0), next_id_(1), size_(0), occupied_{}
+    {
+        for (auto& level: heads_)
+        {
+            level.fill(none);
+        }
+    }
+
+    // Timer wheel is non-copyable.
+    timer_wheel(const timer_wheel& other) = delete;
+
+    // Timer wheel is non-movable.
+    timer_wheel(timer_wheel&& other) = delete;
+
+    // Timer wheel is non-copyable.
+    timer_wheel& operator=(const timer_wheel& other) = delete;
+
+    // Timer wheel is non-movable.
+    timer_wheel& operator=(timer_wheel&& other) = delete;
+
+    /// \brief Schedules a timer.
+    /// \param when The moment at which the timer expires. A moment in the past expires at the next advance().
+    /// \param value The value that is handed out when the timer expires.
+    /// \return A handle to cancel the timer with.
+    handle schedule(clock::time_point when, T value)
+    {
+        uint32_t index;
+        if (free_.empty())
+        {
+            index = static_cast<uint32_t>(entries_.size());
+            entries_.emplace_back();
+        }
+        else
+        {
+            index = free_.back();
+            free_.pop_back();
+        }
+
+        entries_[index] = entry{std::move(value), next_id_++, std::max(ticks(when), now_ + 1), none, none, 0, 0};
+        ++size_;
+        link(index);
+        return handle{index, entries_[index].id_};
+    }
+
+    /// \brief Cancels a timer.
+    /// \param h The handle of the timer.
+    /// \return \c true if the timer was cancelled, \c false if it already expired or was cancelled before.
+    bool cancel(handle h)
+    {
+        if (h.index_ >= entries_.size() || entries_[h.index_].id_ != h.id_)
+        {
+            return false;
+        }
+
+        unlink(h.index_);
+        release(h.index_);
+        return true;
+    }
+
+    /// \brief Expires all timers that were scheduled for \c now or earlier.
+    /// \details \c f takes the value of an expired timer as an rvalue. It may schedule and cancel timers.
+    /// \param now The current moment.
+    /// \param f The function to execute for every expired timer, in order of expiry.
+    template<typename F>
+    void advance(clock::time_point now, F&& f)
+    {
+        uint64_t target = std::max<int64_t>((now - start_) / tick_, 0);
+
+        while (now_ < target)
+        {
+            uint64_t next = next_tick();
+            if (next > target)
+            {
+                now_ = target;
+                break;
+            }
+            now_ = next;
+
+            // Timers in a slot that starts at this tick move down, highest level first, so that they end up as low as
+            // possible.
+            for (unsigned int level = levels - 1; level > 0; --level)
+            {
+                if ((now_ & ((uint64_t(1) << (level * slot_bits)) - 1)) == 0)
+                {
+                    cascade(level, (now_ >> (level * slot_bits)) & (slot_count - 1));
+                }
+            }
+
+            std::size_t slot = now_ & (slot_count - 1);
+            while (heads_[0][slot] != none)
+            {
+                uint32_t index = heads_[0][slot];
+                unlink(index);
+
+                if (entries_[index].expiry_ > now_)
+                {
+                    // Was beyond the reach of the wheel.
+                    link(index);
+                    continue;
+                }
+
+                T value(std::move(entries_[index].value_));
+                release(index);
+                f(std::move(value));
+            }
+        }
+    }
+
+    /// \brief Returns the moment at which advance() has something to do next.
+    /// \details This is the expiry of the earliest timer, or an earlier moment at which timers move down a level.
+    /// \return The moment, or an empty optional if no timer is scheduled.
+    std::optional<clock::time_point> next_expiry() const
+    {
+        if (size_ == 0)
+        {
+            return {};
+        }
+
+        return start_ + tick_ * next_tick();
+    }
+
+    /// \brief Returns the number of scheduled timers.
+    /// \return The number of scheduled timers.
+    std::size_t size() const noexcept
+    {
+        return size_;
+    }
+
+private:
+    /// \brief A scheduled timer, or free storage for one.
+    struct entry {
+        /// \brief The value that is handed out on expiry.
+        T value_;
+        /// \brief The id of the timer, or zero if the entry is free.
+        uint64_t id_;
+        /// \brief The tick at which the timer expires.
+        uint64_t expiry_;
+        /// \brief The index of the previous timer in the same slot, or \c none.
+        uint32_t prev_;
+        /// \brief The index of the next timer in the same slot, or \c none.
+        uint32_t next_;
+        /// \brief The level of the slot that holds the timer.
+        unsigned int level_;
+        /// \brief The slot that holds the timer.
+        std::size_t slot_;
+    };
+
+    /// \brief Marks the end of a list.
+    static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+    /// \brief The number of ticks that the highest level reaches.
+    static constexpr uint64_t reach = uint64_t(1) << (levels * slot_bits);
+
+    /// \brief Converts a moment to the first tick at or after it.
+    uint64_t ticks(clock::time_point when) const noexcept
+    {
+        if (when <= start_)
+        {
+            return 0;
+        }
+
+        return ((when - start_) + tick_ - std::chrono::nanoseconds(1)) / tick_;
+    }
+
+    /// \brief Returns the first tick after the current one at which a slot that holds timers comes up.
+    uint64_t next_tick() const noexcept
+    {
+        uint64_t next = std::numeric_limits<uint64_t>::max();
+
+        for (unsigned int level = 0; level < levels; ++level)
+        {
+            unsigned int shift = level * slot_bits;
+            uint64_t block = now_ >> shift;
+
+            for (uint64_t bits = occupied_[level]; bits != 0; bits &= bits - 1)
+            {
+                uint64_t slot = std::countr_zero(bits);
+
+                // The slot of the current block has come up already, so it comes up again a full turn later.
+                uint64_t distance = (slot - block) & (slot_count - 1);
+                next = std::min(next, (block + (distance == 0 ? slot_count : distance)) << shift);
+            }
+        }
+
+        return next;
+    }
+
+    /// \brief Frees the storage of a timer that has been unlinked.
+    void release(uint32_t index)
+    {
+        entries_[index] = entry{};
+        free_.push_back(index);
+        --size_;
+    }
+
+    /// \brief Links a timer into the slot that matches its expiry.
+    void link(uint32_t index)
+    {
+        entry& e = entries_[index];
+
+        uint64_t at = std::min(e.expiry_, now_ + reach - 1);
+        uint64_t delta = at - now_;
+
+        unsigned int level = 0;
+        while (level + 1 < levels && delta >= (uint64_t(1) << ((level + 1) * slot_bits)))
+        {
+            ++level;
+        }
+
+        std::size_t slot = (at >> (level * slot_bits)) & (slot_count - 1);
+
+        e.level_ = level;
+        e.slot_ = slot;
+        e.prev_ = none;
+        e.next_ = heads_[level][slot];
+        if (e.next_ != none)
+        {
+            entries_[e.next_].prev_ = index;
+        }
+        heads_[level][slot] = index;
+        occupied_[level] |= uint64_t(1) << slot;
+    }
+
+    /// \brief Unlinks a timer from its slot.
+    void unlink(uint32_t index)
+    {
+        entry& e = entries_[index];
+        if (e.prev_ != none)
+        {
+            entries_[e.prev_].next_ = e.next_;
+        }
+        else
+        {
+            heads_[e.level_][e.slot_] = e.next_;
+        }
+
+        if (e.next_ != none)
+        {
+            entries_[e.next_].prev_ = e.prev_;
+        }
+
+        if (heads_[e.level_][e.slot_] == none)
+        {
+            occupied_[e.level_] &= ~(uint64_t(1) << e.slot_);
+        }
+    }
+
+    /// \brief Moves all timers of a slot down.
+    void cascade(unsigned int level, std::size_t slot)
+    {
+        uint32_t index = heads_[level][slot];
+        heads_[level][slot] = none;
+        occupied_[level] &= ~(uint64_t(1) << slot);
+
+        while (index != none)
+        {
+            uint32_t next = entries_[index].next_;
+            link(index);
+            index = next;
+        }
+    }
+
+    /// \brief The length of a tick.
+    std::chrono::nanoseconds tick_;
+
+    /// \brief The moment at which tick zero starts.
+    clock::time_point start_;
+
+    /// \brief The last tick that has been processed.
+    uint64_t now_;
+
+    /// \brief The id of the next timer that is scheduled.
+    uint64_t next_id_;
+
+    /// \brief The number of scheduled timers.
+    std::size_t size_;
+
+    /// \brief All scheduled timers, and free storage.
+    std::vector<entry> entries_;
+
+    /// \brief The indices of the free entries.
+    std::vector<uint32_t> free_;
+
+    /// \brief The index of the first timer of every slot, or \c none.
+    std::array<std::array<uint32_t, slot_count>, levels> heads_;
+
+    /// \brief One bit per slot that holds timers, per level.
+    std::array<uint64_t, levels> occupied_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_TIMER_WHEEL_H
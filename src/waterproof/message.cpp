@@ -16,6 +16,12 @@
 
 #include "message.h"
 
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#include "../utils/buffers.h"
+
 namespace wpwrapper {
 
 bool response::operator<(const wpwrapper::response& rhs) const
@@ -44,6 +50,26 @@ void from_json(const json& j, request& r)
     j.at("verb").get_to(r.verb_);
     j.at("instance_id").get_to(r.instance_id_);
     j.at("content").get_to(r.content_);
+
+    if (j.contains("deadline"))
+    {
+        r.deadline_ = std::chrono::milliseconds(std::max<int64_t>(j.at("deadline").get<int64_t>(), 0));
+    }
+
+    if (j.contains("background"))
+    {
+        j.at("background").get_to(r.background_);
+    }
+
+    if (j.contains("query"))
+    {
+        j.at("query").get_to(r.query_);
+    }
+
+    if (j.contains("session"))
+    {
+        j.at("session").get_to(r.session_);
+    }
 }
 
 void from_json(const json& j, response& r)
@@ -52,6 +78,12 @@ void from_json(const json& j, response& r)
     j.at("verb").get_to(r.verb_);
     j.at("instance_id").get_to(r.instance_id_);
     j.at("content").get_to(r.content_);
+
+    r.sequenced_ = j.contains("sequence");
+    if (r.sequenced_)
+    {
+        j.at("sequence").get_to(r.sequence_);
+    }
 }
 
 void to_json(json& j, const request& r)
@@ -61,6 +93,26 @@ void to_json(json& j, const request& r)
             {"instance_id", r.instance_id_},
             {"content",     r.content_},
     };
+
+    if (r.deadline_)
+    {
+        j["deadline"] = r.deadline_->count();
+    }
+
+    if (r.background_)
+    {
+        j["background"] = true;
+    }
+
+    if (r.query_)
+    {
+        j["query"] = true;
+    }
+
+    if (r.session_)
+    {
+        j["session"] = true;
+    }
 }
 
 void to_json(json& j, const response& r)
@@ -72,6 +124,38 @@ void to_json(json& j, const response& r)
             {"instance_id", r.instance_id_},
             {"content",     r.content_},
     };
+
+    if (r.sequenced_)
+    {
+        j["sequence"] = r.sequence_;
+    }
+}
+
+frame encode(const response& r)
+{
+    // Sertop's output is not guaranteed to be valid UTF-8: replace invalid bytes rather than failing the response.
+    std::string raw = json(r).dump(-1, ' ', false, json::error_handler_t::replace);
+
+    std::vector<char> length(4, 0);
+    buffers::write_uint32(raw.length(), length, buffers::endianness::big);
+
+    frame f{r.instance_id_, r.priority_, r.sequence_, std::string()};
+    f.data_.reserve(length.size() + raw.length());
+    f.data_.append(length.data(), length.size());
+    f.data_.append(raw);
+    return f;
+}
+
+request decode(const std::string& raw)
+{
+    try
+    {
+        return json::parse(raw).get<request>();
+    }
+    catch (const json::exception& e)
+    {
+        throw std::invalid_argument(e.what());
+    }
 }
 
 } // namespace wpwrapper
@@ -17,6 +17,8 @@
 #ifndef WPWRAPPER_MESSAGE_H
 #define WPWRAPPER_MESSAGE_H
 
+#include <chrono>
+#include <optional>
 #include <string>
 
 #include <nlohmann/json.hpp>
@@ -36,19 +38,60 @@ struct request {
         /// \brief Forward the request content to the worker.
                 forward,
         /// \brief Stop the wrapper.
-                stop
+                stop,
+        /// \brief Bind a worker that was created on an earlier connection to the connection of this request.
+                reattach,
+        /// \brief Interrupt the computation that the worker is running.
+                interrupt,
+        /// \brief Report the memory usage of the worker and the number of forward requests it handled.
+                stats,
+        /// \brief Create a new worker in the same state as an existing one.
+                clone,
+        /// \brief Tell the wrapper which forward requests are likely to follow for a worker.
+                speculate,
+        /// \brief Never sent by Waterproof. Marks the responses that the wrapper sends by itself when a worker uses
+        /// more memory than one of its limits.
+                memory
     };
 
     /// \brief The action that should be performed by the wrapper.
     verb verb_;
 
-    /// \brief The identifier of the worker which should be destroyed or to which the request content should be
-    /// forwarded. Ignored in create and stop requests.
+    /// \brief The identifier of the worker which should be destroyed, to which the request content should be forwarded,
+    /// or which should be reattached, interrupted, reported on, cloned or hinted at. Ignored in create and stop
+    /// requests.
     unsigned int instance_id_;
 
-    /// \brief The request content. In forward requests, the content is what will be forwarded to the worker. Ignored in
-    /// all other requests.
+    /// \brief The identifier of the worker to clone, in clone requests. The server moves it here from \c instance_id_,
+    /// which becomes the identifier of the new worker.
+    /// \note For internal use only, is not (de)serialized.
+    unsigned int source_id_ = 0;
+
+    /// \brief The request content. In forward requests, the content is what will be forwarded to the worker. In
+    /// reattach requests, it is a JSON object with the session \c token of the worker and the \c sequence number of the
+    /// last response that was received for it, if any. In clone requests, it is a JSON object with the session \c token
+    /// of the worker to clone, which is only needed if that worker belongs to another connection. In speculate
+    /// requests, it is a JSON array with the contents of the forward requests that are likely to follow, in order.
+    /// Ignored in all other requests.
     std::string content_;
+
+    /// \brief How long a forward request may take, in milliseconds, until sertop reports it completed. Overrides the
+    /// default deadline of the worker, zero disables it. Optional, ignored in all other requests.
+    std::optional<std::chrono::milliseconds> deadline_;
+
+    /// \brief Set in forward requests that no user waits for, such as rechecks of a document in the background. These
+    /// do not raise the priority of the worker. Optional, ignored in all other requests.
+    bool background_ = false;
+
+    /// \brief Set in forward requests that only read the state of sertop, such as \c Search. These are answered by the
+    /// sidecar of the worker if it has one, so that they do not hold up the commands that follow. Optional, ignored in
+    /// all other requests.
+    bool query_ = false;
+
+    /// \brief Set in create and clone requests by clients that want to reattach the new worker after a reconnect. The
+    /// create or clone response then carries the session token of the worker, and every response for the worker
+    /// carries a sequence number. Optional, ignored in all other requests.
+    bool session_ = false;
 };
 
 /// \brief A response sent back to Waterproof.
@@ -78,12 +121,33 @@ struct response {
     /// \brief The verb of the request to which this response corresponds.
     request::verb verb_;
 
+    /// \brief Set if the response was read from the sidecar of a worker rather than from the worker itself.
+    /// \note For internal use only, is not (de)serialized.
+    bool from_sidecar_ = false;
+
     /// \brief Identifies the worker that executed the request to which this response corresponds.
     unsigned int instance_id_;
 
+    /// \brief The position of this response among all responses for the same worker, starting at 0. Set by the server
+    /// when the response is queued. Only serialized if \c sequenced_ is set.
+    uint64_t sequence_;
+
+    /// \brief Set if the response is for a worker that was created or cloned with a session, so that it carries its
+    /// sequence number.
+    /// \note For internal use only, is not (de)serialized.
+    bool sequenced_ = false;
+
     /// \brief The response content.
     /// \details In failure responses, this will contain some error message. In success responses, this will contain
-    /// sertop's responses for forward requests and be empty for other requests.
+    /// sertop's responses for forward requests, the session token for create and clone requests that asked for a
+    /// session and a JSON object with the statistics for stats requests. It is empty for other requests.
+    ///
+    /// Memory responses do not answer a request. The wrapper sends one when a worker is found to use more memory than
+    /// its soft or hard limit. Their content is a JSON object with the \c limit that was exceeded, \c "soft" or
+    /// \c "hard", the resident memory \c usage of the worker and the \c threshold of that limit, both in bytes. A
+    /// worker over its soft limit keeps running, and the response has status success. A worker over its hard limit is
+    /// recycled, and the response has status failure. The soft limit is only reported again after the worker dropped
+    /// below it.
     std::string content_;
 
     /// \brief Defines a weak ordering on the set of responses.
@@ -99,12 +163,33 @@ struct response {
     bool operator>(const response& rhs) const;
 };
 
+/// \brief A response that has been serialized, together with what is needed to schedule and route it.
+struct frame {
+    /// \brief Identifies the worker that executed the request to which the response corresponds.
+    unsigned int instance_id_;
+
+    /// \brief The priority of the response. The server will send frames with higher priority first.
+    int priority_;
+
+    /// \brief The sequence number of the response.
+    uint64_t sequence_;
+
+    /// \brief The serialized response, prefixed with its length as a big-endian 32-bit integer, exactly as it is sent.
+    std::string data_;
+};
+
 // Define how a request::verb enum should be (de)serialized.
 NLOHMANN_JSON_SERIALIZE_ENUM(request::verb, {
     { request::verb::create, "create" },
     { request::verb::destroy, "destroy" },
     { request::verb::forward, "forward" },
     { request::verb::stop, "stop" },
+    { request::verb::reattach, "reattach" },
+    { request::verb::interrupt, "interrupt" },
+    { request::verb::stats, "stats" },
+    { request::verb::clone, "clone" },
+    { request::verb::speculate, "speculate" },
+    { request::verb::memory, "memory" },
 })
 
 // Define how a response::status enum should be (de)serialized.
@@ -133,6 +218,18 @@ void to_json(json& j, const request& r);
 /// \param r The response to serialize.
 void to_json(json& j, const response& r);
 
+/// \brief Serializes a response \c r into a frame.
+/// \details Invalid UTF-8 in the content is replaced by U+FFFD.
+/// \param r The response to serialize.
+/// \return A frame containing the serialized response.
+frame encode(const response& r);
+
+/// \brief Deserializes a request from its JSON text \c raw.
+/// \param raw The JSON text to deserialize.
+/// \return The deserialized request.
+/// \throw std::invalid_argument If \c raw is not valid JSON, or if it does not describe a request.
+request decode(const std::string& raw);
+
 } // namespace wpwrapper
 
 #endif // WPWRAPPER_MESSAGE_H
@@ -0,0 +1,128 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "scheduler.h"
+
+#include <algorithm>
+
+namespace wpwrapper {
+
+void response_scheduler::push(wpwrapper::frame f)
+{
+    lane& l = lanes_[std::clamp(f.priority_, 0, lane_count - 1)];
+    unsigned int instance_id = f.instance_id_;
+
+    auto& queue = l.queues_[instance_id];
+    if (queue.empty())
+    {
+        // The instance did not have a turn yet.
+        l.turns_.push_back(instance_id);
+    }
+
+    queue.push(std::move(f));
+    ++l.size_;
+}
+
+std::optional<wpwrapper::frame> response_scheduler::pop()
+{
+    for (int i = lane_count - 1; i >= 0; --i)
+    {
+        lane& l = lanes_[i];
+        if (l.size_ == 0)
+        {
+            continue;
+        }
+
+        unsigned int instance_id = l.turns_.front();
+        l.turns_.pop_front();
+
+        auto& queue = l.queues_[instance_id];
+        std::optional<wpwrapper::frame> next(std::move(queue.front()));
+        queue.pop();
+        --l.size_;
+
+        if (!queue.empty())
+        {
+            // Let the other instances in this lane go first.
+            l.turns_.push_back(instance_id);
+        }
+
+        return next;
+    }
+
+    return {};
+}
+
+void response_scheduler::discard(unsigned int instance_id)
+{
+    for (auto& l: lanes_)
+    {
+        auto queue = l.queues_.find(instance_id);
+        if (queue == l.queues_.end())
+        {
+            continue;
+        }
+
+        if (!queue->second.empty())
+        {
+            l.size_ -= queue->second.size();
+            l.turns_.erase(std::find(l.turns_.begin(), l.turns_.end(), instance_id));
+        }
+
+        l.queues_.erase(queue);
+    }
+}
+
+std::vector<wpwrapper::frame> response_scheduler::take(unsigned int instance_id)
+{
+    std::vector<frame> taken;
+
+    for (int i = lane_count - 1; i >= 0; --i)
+    {
+        lane& l = lanes_[i];
+        auto queue = l.queues_.find(instance_id);
+        if (queue == l.queues_.end())
+        {
+            continue;
+        }
+
+        if (!queue->second.empty())
+        {
+            l.size_ -= queue->second.size();
+            l.turns_.erase(std::find(l.turns_.begin(), l.turns_.end(), instance_id));
+        }
+
+        while (!queue->second.empty())
+        {
+            taken.push_back(std::move(queue->second.front()));
+            queue->second.pop();
+        }
+
+        l.queues_.erase(queue);
+    }
+
+    return taken;
+}
+
+bool response_scheduler::empty() const noexcept
+{
+    return std::all_of(lanes_.begin(), lanes_.end(), [](const lane& l)
+    {
+        return l.size_ == 0;
+    });
+}
+
+} // namespace wpwrapper
@@ -0,0 +1,101 @@
+// This file is part of WaterProof.
+// Copyright (C) 2019  The ChefCoq team.
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef WPWRAPPER_SCHEDULER_H
+#define WPWRAPPER_SCHEDULER_H
+
+#include <array>
+#include <cstddef>
+#include <deque>
+#include <optional>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+#include "message.h"
+
+namespace wpwrapper {
+
+/// \brief Decides in which order queued responses are sent.
+/// \details Responses are queued as encoded frames and sorted into a small, fixed number of priority lanes. Within a
+/// lane, every instance has its own first-in first-out queue, and instances take turns. A frame is always taken from
+/// the highest non-empty lane, so the frames of a single instance are sent by priority, then in order of arrival, like
+/// the order defined by response::operator<. Pushing and popping take constant time, and frames are moved rather than
+/// copied.
+/// \note Not thread-safe.
+class response_scheduler {
+public:
+    /// \brief The number of priority lanes. Frames with a priority of at least \c lane_count - 1 share the highest
+    /// lane, frames with a priority of at most 0 share the lowest one.
+    static constexpr int lane_count = 2;
+
+    response_scheduler() = default;
+
+    // Scheduler is non-copyable.
+    response_scheduler(const response_scheduler& other) = delete;
+
+    // Scheduler is non-movable.
+    response_scheduler(response_scheduler&& other) = delete;
+
+    // Scheduler is non-copyable.
+    response_scheduler& operator=(const response_scheduler& other) = delete;
+
+    // Scheduler is non-movable.
+    response_scheduler& operator=(response_scheduler&& other) = delete;
+
+    /// \brief Queues a frame.
+    /// \param f The frame to queue.
+    void push(frame f);
+
+    /// \brief Takes the next frame to send.
+    /// \return The next frame to send, or an empty optional if no frame is queued.
+    std::optional<frame> pop();
+
+    /// \brief Drops all queued frames of an instance.
+    /// \param instance_id The instance to drop the frames of.
+    void discard(unsigned int instance_id);
+
+    /// \brief Removes all queued frames of an instance and returns them.
+    /// \param instance_id The instance to take the frames of.
+    /// \return The frames, in the order in which they would have been popped.
+    std::vector<frame> take(unsigned int instance_id);
+
+    /// \brief Returns \c true if no frame is queued.
+    /// \return \c true if no frame is queued.
+    bool empty() const noexcept;
+
+private:
+    /// \brief The frames of a single priority.
+    struct lane {
+        /// \brief Queued frames per instance, in order of arrival. An instance keeps its (possibly empty) queue
+        /// until it is discarded, so that its storage is reused. The server discards the queues of an instance when it
+        /// is unmapped or invalidated.
+        std::unordered_map<unsigned int, std::queue<frame>> queues_;
+
+        /// \brief Instances with a non-empty queue, in the order in which they take turns. Contains every instance at
+        /// most once.
+        std::deque<unsigned int> turns_;
+
+        /// \brief The number of queued frames in this lane.
+        std::size_t size_ = 0;
+    };
+
+    std::array<lane, lane_count> lanes_;
+};
+
+} // namespace wpwrapper
+
+#endif // WPWRAPPER_SCHEDULER_H
@@ -16,36 +16,75 @@
 
 #include "server.h"
 
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
 #include "../utils/buffers.h"
 
 namespace wpwrapper {
 
-void server::enqueue(const wpwrapper::response& response)
+void server::enqueue(wpwrapper::response response)
 {
     {
         std::lock_guard<std::mutex> guard(response_queue_mutex_);
-        response_queue_.push(response);
+
+        auto s = sessions_.find(response.instance_id_);
+        if (s == sessions_.end())
+        {
+            // The instance was invalidated, nobody to inform.
+            logger_->debug("dropped response for unmapped instance {}", response.instance_id_);
+            return;
+        }
+
+        // Only clients that asked for a session get a token, and can make use of sequence numbers.
+        response.sequence_ = s->second.next_sequence_++;
+        response.sequenced_ = !s->second.token_.empty();
+        if ((response.verb_ == request::verb::create || response.verb_ == request::verb::clone)
+            && response.status_ == response::status::success && response.sequenced_)
+        {
+            response.content_ = s->second.token_;
+        }
+    }
+
+    // Serialize outside of the lock, so that responses are serialized in parallel.
+    frame f = encode(response);
+
+    {
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+        response_queue_.push(std::move(f));
     }
     cv_.notify_one();
 }
 
-void server::unmap(unsigned int id, const response& response)
+void server::unmap(unsigned int id, wpwrapper::response response)
 {
-    std::lock_guard<std::mutex> guard(clients_mutex_);
-
-    try
     {
-        socket client = client_map_[id];
-        write(client, response);
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+
+        auto s = sessions_.find(id);
+        if (s == sessions_.end())
+        {
+            // Socket already invalidated, nobody to inform.
+            logger_->debug("instance {} was not mapped", id);
+            return;
+        }
+
+        response.sequence_ = s->second.next_sequence_++;
+        response.sequenced_ = !s->second.token_.empty();
     }
-    catch (const api_error& e)
+
+    // The final response is written by the write thread, so that it cannot interleave with another response on the
+    // same socket. Responses still queued for the instance would be dropped after unmapping anyway.
+    frame f = encode(response);
+
     {
-        logger_->debug("error occurred in writing final message to {}", id);
-        // we are already shutting down so ignore any errors
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+        response_queue_.discard(id);
+        response_queue_.push(std::move(f));
+        unmapping_.insert(id);
     }
-
-    client_map_.erase(id);
-    logger_->debug("unmapped instance {}", id);
+    cv_.notify_one();
 }
 
 void server::fail(const wpwrapper::api_error& error)
@@ -59,7 +98,7 @@ void server::fail(const wpwrapper::api_error& error)
     cv_.notify_one();
 
     // Causes an POLLHUP event in the accept and read threads.
-    close_all(std::vector<socket>{interrupt_[0]});
+    interrupt();
 
     // Notify subscribers.
     for (const auto& callback: on_failure_)
@@ -72,44 +111,330 @@ void server::invalidate(wpwrapper::server::socket client)
 {
     logger_->debug("invalidating socket {}", client);
 
-    std::lock_guard<std::mutex> guard(clients_mutex_);
-
-    // Remove the socket from the clients list.
-    auto in_clients = std::find(clients_.begin(), clients_.end(), client);
-    if (in_clients != clients_.end())
+    // Remove the socket from the clients list. Both the read and the write thread may invalidate the same socket; only
+    // the first one to do so continues.
     {
+        std::lock_guard<std::mutex> guard(clients_mutex_);
+
+        auto in_clients = std::find(clients_.begin(), clients_.end(), client);
+        if (in_clients == clients_.end())
+        {
+            return;
+        }
         clients_.erase(in_clients);
     }
 
-    // Remove all mappings to the invalid socket.
-    for (auto it = client_map_.cbegin(); it != client_map_.cend(); /* Do not increment. */)
+    // Remove all mappings to the invalid socket. With a grace period, instances are detached instead, unless they are
+    // being unmapped anyway.
+    std::vector<unsigned int> invalid_instances;
+    std::vector<unsigned int> detached_instances;
     {
-        if (it->second == client)
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+
+        client_map_.update([&](slot_map<socket>& map)
         {
-            it = client_map_.erase(it);
-            logger_->debug("unmapped instance {} from socket {}", it->first, it->second);
+            map.for_each([&](unsigned int id, socket& mapped)
+            {
+                if (mapped != client)
+                {
+                    return;
+                }
+
+                auto s = sessions_.find(id);
+                bool detach = grace_period_ > std::chrono::seconds::zero() && unmapping_.count(id) == 0
+                        && s != sessions_.end() && !s->second.token_.empty();
+                if (detach)
+                {
+                    mapped = detached;
+                    detached_instances.push_back(id);
+                }
+                else
+                {
+                    invalid_instances.push_back(id);
+                }
+            });
 
-            // Notify subscribers.
-            for (const auto& callback: on_invalidate_)
+            for (const auto& id: invalid_instances)
             {
-                callback(it->first);
+                map.erase(id);
             }
-            logger_->debug("invalidated instance {}", it->first);
+        });
+
+        // Nothing can be sent to these instances anymore.
+        for (const auto& id: invalid_instances)
+        {
+            response_queue_.discard(id);
+            unmapping_.erase(id);
+            sessions_.erase(id);
         }
-        else
+
+        // Responses that are still queued for detached instances end up in their history.
+        auto expiry = std::chrono::steady_clock::now() + grace_period_;
+        for (const auto& id: detached_instances)
         {
-            ++it;
+            sessions_.at(id).expiry_ = expiry;
+            expiries_.emplace(expiry, id);
         }
     }
 
+    if (!detached_instances.empty())
+    {
+        // The write thread keeps track of the grace periods.
+        cv_.notify_one();
+    }
+
+    for (const auto& id: detached_instances)
+    {
+        logger_->debug("detached instance {} from socket {} for {} s", id, client, grace_period_.count());
+    }
+
+    for (const auto& id: invalid_instances)
+    {
+        logger_->debug("unmapped instance {} from socket {}", id, client);
+
+        // Notify subscribers.
+        for (const auto& callback: on_invalidate_)
+        {
+            callback(id);
+        }
+        logger_->debug("invalidated instance {}", id);
+    }
+
     // Close the invalid socket.
     close_all(std::vector<socket>{client});
 }
 
-std::optional<wpwrapper::request> server::read(wpwrapper::server::socket client) const
+void server::announce(wpwrapper::server::socket client)
+{
+    {
+        std::lock_guard<std::mutex> guard(clients_mutex_);
+        clients_.push_back(client);
+        new_clients_.push(client);
+    }
+
+    logger_->debug("signalling read thread to refresh");
+
+    // The ACK char is written to the interrupt pipe to notify the read thread of a new client.
+    char ack = '\x06';
+    int written = 0;
+    while (written == 0)
+    {
+        written = api_->send(interrupt_[1], &ack, 1, 0);
+
+        if (written < 0)
+        {
+            throw api_error("unable to write to interrupt pipe", last_error(), logger_);
+        }
+    }
+}
+
+std::vector<unsigned int> server::expire()
+{
+    std::vector<unsigned int> expired;
+
+    auto now = std::chrono::steady_clock::now();
+    while (!expiries_.empty() && expiries_.begin()->first <= now)
+    {
+        unsigned int id = expiries_.begin()->second;
+        expiries_.erase(expiries_.begin());
+
+        response_queue_.discard(id);
+        unmapping_.erase(id);
+        sessions_.erase(id);
+        expired.push_back(id);
+    }
+
+    if (!expired.empty())
+    {
+        client_map_.update([&](slot_map<socket>& map)
+        {
+            for (const auto& id: expired)
+            {
+                map.erase(id);
+            }
+        });
+    }
+
+    return expired;
+}
+
+void server::reattach(wpwrapper::server::socket client, const wpwrapper::request& request)
 {
-    std::vector<char> buffer(4096, 0);
+    unsigned int id = request.instance_id_;
+    std::string token;
+    std::optional<uint64_t> last;
+
+    try
+    {
+        json content = json::parse(request.content_);
+        content.at("token").get_to(token);
+        if (content.contains("sequence"))
+        {
+            last = content.at("sequence").get<uint64_t>();
+        }
+    }
+    catch (const json::exception& e)
+    {
+        // Like other malformed requests, not fatal for either client or server.
+        logger_->warn("invalid reattach request for instance {} on socket {}: {}", id, client, e.what());
+
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+        refuse(client, request, fmt::format("invalid reattach request: {}", e.what()));
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+
+        auto found = sessions_.find(id);
+        if (found == sessions_.end() || found->second.token_.empty() || !same_token(found->second.token_, token))
+        {
+            logger_->warn("refused to reattach instance {} to socket {}", id, client);
+            refuse(client, request, "unknown instance or wrong session token");
+            return;
+        }
+
+        if (unmapping_.count(id) > 0)
+        {
+            logger_->warn("refused to reattach instance {} to socket {}, as it is being destroyed", id, client);
+            refuse(client, request, "instance is being destroyed");
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> clients_guard(clients_mutex_);
+            if (std::find(clients_.begin(), clients_.end(), client) == clients_.end())
+            {
+                // The new client has disconnected as well.
+                return;
+            }
+        }
+
+        session& s = found->second;
+        if (s.expiry_)
+        {
+            expiries_.erase({*s.expiry_, id});
+            s.expiry_.reset();
+        }
+
+        // If the instance is still attached to another client, that client loses it, and is told so.
+        socket previous = detached;
+        client_map_.update([&](slot_map<socket>& map)
+        {
+            socket* mapped = map.find(id);
+            previous = *mapped;
+            *mapped = client;
+        });
+
+        if (previous != detached && previous != client)
+        {
+            logger_->info("instance {} was taken over from socket {} by socket {}", id, previous, client);
+
+            response notice{};
+            notice.status_ = response::status::failure;
+            notice.verb_ = request::verb::reattach;
+            notice.instance_id_ = id;
+            notice.content_ = "reattached to another connection";
+            direct_.emplace(previous, encode(notice));
+        }
+
+        // Everything after the last response the client received, including what was never sent, in order.
+        std::vector<frame> replay;
+        for (const auto& f: s.history_)
+        {
+            if (!last || f.sequence_ > *last)
+            {
+                replay.push_back(f);
+            }
+        }
+
+        std::vector<frame> queued = response_queue_.take(id);
+        replay.insert(replay.end(), std::make_move_iterator(queued.begin()), std::make_move_iterator(queued.end()));
+        std::sort(replay.begin(), replay.end(), [](const frame& a, const frame& b)
+        {
+            return a.sequence_ < b.sequence_;
+        });
 
+        logger_->debug("reattached instance {} to socket {}, replaying {} responses", id, client, replay.size());
+
+        response r{};
+        r.status_ = response::status::success;
+        r.verb_ = request::verb::reattach;
+        r.instance_id_ = id;
+        r.sequence_ = s.next_sequence_++;
+        r.sequenced_ = true;
+        replay.push_back(encode(r));
+
+        for (auto& f: replay)
+        {
+            // Frames of the same priority are sent in the order in which they were queued.
+            f.priority_ = 0;
+            response_queue_.push(std::move(f));
+        }
+    }
+    cv_.notify_one();
+}
+
+void server::refuse(wpwrapper::server::socket client, const wpwrapper::request& request, std::string reason)
+{
+    response r{};
+    r.status_ = response::status::failure;
+    r.verb_ = request.verb_;
+    r.instance_id_ = request.instance_id_;
+    r.content_ = std::move(reason);
+
+    direct_.emplace(client, encode(r));
+    cv_.notify_one();
+}
+
+std::string server::new_token()
+{
+    return fmt::format("{:08x}{:08x}{:08x}{:08x}", token_source_(), token_source_(), token_source_(),
+            token_source_());
+}
+
+bool server::same_token(std::string_view expected, std::string_view presented) noexcept
+{
+    if (expected.size() != presented.size())
+    {
+        return false;
+    }
+
+    unsigned char difference = 0;
+    for (std::size_t c = 0; c < expected.size(); ++c)
+    {
+        difference |= static_cast<unsigned char>(expected[c] ^ presented[c]);
+    }
+    return difference == 0;
+}
+
+void server::remember(wpwrapper::server::session& s, wpwrapper::frame f)
+{
+    s.history_bytes_ += f.data_.length();
+    s.history_.push_back(std::move(f));
+
+    while (s.history_bytes_ > max_history_bytes)
+    {
+        s.history_bytes_ -= s.history_.front().data_.length();
+        s.history_.pop_front();
+    }
+}
+
+std::optional<wpwrapper::server::socket> server::route(unsigned int id) const
+{
+    return client_map_.read([id](const slot_map<socket>& map) -> std::optional<socket>
+    {
+        const socket* client = map.find(id);
+        if (client == nullptr || *client == detached)
+        {
+            return {};
+        }
+        return *client;
+    });
+}
+
+std::optional<std::string> server::read(wpwrapper::server::socket client)
+{
     // Points to the next character to read into.
     char* data;
     int bytes_to_read;
@@ -118,7 +443,7 @@ std::optional<wpwrapper::request> server::read(wpwrapper::server::socket client)
     // First four bytes in a request indicate request length.
     uint32_t length = 0;
 
-    data = buffer.data();
+    data = length_buffer_.data();
     bytes_to_read = sizeof length;
     while (bytes_to_read > 0)
     {
@@ -143,18 +468,23 @@ std::optional<wpwrapper::request> server::read(wpwrapper::server::socket client)
     }
 
     // Read the request length from the buffer.
-    length = buffers::read_uint32(buffer, buffers::endianness::big);
-    buffers::clear(buffer);
+    length = buffers::read_uint32(length_buffer_, buffers::endianness::big);
 
     logger_->trace("reading {} bytes from socket {}", length, client);
 
-    // Read data from Waterproof.
+    // Read data from Waterproof straight into the request. The request grows in bounded steps, so that a bogus length
+    // does not allocate more than what actually arrives.
     std::string raw_request;
-    bytes_to_read = length;
-    while (bytes_to_read > 0)
+    std::size_t received = 0;
+    while (received < length)
     {
-        // Read at most the buffer length bytes.
-        result = api_->recv(client, buffer.data(), (bytes_to_read > buffer.size()) ? buffer.size() : bytes_to_read, 0);
+        if (received == raw_request.length())
+        {
+            raw_request.resize(std::min<std::size_t>(length, received + max_read_step));
+        }
+
+        bytes_to_read = static_cast<int>(raw_request.length() - received);
+        result = api_->recv(client, raw_request.data() + received, bytes_to_read, 0);
 
         if (result == 0 || (result < 0 && last_error() == WPCONNRESET))
         {
@@ -167,41 +497,26 @@ std::optional<wpwrapper::request> server::read(wpwrapper::server::socket client)
         }
         else
         {
-            bytes_to_read -= result;
-
-            raw_request.append(buffer.data(), result);
-            buffers::clear(buffer);
+            received += result;
         }
     }
 
     logger_->trace("read {} ({} chars) from socket {}", raw_request, raw_request.length(), client);
 
-    // Parse data to request.
-    auto j = nlohmann::json::parse(raw_request);
-    return j.get<request>();
+    return raw_request;
 }
 
-void server::write(wpwrapper::server::socket client, const wpwrapper::response& response) const
+void server::write(wpwrapper::server::socket client, const wpwrapper::frame& f) const
 {
-    std::vector<char> buffer(4, 0);
-
     // Points to the next character to write.
-    const char* data;
-    int bytes_to_write;
+    const char* data = f.data_.c_str();
+    std::size_t bytes_to_write = f.data_.length();
     int result;
 
-    // Serialize the response.
-    nlohmann::json json = response;
-    std::string raw = json.dump();
-
-    // Write the response length to Waterproof.
-    uint32_t length = raw.length();
-    buffers::write_uint32(length, buffer, buffers::endianness::big);
-
-    logger_->trace("writing {:#010x} to socket {}", length, client);
+    logger_->trace("writing {} bytes to socket {}", bytes_to_write, client);
 
-    data = buffer.data();
-    bytes_to_write = sizeof length;
+    // The length prefix and the response go out together, so the response is not held back waiting for the
+    // acknowledgement of a tiny first segment.
     while (bytes_to_write > 0)
     {
         result = api_->send(client, data, bytes_to_write, 0);
@@ -216,37 +531,164 @@ void server::write(wpwrapper::server::socket client, const wpwrapper::response&
         // Move pointer to next char to write.
         data += result;
     }
+}
 
-    // Write the response itself to Waterproof.
-    data = raw.c_str();
-    bytes_to_write = length;
-    while (bytes_to_write > 0)
+void server::dispatch(const std::shared_ptr<connection>& c, std::optional<std::string> raw)
+{
+    c->frames_.push(std::move(raw));
+
+    // Only one decoder runs per connection, so the requests of a client are handled in order.
+    if (c->scheduled_.fetch_add(1) == 0)
     {
-        result = api_->send(client, data, bytes_to_write > 4096 ? 4096 : bytes_to_write, 0);
+        ++decoding_;
+        executor_->submit([this, c]
+        {
+            decode(c);
+        });
+    }
+}
 
-        if (result < 0)
+void server::decode(const std::shared_ptr<connection>& c)
+{
+    unsigned int handled;
+
+    do
+    {
+        handled = 0;
+
+        while (auto raw = c->frames_.pop())
         {
-            throw api_error(fmt::format("unable to write to socket {}", client), last_error());
+            ++handled;
+
+            if (!running_)
+            {
+                // The server is shutting down: the callbacks may no longer be valid.
+                continue;
+            }
+
+            if (*raw)
+            {
+                handle_request(c->socket_, **raw);
+            }
+            else
+            {
+                invalidate(c->socket_);
+            }
         }
+    }
+    while (c->scheduled_.fetch_sub(handled) != handled);
 
-        bytes_to_write -= result;
+    if (--decoding_ == 0)
+    {
+        decoding_.notify_all();
+    }
+}
 
-        // Move pointer to next char to write.
-        data += result;
+void server::handle_request(wpwrapper::server::socket client, const std::string& raw)
+{
+    request request;
+
+    try
+    {
+        request = wpwrapper::decode(raw);
+    }
+    catch (const std::invalid_argument& e)
+    {
+        // Parse error is not fatal for either client or server.
+        logger_->warn("json parse error on socket {}: {}", client, e.what());
+        return;
     }
 
-    logger_->trace("wrote '{}' ({} chars) to socket {}", raw, length, client);
+    if (request.verb_ == request::verb::clone && !may_clone(client, request))
+    {
+        logger_->warn("refused to clone instance {} for socket {}", request.instance_id_, client);
+
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+        refuse(client, request, "unknown instance or wrong session token");
+        return;
+    }
+
+    // On receiving a create or clone request, we need to assign an instance id and map it to the socket.
+    if (request.verb_ == request::verb::create || request.verb_ == request::verb::clone)
+    {
+        {
+            std::lock_guard<std::mutex> guard(response_queue_mutex_);
+
+            if (request.verb_ == request::verb::clone)
+            {
+                request.source_id_ = request.instance_id_;
+            }
+            try
+            {
+                client_map_.update([&](slot_map<socket>& map)
+                {
+                    request.instance_id_ = map.insert(client);
+                });
+            }
+            catch (const std::length_error& e)
+            {
+                logger_->warn("no instance id left for socket {}: {}", client, e.what());
+                refuse(client, request, "too many instances");
+                return;
+            }
+
+            // Without a session, the instance cannot be reattached or cloned by another client.
+            sessions_[request.instance_id_].token_ = request.session_ ? new_token() : std::string();
+        }
+
+        logger_->debug("mapped instance {} to socket {}", request.instance_id_, client);
+    }
+    else if (request.verb_ == request::verb::reattach)
+    {
+        // Only concerns the server: the worker does not know about connections.
+        reattach(client, request);
+        return;
+    }
+
+    for (const auto& callback: on_request_)
+    {
+        callback(request);
+    }
+}
+
+bool server::may_clone(wpwrapper::server::socket client, const wpwrapper::request& request)
+{
+    if (route(request.instance_id_) == client)
+    {
+        return true;
+    }
+
+    // Like a reattach request, a clone request for a worker of another client needs its token.
+    std::string token;
+    try
+    {
+        json::parse(request.content_).at("token").get_to(token);
+    }
+    catch (const json::exception& e)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(response_queue_mutex_);
+    auto found = sessions_.find(request.instance_id_);
+    return found != sessions_.end() && !found->second.token_.empty() && same_token(found->second.token_, token)
+           && unmapping_.count(request.instance_id_) == 0;
+}
+
+void server::wait_for_decoders() noexcept
+{
+    // Woken by the last parsing task to finish.
+    for (unsigned int decoding = decoding_; decoding > 0; decoding = decoding_)
+    {
+        decoding_.wait(decoding);
+    }
 }
 
 void server::accept_loop() noexcept
 {
     logger_->debug("started accept loop");
 
-    // The ACK char is written to the interrupt pipe when a new client is accepted.
-    char ack = '\x06';
-
     int result;
-    int written;
 
     // Wait for POLLRDBAND on the interrupt socket as macOS does not seem to adequately support waiting on 'nothing'.
     waitfd interrupt = {interrupt_[0], POLLRDBAND};
@@ -287,27 +729,29 @@ void server::accept_loop() noexcept
                 break;
             }
 
-            // TODO: mark socket non-inheritable?
-
+            // Otherwise, a sertop instance that inherits the socket keeps the connection open after it is closed here.
+            if (!disinherit(client))
             {
-                std::lock_guard<std::mutex> guard(clients_mutex_);
-                clients_.push_back(client);
-                new_clients_.push(client);
+                logger_->warn("unable to keep socket {} from being inherited", client);
             }
 
-            logger_->debug("signalling read thread to refresh");
-
-            // Notify the read thread that a new client has been accepted.
-            written = 0;
-            while (written == 0)
+            // Every frame is sent in one go, so there is nothing to coalesce. Without this, a response that directly
+            // follows another one waits for the client to acknowledge the first.
+            int enable = 1;
+            if (api_->setsockopt(client, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&enable),
+                    sizeof enable) < 0)
             {
-                written = api_->send(interrupt_[1], &ack, 1, 0);
+                logger_->warn("unable to disable coalescing on socket {}", client);
+            }
 
-                if (written < 0)
-                {
-                    fail(api_error("unable to write to interrupt pipe", last_error(), logger_));
-                    break;
-                }
+            try
+            {
+                announce(client);
+            }
+            catch (const api_error& e)
+            {
+                fail(e);
+                break;
             }
         }
     }
@@ -320,7 +764,6 @@ void server::read_loop() noexcept
     logger_->debug("started read loop");
     int result;
 
-    std::vector<socket> invalid_sockets;
     waitfd waitfds[256];
     int next = 0;
 
@@ -379,6 +822,10 @@ void server::read_loop() noexcept
 
             logger_->debug("received refresh for new socket {}", recent);
 
+            auto c = std::make_shared<connection>();
+            c->socket_ = recent;
+            connections_[recent] = std::move(c);
+
             // Start listening for incoming data on the new client.
             waitfd client = {recent, POLLRDNORM, 0};
             waitfds[next++] = client;
@@ -395,71 +842,52 @@ void server::read_loop() noexcept
 //            waitfds[j-1]->events = array[j].events;
 #endif
 
+            if (waitfds[j].fd < 0)
+            {
+                continue;
+            }
+
+            // Requests are decoded and handled on the executor, so this thread only moves bytes.
+            const auto c = connections_.at(waitfds[j].fd);
+
             if (waitfds[j].revents & (POLLHUP | POLLERR))
             {
                 logger_->debug("received {} shutdown on socket {}", waitfds[j].revents & POLLHUP ? "soft" : "hard",
                         waitfds[j].fd);
-                invalid_sockets.push_back(waitfds[j].fd);
-                waitfds[j].fd = -1;
             }
             else if (waitfds[j].revents & POLLRDNORM)
             {
-                std::optional<request> request;
+                std::optional<std::string> raw;
 
                 try
                 {
-                    request = read(waitfds[j].fd);
+                    raw = read(waitfds[j].fd);
                 }
                 catch (const api_error& e)
                 {
                     // API error is not fatal for server, but is fatal for client.
                     logger_->error(e.what());
-                    invalid_sockets.push_back(waitfds[j].fd);
-                    waitfds[j].fd = -1;
-                    continue;
                 }
-                catch (const nlohmann::json::parse_error& e)
+
+                if (raw)
                 {
-                    // Parse error is not fatal for either client or server.
-                    logger_->warn("json parse error on socket {}: {}", waitfds[j].fd, e.what());
+                    dispatch(c, std::move(raw));
                     continue;
                 }
 
-                if (request)
-                {
-                    // On receiving a create request, we need to assign an instance id and map it to the socket.
-                    if (request->verb_ == request::verb::create)
-                    {
-                        std::lock_guard<std::mutex> guard(clients_mutex_);
-
-                        request->instance_id_ = next_id_++;
-                        client_map_.insert(std::make_pair(request->instance_id_, waitfds[j].fd));
-
-                        logger_->debug("mapped instance {} to socket {}", request->instance_id_, waitfds[j].fd);
-                    }
-
-                    for (const auto& callback: on_request_)
-                    {
-                        callback(request.value());
-                    }
-                }
-                else
-                {
-                    // Read 0 bytes or got WPCONNRESET: connection shut down on other end.
-                    logger_->debug("received shutdown on socket {} while reading", waitfds[j].fd);
-                    invalid_sockets.push_back(waitfds[j].fd);
-                    waitfds[j].fd = -1;
-                }
+                // Read 0 bytes or got WPCONNRESET: connection shut down on other end.
+                logger_->debug("received shutdown on socket {} while reading", waitfds[j].fd);
+            }
+            else
+            {
+                continue;
             }
-        }
 
-        // Deal with invalid sockets.
-        for (const auto& socket: invalid_sockets)
-        {
-            invalidate(socket);
+            // The socket is invalidated after the requests that were read before, in order.
+            dispatch(c, std::nullopt);
+            connections_.erase(waitfds[j].fd);
+            waitfds[j].fd = -1;
         }
-
-        invalid_sockets.clear();
     }
 
     logger_->debug("stopped read loop");
@@ -473,11 +901,20 @@ void server::write_loop() noexcept
     {
         std::unique_lock<std::mutex> lock(response_queue_mutex_);
 
-        // Wait until a new response can be sent or until we're told to stop.
-        cv_.wait(lock, [&]
+        // Wait until a new response can be sent, until the grace period of a detached instance has passed or until
+        // we're told to stop.
+        while (response_queue_.empty() && direct_.empty() && running_ && !releasing_
+                && (expiries_.empty() || expiries_.begin()->first > std::chrono::steady_clock::now()))
         {
-            return !response_queue_.empty() || !running_;
-        });
+            if (expiries_.empty())
+            {
+                cv_.wait(lock);
+            }
+            else
+            {
+                cv_.wait_until(lock, expiries_.begin()->first);
+            }
+        }
 
         if (!running_)
         {
@@ -485,20 +922,116 @@ void server::write_loop() noexcept
             break;
         }
 
-        response response = response_queue_.top();
-        response_queue_.pop();
-        socket client = client_map_[response.instance_id_];
+        if (!direct_.empty())
+        {
+            auto [client, f] = std::move(direct_.front());
+            direct_.pop();
+            lock.unlock();
+
+            try
+            {
+                write(client, f);
+            }
+            catch (const api_error& e)
+            {
+                // Fatal error for client, but not for server.
+                invalidate(client);
+            }
+            continue;
+        }
+
+        if (releasing_ && response_queue_.empty())
+        {
+            // Everything has been sent, and the previous response has been written completely.
+            logger_->debug("released write loop");
+            break;
+        }
+
+        // Instances that are being handed over are not invalidated, as their workers are handed over too.
+        std::vector<unsigned int> expired = releasing_ ? std::vector<unsigned int>() : expire();
+        if (!expired.empty())
+        {
+            lock.unlock();
+
+            for (const auto& id: expired)
+            {
+                logger_->debug("instance {} was not reattached in time", id);
+
+                // Notify subscribers.
+                for (const auto& callback: on_invalidate_)
+                {
+                    callback(id);
+                }
+                logger_->debug("invalidated instance {}", id);
+            }
+            continue;
+        }
+
+        frame f = std::move(*response_queue_.pop());
+
+        // After unmap(), the first response that is sent to the instance is the final one.
+        bool final = unmapping_.erase(f.instance_id_) > 0;
 
         lock.unlock();
 
-        try
+        std::optional<socket> client = route(f.instance_id_);
+        if (client)
+        {
+            try
+            {
+                write(*client, f);
+            }
+            catch (const api_error& e)
+            {
+                // Fatal error for client, but not for server.
+                invalidate(*client);
+            }
+
+            if (!final && grace_period_ == std::chrono::seconds::zero())
+            {
+                // Nothing to keep.
+                continue;
+            }
+        }
+
+        lock.lock();
+
+        auto s = sessions_.find(f.instance_id_);
+        if (s == sessions_.end())
+        {
+            if (!client)
+            {
+                // The instance was unmapped or its socket was invalidated after the response was queued.
+                logger_->debug("dropped response for unmapped instance {}", f.instance_id_);
+            }
+
+            // Forget the queue the response left behind.
+            response_queue_.discard(f.instance_id_);
+        }
+        else if (final)
+        {
+            if (s->second.expiry_)
+            {
+                expiries_.erase({*s->second.expiry_, f.instance_id_});
+            }
+            sessions_.erase(s);
+            response_queue_.discard(f.instance_id_);
+
+            client_map_.update([&](slot_map<socket>& map)
+            {
+                map.erase(f.instance_id_);
+            });
+            logger_->debug("unmapped instance {}", f.instance_id_);
+        }
+        else if (!client && !s->second.expiry_)
         {
-            write(client, response);
+            // The instance was reattached after its route was looked up.
+            response_queue_.push(std::move(f));
         }
-        catch (const api_error& e)
+        else if (grace_period_ > std::chrono::seconds::zero() && !s->second.token_.empty())
         {
-            // Fatal error for client, but not for server.
-            invalidate(client);
+            // Sent, or held back because the instance is detached. Either way, it may need to be replayed.
+            remember(s->second, std::move(f));
         }
     }
 
@@ -18,20 +18,33 @@
 #define WPWRAPPER_SERVER_H
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
+#include <random>
+#include <set>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <spdlog/spdlog.h>
 
 #include "message.h"
+#include "scheduler.h"
 #include "../utils/exceptions.h"
+#include "../utils/executor.h"
+#include "../utils/mpsc_queue.h"
+#include "../utils/rcu.h"
+#include "../utils/slot_map.h"
 
 #ifdef WPWRAPPER_WIN
 
@@ -58,22 +71,77 @@ public:
     /// \brief Platform-agnostic socket type. On Windows, a socket is a void pointer.
     using socket = SOCKET;
     using waitfd = WSAPOLLFD;
+    /// \brief Stands in for the socket of an instance whose client disconnected.
+    static constexpr socket detached = INVALID_SOCKET;
 #elif WPWRAPPER_POSIX
     /// \brief Platform-agnostic socket type. On Ubuntu and macOS, a socket is a file descriptor int.
     using socket = int;
     using waitfd = pollfd;
+    /// \brief Stands in for the socket of an instance whose client disconnected.
+    static constexpr socket detached = -1;
+#endif
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief What another wrapper process needs to take over the connections of this server.
+    struct snapshot {
+        /// \brief A mapped instance.
+        struct instance {
+            /// \brief The instance id.
+            unsigned int id_;
+            /// \brief The socket to which the instance is mapped, or \c detached.
+            socket socket_;
+            /// \brief The session token.
+            std::string token_;
+            /// \brief The sequence number of the next response.
+            uint64_t next_sequence_;
+            /// \brief The responses that can be replayed, oldest first.
+            std::vector<frame> history_;
+            /// \brief For a detached instance, how much of the grace period is left.
+            std::optional<std::chrono::milliseconds> grace_left_;
+        };
+
+        /// \brief The socket on which new clients are accepted.
+        socket listen_socket_;
+        /// \brief All connected clients.
+        std::vector<socket> clients_;
+        /// \brief All mapped instances.
+        std::vector<instance> instances_;
+    };
 #endif
 
     /// \brief Constructs a server that listens on port \c port.
     /// \details Creates three server threads: one for accepting new clients, one for reading from these clients and one
-    /// for writing to these clients.
+    /// for writing to these clients. These threads only move raw frames. Requests are parsed on \c executor_instance,
+    /// in order per client, and responses are serialized by the thread that enqueues them.
+    /// \param api_instance The API instance to use.
+    /// \param executor_instance The executor on which requests are parsed.
+    /// \param failure_callbacks A list of callbacks to execute when an error occurs in any of the server threads.
+    /// \param request_callbacks A list of callbacks to execute when a request is received from Waterproof.
+    /// \param invalidate_callbacks A list of callbacks to execute when a worker instance becomes invalid.
+    /// \param grace_period How long the instances of a disconnected client stay alive, waiting to be reattached. Zero
+    /// invalidates them as soon as the client disconnects.
+    /// \throw api_error If the socket could not be created, or if any other API call fails.
+    server(std::shared_ptr<api> api_instance, std::shared_ptr<executor> executor_instance,
+            std::vector<failure_callback> failure_callbacks,
+            std::vector<request_callback> request_callbacks, std::vector<invalidate_callback> invalidate_callbacks,
+            std::chrono::seconds grace_period = std::chrono::seconds::zero());
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief Constructs a server that takes over the connections of a server in another wrapper process, instead of
+    /// opening a new listen socket. Only available on macOS and Ubuntu.
     /// \param api_instance The API instance to use.
+    /// \param executor_instance The executor on which requests are parsed.
     /// \param failure_callbacks A list of callbacks to execute when an error occurs in any of the server threads.
     /// \param request_callbacks A list of callbacks to execute when a request is received from Waterproof.
     /// \param invalidate_callbacks A list of callbacks to execute when a worker instance becomes invalid.
+    /// \param grace_period How long the instances of a disconnected client stay alive, waiting to be reattached.
+    /// \param adopted The connections to take over. Empty to open a new listen socket.
     /// \throw api_error If the socket could not be created, or if any other API call fails.
-    server(std::shared_ptr<api> api_instance, std::vector<failure_callback> failure_callbacks,
-            std::vector<request_callback> request_callbacks, std::vector<invalidate_callback> invalidate_callbacks);
+    server(std::shared_ptr<api> api_instance, std::shared_ptr<executor> executor_instance,
+            std::vector<failure_callback> failure_callbacks,
+            std::vector<request_callback> request_callbacks, std::vector<invalidate_callback> invalidate_callbacks,
+            std::chrono::seconds grace_period, std::optional<snapshot> adopted);
+#endif
 
     /// \brief Destructs this worker.
     /// \details Stops the server threads and cleans up open handles/file descriptors.
@@ -92,14 +160,64 @@ public:
     server& operator=(server&& other) = delete;
 
     /// \brief Add a response to be sent to Waterproof.
+    /// \details Assigns the next sequence number of the instance to the response. A successful create or clone response
+    /// carries the session token of the new instance as its content. The response is serialized on the calling thread.
     /// \param response The response to add.
-    void enqueue(const response& response);
+    void enqueue(response response);
 
-    /// \brief Unmaps a single worker from its socket.
+    /// \brief Unmaps a single worker from its socket, after sending a final response.
+    /// \details Responses for the worker that are still queued are dropped.
     /// \param id Unique identifier for the worker to unmap.
-    void unmap(unsigned int id, const response& response);
+    /// \param response The final response to send to the worker's socket.
+    void unmap(unsigned int id, response response);
+
+#ifdef WPWRAPPER_POSIX
+    /// \brief Stops accepting clients and reading requests. Requests that were read already are still handled.
+    /// \details Requests that arrive from now on stay in the socket buffers, for the process that takes over.
+    void pause();
+
+    /// \brief Sends all queued responses, stops the server threads and gives up the connections, so that another
+    /// wrapper process can take them over.
+    /// \note pause() must have been called first.
+    /// \return The connections. Their sockets stay open until this server is destructed.
+    snapshot release();
+#endif
 
 private:
+    /// \brief A client whose requests are being parsed.
+    struct connection {
+        /// \brief The client's socket.
+        socket socket_;
+
+        /// \brief Raw requests read from the socket, in order of arrival. An empty frame marks the end of the
+        /// connection.
+        mpsc_queue<std::optional<std::string>> frames_;
+
+        /// \brief The number of frames pushed since the parsing task last caught up. A parsing task is only submitted
+        /// when this goes from zero to one, so at most one is active per connection.
+        std::atomic<unsigned int> scheduled_{0};
+    };
+
+    /// \brief What the server keeps for a mapped instance, on top of its route.
+    struct session {
+        /// \brief Secret that a client needs to reattach the instance. Only sent to the client that created it. Empty
+        /// if that client did not ask for a session, in which case the instance cannot be reattached.
+        std::string token_;
+
+        /// \brief The sequence number of the next response for the instance.
+        uint64_t next_sequence_ = 0;
+
+        /// \brief The most recent responses that were sent, or that could not be sent because the client was gone, in
+        /// the order in which they left the queue. Replayed when the instance is reattached. Only kept if there is a
+        /// grace period.
+        std::deque<frame> history_;
+
+        /// \brief The total size of the frames in the history.
+        std::size_t history_bytes_ = 0;
+
+        /// \brief While the instance is detached, the moment at which it is invalidated.
+        std::optional<std::chrono::steady_clock::time_point> expiry_;
+    };
 
     /// \brief Closes a list of sockets (on Windows) or file descriptors (on macOS and Ubuntu).
     /// \param fds A list containing all file descriptors to close.
@@ -109,10 +227,73 @@ private:
     /// \param error The error that lead to failure.
     void fail(const api_error& error);
 
+    /// \brief Wakes the accept and read threads from their blocking wait with a hangup on the interrupt socket.
+    /// \details On macOS and Ubuntu, the read end of the interrupt socket is shut down. On Windows, it is closed.
+    void interrupt() noexcept;
+
     /// \brief Unmaps all workers associated with a client. Executes the on_invalidate callbacks.
+    /// \details If there is a grace period, the workers are detached instead, and only invalidated if they are not
+    /// reattached in time. Workers that are being unmapped are invalidated right away.
     /// \param client The socket to invalidate.
     void invalidate(socket client);
 
+    /// \brief Adds a client to the client list, and has the read thread start reading from it.
+    /// \param client The client.
+    /// \throw api_error If the read thread could not be notified.
+    void announce(socket client);
+
+    /// \brief Invalidates the detached workers whose grace period has passed.
+    /// \return The invalidated workers. The on_invalidate callbacks still need to be executed for them.
+    /// \note The response queue mutex must be held.
+    std::vector<unsigned int> expire();
+
+    /// \brief Binds a worker to the socket from which a reattach request was read, and replays the responses that the
+    /// client missed, followed by the reattach response.
+    /// \details Requests with an unknown worker or a wrong token are refused. If the worker is still attached to
+    /// another connection, that connection is sent a failed reattach response for it.
+    /// \param client The socket from which the request was read.
+    /// \param request The reattach request.
+    void reattach(socket client, const request& request);
+
+    /// \brief Decides whether the client on a socket may clone a worker: either the worker belongs to it, or the clone
+    /// request holds the session token of the worker.
+    /// \param client The socket from which the request was read.
+    /// \param request The clone request.
+    /// \return \c true if the worker may be cloned.
+    bool may_clone(socket client, const request& request);
+
+    /// \brief Sends a failure response for a request that is refused before it reaches a worker.
+    /// \details The response goes to the socket from which the request was read rather than to the socket of the
+    /// worker, if any, and is not part of any session.
+    /// \param client The socket from which the request was read.
+    /// \param request The refused request.
+    /// \param reason Why the request was refused, sent as the response content.
+    /// \note The response queue mutex must be held.
+    void refuse(socket client, const request& request, std::string reason);
+
+    /// \brief Draws a new session token from the random device of the system.
+    /// \return 128 random bits, in hexadecimal.
+    /// \note The response queue mutex must be held.
+    std::string new_token();
+
+    /// \brief Compares a session token with the one that a client presented, in a time that does not depend on where
+    /// they differ.
+    /// \param expected The session token.
+    /// \param presented The token that the client presented.
+    /// \return \c true if they are the same.
+    static bool same_token(std::string_view expected, std::string_view presented) noexcept;
+
+    /// \brief Adds a frame to the history of a session, dropping the oldest frames if it grows too large.
+    /// \param s The session.
+    /// \param f The frame.
+    /// \note The response queue mutex must be held.
+    void remember(session& s, frame f);
+
+    /// \brief Keeps a socket from being inherited by the sertop instances and wrapper processes started later.
+    /// \param client The socket.
+    /// \return \c true on success.
+    bool disinherit(socket client) const noexcept;
+
     /// \brief Returns the error status for the last failed operation.
     /// \return The error status for the last failed operation.
     int last_error() const noexcept;
@@ -123,16 +304,40 @@ private:
     /// \return The number of file descriptors with nonzero revents values.
     int wait(waitfd fds[], int n) const noexcept;
 
-    /// \brief Reads a request from a socket.
+    /// \brief Looks up the socket to which an instance is mapped. Does not take a lock.
+    /// \param id The instance to look up.
+    /// \return The socket, or an empty optional if the instance is not mapped or detached.
+    std::optional<socket> route(unsigned int id) const;
+
+    /// \brief Reads a raw request from a socket.
     /// \param client The socket to read from.
-    /// \return The read request. Empty if the socket was reset or shutdown.
+    /// \return The request, without its length prefix. Empty if the socket was reset or shutdown.
     /// \throw api_error If an API call fails.
-    std::optional<request> read(socket client) const;
+    /// \note Only called on the read thread.
+    std::optional<std::string> read(socket client);
 
-    /// \brief Writes a response to a socket.
+    /// \brief Writes a frame to a socket.
     /// \param client The socket to write to.
-    /// \param response The response to write.
-    void write(socket client, const response& response) const;
+    /// \param f The frame to write.
+    /// \throw api_error If an API call fails.
+    void write(socket client, const frame& f) const;
+
+    /// \brief Hands a raw request, or the end of a connection, to the connection's parsing task.
+    /// \param c The connection.
+    /// \param raw The raw request, or an empty optional if the connection ended.
+    void dispatch(const std::shared_ptr<connection>& c, std::optional<std::string> raw);
+
+    /// \brief Parses the raw requests of a connection until none are left. Executed as a task on the executor.
+    /// \param c The connection.
+    void decode(const std::shared_ptr<connection>& c);
+
+    /// \brief Parses a raw request and executes the on_request callbacks.
+    /// \param client The socket from which the request was read.
+    /// \param raw The raw request.
+    void handle_request(socket client, const std::string& raw);
+
+    /// \brief Waits until all parsing tasks have finished. They no longer parse anything once the server has stopped.
+    void wait_for_decoders() noexcept;
 
     /// \brief Listens on the listen socket and accepts new clients.
     /// \note Should be executed on a separate thread.
@@ -149,8 +354,6 @@ private:
     /// \brief Indicates whether the server threads should be running or not.
     std::atomic<bool> running_;
 
-    /// \brief The lowest free worker instance id, which will be assigned to a new worker upon a create request.
-    unsigned int next_id_;
     /// \brief Socket used to listen for new clients.
     socket listen_socket_;
 
@@ -158,6 +361,19 @@ private:
     std::shared_ptr<spdlog::logger> logger_;
     /// \brief API instance used for all API calls.
     std::shared_ptr<api> api_;
+    /// \brief Executor on which requests are parsed.
+    std::shared_ptr<executor> executor_;
+
+    /// \brief Connections by socket.
+    /// \note Only accessed by the read thread.
+    std::unordered_map<socket, std::shared_ptr<connection>> connections_;
+    /// \brief Receives the length prefix of a request.
+    /// \note Only accessed by the read thread.
+    std::vector<char> length_buffer_ = std::vector<char>(sizeof(uint32_t), 0);
+    /// \brief The largest number of bytes by which a request that is being read grows at once.
+    static constexpr std::size_t max_read_step = 1 << 20;
+    /// \brief The number of parsing tasks that have been submitted but have not finished.
+    std::atomic<unsigned int> decoding_;
 
     /// \brief List of callbacks that are executed when an error occurs in one of the worker threads.
     std::vector<failure_callback> on_failure_;
@@ -166,20 +382,46 @@ private:
     /// \brief List of callbacks that are executed when a worker becomes invalid.
     std::vector<invalidate_callback> on_invalidate_;
 
-    /// \brief Priority queue containing all responses that still need to be sent.
-    std::priority_queue<response> response_queue_;
-    /// \brief Guards the response queue.
+    /// \brief All responses that still need to be sent.
+    response_scheduler response_queue_;
+    /// \brief Failure responses that go to a given socket rather than to the socket of their instance, with that
+    /// socket: refused requests, and notices to clients whose instance was reattached to another connection. Sent
+    /// before any other response.
+    std::queue<std::pair<socket, frame>> direct_;
+    /// \brief Instances for which unmap() was called, but whose final response has not been sent yet.
+    std::unordered_set<unsigned int> unmapping_;
+    /// \brief Sessions of all mapped instances.
+    std::unordered_map<unsigned int, session> sessions_;
+    /// \brief Detached instances, by the moment at which they are invalidated.
+    std::set<std::pair<std::chrono::steady_clock::time_point, unsigned int>> expiries_;
+    /// \brief Source of session tokens. Every token is drawn from it directly, so that one token says nothing about
+    /// another.
+    std::random_device token_source_;
+    /// \brief The largest total size of the frames in a session history.
+    static constexpr std::size_t max_history_bytes = 1 << 20;
+    /// \brief Guards the response queue, the set of instances being unmapped and the sessions. Changes to the client
+    /// map that add or remove an instance are made while holding it, so that the sessions stay in sync.
     mutable std::mutex response_queue_mutex_;
     /// \brief Notified when a new response is available or when the server threads need to finish execution.
     std::condition_variable cv_;
+    /// \brief How long the instances of a disconnected client wait to be reattached.
+    std::chrono::seconds grace_period_;
+    /// \brief Set when the write thread should finish once the response queue is empty.
+    bool releasing_ = false;
 
     /// \brief Maps worker instances to their corresponding sockets. Used to route responses to the correct destination.
-    std::map<int, socket> client_map_;
+    /// \details Generates the instance id of a new worker upon a create request. The conductor keeps its instance state
+    /// under the same ids.
+    ///
+    /// The write thread looks up a route for every response, while instances are only mapped and unmapped on create,
+    /// destroy, disconnect and reattach. Lookups therefore read an immutable snapshot without locking, and changes
+    /// publish a new snapshot. Detached instances keep their id, mapped to \c detached.
+    rcu<slot_map<socket>> client_map_;
     /// \brief List of all accepted client sockets.
     std::vector<socket> clients_;
     /// \brief Queue of all clients that have been accepted but not yet marked as readable by the read thread.
     std::queue<socket> new_clients_;
-    /// \brief Guards the client collections.
+    /// \brief Guards the client list and the queue of new clients.
     mutable std::mutex clients_mutex_;
 
     /// \brief Thread on which the accept loop is executed.
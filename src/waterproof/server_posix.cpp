@@ -24,81 +24,115 @@
 namespace wpwrapper {
 
 server::server(std::shared_ptr<wpwrapper::api> api_instance,
+        std::shared_ptr<wpwrapper::executor> executor_instance,
         std::vector<wpwrapper::server::failure_callback> failure_callbacks,
         std::vector<wpwrapper::server::request_callback> request_callbacks,
-        std::vector<wpwrapper::server::invalidate_callback> invalidate_callbacks)
-        :running_(false), next_id_(0), api_(std::move(api_instance)),
+        std::vector<wpwrapper::server::invalidate_callback> invalidate_callbacks,
+        std::chrono::seconds grace_period)
+        :server(std::move(api_instance), std::move(executor_instance), std::move(failure_callbacks),
+                std::move(request_callbacks), std::move(invalidate_callbacks), grace_period, std::nullopt)
+{
+}
+
+server::server(std::shared_ptr<wpwrapper::api> api_instance,
+        std::shared_ptr<wpwrapper::executor> executor_instance,
+        std::vector<wpwrapper::server::failure_callback> failure_callbacks,
+        std::vector<wpwrapper::server::request_callback> request_callbacks,
+        std::vector<wpwrapper::server::invalidate_callback> invalidate_callbacks,
+        std::chrono::seconds grace_period,
+        std::optional<wpwrapper::server::snapshot> adopted)
+        :running_(false), api_(std::move(api_instance)), executor_(std::move(executor_instance)), decoding_(0),
          on_failure_(std::move(failure_callbacks)),
          on_request_(std::move(request_callbacks)),
-         on_invalidate_(std::move(invalidate_callbacks))
+         on_invalidate_(std::move(invalidate_callbacks)), grace_period_(grace_period)
 {
     logger_ = spdlog::get("main")->clone(fmt::format("server"));
 
-    // Resolve server address.
     addrinfo hints = {};
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_protocol = IPPROTO_TCP;
-
-    addrinfo* addr;
+    int result;
+    int enable = 1;
 
-    int result = api_->getaddrinfo("localhost", nullptr, &hints, &addr);
-    if (result < 0)
+    if (adopted)
     {
-        throw api_error("unable to resolve server address", result, logger_);
+        // Clients keep connecting to the same port.
+        listen_socket_ = adopted->listen_socket_;
     }
-
-    // Create server socket.
-    listen_socket_ = api_->socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
-    if (listen_socket_ < 0)
+    else
     {
-        int err = errno;
-        api_->freeaddrinfo(addr);
-        throw api_error("unable to create server socket", err, logger_);
-    }
+        // Resolve server address.
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
 
-    // Allow server socket to reuse ports.
-    int enable = 1;
-    if (api_->setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable) < 0)
-    {
-        int err = errno;
-        api_->freeaddrinfo(addr);
-        api_->close(listen_socket_);
-        throw api_error("unable to set SO_REUSEADDR on server socket", err, logger_);
-    }
+        addrinfo* addr;
 
-    if (api_->setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable) < 0)
-    {
-        int err = errno;
-        api_->freeaddrinfo(addr);
-        api_->close(listen_socket_);
-        throw api_error("unable to set SO_REUSEPORT on server socket", err, logger_);
-    }
+        result = api_->getaddrinfo("localhost", nullptr, &hints, &addr);
+        if (result < 0)
+        {
+            throw api_error("unable to resolve server address", result, logger_);
+        }
 
-    // Close this socket handle after an exec() call. This ensures that sertop instances don't inherit it.
-    if (api_->fcntl(listen_socket_, F_SETFD, FD_CLOEXEC) < 0)
-    {
-        int err = errno;
-        api_->freeaddrinfo(addr);
-        api_->close(listen_socket_);
-        throw api_error("unable to set FD_CLOEXEC", err, logger_);
-    }
+        // Create server socket.
+        listen_socket_ = api_->socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (listen_socket_ < 0)
+        {
+            int err = errno;
+            api_->freeaddrinfo(addr);
+            throw api_error("unable to create server socket", err, logger_);
+        }
 
-    // Bind server socket to resolved address.
-    result = api_->bind(listen_socket_, addr->ai_addr, addr->ai_addrlen);
-    if (result < 0)
-    {
-        int err = errno;
+        // Allow server socket to reuse ports.
+        if (api_->setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof enable) < 0)
+        {
+            int err = errno;
+            api_->freeaddrinfo(addr);
+            api_->close(listen_socket_);
+            throw api_error("unable to set SO_REUSEADDR on server socket", err, logger_);
+        }
+
+        if (api_->setsockopt(listen_socket_, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof enable) < 0)
+        {
+            int err = errno;
+            api_->freeaddrinfo(addr);
+            api_->close(listen_socket_);
+            throw api_error("unable to set SO_REUSEPORT on server socket", err, logger_);
+        }
+
+        // Close this socket handle after an exec() call. This ensures that sertop instances don't inherit it.
+        if (api_->fcntl(listen_socket_, F_SETFD, FD_CLOEXEC) < 0)
+        {
+            int err = errno;
+            api_->freeaddrinfo(addr);
+            api_->close(listen_socket_);
+            throw api_error("unable to set FD_CLOEXEC", err, logger_);
+        }
+
+        // Bind server socket to resolved address.
+        result = api_->bind(listen_socket_, addr->ai_addr, addr->ai_addrlen);
+        if (result < 0)
+        {
+            int err = errno;
+            api_->freeaddrinfo(addr);
+            api_->close(listen_socket_);
+            throw api_error("unable to bind server socket", err, logger_);
+        }
+
+        // Don't need this anymore.
         api_->freeaddrinfo(addr);
-        api_->close(listen_socket_);
-        throw api_error("unable to bind server socket", err, logger_);
+
+        // Make socket ready for connections.
+        if (api_->listen(listen_socket_, SOMAXCONN) < 0)
+        {
+            int err = errno;
+            api_->close(listen_socket_);
+            throw api_error("unable to listen on server socket", err, logger_);
+        }
     }
 
     sockaddr_in socket_addr{};
     socklen_t socket_info_length = sizeof(socket_addr);
     if (getsockname(listen_socket_, (struct sockaddr*) &socket_addr, &socket_info_length) != 0) {
       int err = errno;
-      api_->freeaddrinfo(addr);
       api_->close(listen_socket_);
       throw api_error("unable to get socket info after binding server socket", err, logger_);
     }
@@ -106,17 +140,6 @@ server::server(std::shared_ptr<wpwrapper::api> api_instance,
     int server_port = htons(socket_addr.sin_port);
     logger_->info("got port {}", server_port);
 
-    // Don't need this anymore.
-    api_->freeaddrinfo(addr);
-
-    // Make socket ready for connections.
-    if (api_->listen(listen_socket_, SOMAXCONN) < 0)
-    {
-        int err = errno;
-        api_->close(listen_socket_);
-        throw api_error("unable to listen on server socket", err, logger_);
-    }
-
     // Create UDP sockets which will server as interrupt mechanism for blocking poll() calls.
     interrupt_[0] = api_->socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
     if (interrupt_[0] < 0)
@@ -143,7 +166,9 @@ server::server(std::shared_ptr<wpwrapper::api> api_instance,
 
     addrinfo* iaddr;
 
-    result = api_->getaddrinfo("localhost", std::to_string(server_port).c_str(), &hints, &iaddr);
+    // Any free port will do. Reusing the server port would spread the interrupts over this server and the one it took
+    // over from, as long as the latter has not closed its interrupt socket.
+    result = api_->getaddrinfo("localhost", "0", &hints, &iaddr);
     if (result < 0)
     {
         close_all(std::vector<socket>{listen_socket_, interrupt_[0], interrupt_[1]});
@@ -177,18 +202,26 @@ server::server(std::shared_ptr<wpwrapper::api> api_instance,
         throw api_error("unable to bind interrupt socket", err, logger_);
     }
 
+    api_->freeaddrinfo(iaddr);
+
+    sockaddr_in interrupt_addr{};
+    socklen_t interrupt_info_length = sizeof(interrupt_addr);
+    if (getsockname(interrupt_[0], (struct sockaddr*) &interrupt_addr, &interrupt_info_length) != 0)
+    {
+        int err = errno;
+        close_all(std::vector<socket>{listen_socket_, interrupt_[0], interrupt_[1]});
+        throw api_error("unable to get interrupt socket info after binding", err, logger_);
+    }
+
     // Connect to socket.
-    result = connect(interrupt_[1], iaddr->ai_addr, iaddr->ai_addrlen);
+    result = connect(interrupt_[1], (struct sockaddr*) &interrupt_addr, interrupt_info_length);
     if (result != 0)
     {
         int err = errno;
-        api_->freeaddrinfo(iaddr);
         close_all(std::vector<socket>{listen_socket_, interrupt_[0], interrupt_[1]});
         throw api_error("unable to connect interrupt socket", err, logger_);
     }
 
-    api_->freeaddrinfo(iaddr);
-
     // Close the interrupt handle after an exec() call. This ensures that sertop instances don't inherit it.
     if (api_->fcntl(interrupt_[0], F_SETFD, FD_CLOEXEC) < 0)
     {
@@ -205,9 +238,61 @@ server::server(std::shared_ptr<wpwrapper::api> api_instance,
         throw api_error("unable to set FD_CLOEXEC on write end of interrupt pipe", err, logger_);
     }
 
+    if (adopted)
+    {
+        // Restore the routes under the same instance ids, so that clients can keep using them.
+        client_map_.update([&](slot_map<socket>& map)
+        {
+            for (const auto& i: adopted->instances_)
+            {
+                map.assign(i.id_, i.socket_);
+            }
+        });
+
+        auto now = std::chrono::steady_clock::now();
+        for (auto& i: adopted->instances_)
+        {
+            session& s = sessions_[i.id_];
+            s.token_ = std::move(i.token_);
+            s.next_sequence_ = i.next_sequence_;
+            for (auto& f: i.history_)
+            {
+                remember(s, std::move(f));
+            }
+
+            if (i.grace_left_)
+            {
+                s.expiry_ = now + *i.grace_left_;
+                expiries_.emplace(*s.expiry_, i.id_);
+            }
+        }
+
+        // The read thread picks the clients up as soon as it starts.
+        try
+        {
+            for (auto client: adopted->clients_)
+            {
+                announce(client);
+            }
+        }
+        catch (const api_error& e)
+        {
+            std::vector<socket> remaining_sockets{listen_socket_, interrupt_[0], interrupt_[1]};
+            remaining_sockets.insert(remaining_sockets.end(), clients_.begin(), clients_.end());
+            close_all(remaining_sockets);
+            throw;
+        }
+
+        logger_->info("took over {} clients and {} instances on port {}", adopted->clients_.size(),
+                adopted->instances_.size(), server_port);
+    }
+    else
+    {
+        // NOTE: Do not change this message, waterproof relies on the wording and extracts port from here.
+        logger_->info("started listening on port {}", server_port);
+    }
+
     // Start the worker threads.
-    // NOTE: Do not change this message, waterproof relies on the wording and extracts port from here.
-    logger_->info("started listening on port {}", server_port);
     running_ = true;
     accept_thread_ = std::thread(&server::accept_loop, this);
     read_thread_ = std::thread(&server::read_loop, this);
@@ -225,8 +310,8 @@ server::~server() noexcept
         }
         cv_.notify_one();
 
-        // Close write end of interrupt pipe. This will cause the accept and read threads to finish execution.
-        api_->close(interrupt_[1]);
+        // This will cause the accept and read threads to finish execution.
+        interrupt();
     }
 
     // Wait until server threads have finished execution.
@@ -245,13 +330,79 @@ server::~server() noexcept
         write_thread_.join();
     }
 
+    // Decoders may still invalidate sockets.
+    wait_for_decoders();
+
     // Cleanup.
-    std::vector<socket> remaining_sockets{listen_socket_, interrupt_[0]};
+    std::vector<socket> remaining_sockets{listen_socket_, interrupt_[0], interrupt_[1]};
     remaining_sockets.insert(remaining_sockets.end(), clients_.begin(), clients_.end());
 
     close_all(remaining_sockets);
 }
 
+void server::pause()
+{
+    // Wakes the accept and read threads, which then finish. The write thread keeps running.
+    interrupt();
+
+    if (accept_thread_.joinable())
+    {
+        accept_thread_.join();
+    }
+
+    if (read_thread_.joinable())
+    {
+        read_thread_.join();
+    }
+
+    // Requests that were read already are parsed and handed to the request callbacks.
+    wait_for_decoders();
+}
+
+wpwrapper::server::snapshot server::release()
+{
+    {
+        std::lock_guard<std::mutex> guard(response_queue_mutex_);
+        releasing_ = true;
+    }
+    cv_.notify_one();
+
+    if (write_thread_.joinable())
+    {
+        write_thread_.join();
+    }
+    running_ = false;
+
+    snapshot state;
+    state.listen_socket_ = listen_socket_;
+
+    {
+        std::lock_guard<std::mutex> guard(clients_mutex_);
+        state.clients_ = clients_;
+    }
+
+    std::lock_guard<std::mutex> guard(response_queue_mutex_);
+    auto now = std::chrono::steady_clock::now();
+
+    for (const auto& [id, s]: sessions_)
+    {
+        snapshot::instance i{id, route(id).value_or(detached), s.token_, s.next_sequence_,
+                std::vector<frame>(s.history_.begin(), s.history_.end()), std::nullopt};
+
+        if (s.expiry_)
+        {
+            i.grace_left_ = std::max(std::chrono::milliseconds::zero(),
+                    std::chrono::duration_cast<std::chrono::milliseconds>(*s.expiry_ - now));
+        }
+
+        state.instances_.push_back(std::move(i));
+    }
+
+    logger_->debug("released {} clients and {} instances", state.clients_.size(), state.instances_.size());
+
+    return state;
+}
+
 void server::close_all(const std::vector<wpwrapper::server::socket>& fds)
 {
     for (const auto& fd: fds)
@@ -260,6 +411,18 @@ void server::close_all(const std::vector<wpwrapper::server::socket>& fds)
     }
 }
 
+void server::interrupt() noexcept
+{
+    // Closing either end of the interrupt socket does not wake up a poll() on the read end, but shutting it down does,
+    // even though the socket is not connected.
+    api_->shutdown(interrupt_[0], SHUT_RDWR);
+}
+
+bool server::disinherit(wpwrapper::server::socket client) const noexcept
+{
+    return api_->fcntl(client, F_SETFD, FD_CLOEXEC) == 0;
+}
+
 int server::last_error() const noexcept
 {
     return errno;
@@ -20,13 +20,15 @@
 namespace wpwrapper {
 
 server::server(std::shared_ptr<wpwrapper::api> api_instance,
+        std::shared_ptr<wpwrapper::executor> executor_instance,
         std::vector<wpwrapper::server::failure_callback> failure_callbacks,
         std::vector<wpwrapper::server::request_callback> request_callbacks,
-        std::vector<wpwrapper::server::invalidate_callback> invalidate_callbacks)
-        :running_(false), next_id_(0), api_(std::move(api_instance)),
+        std::vector<wpwrapper::server::invalidate_callback> invalidate_callbacks,
+        std::chrono::seconds grace_period)
+        :running_(false), api_(std::move(api_instance)), executor_(std::move(executor_instance)), decoding_(0),
          on_failure_(std::move(failure_callbacks)),
          on_request_(std::move(request_callbacks)),
-         on_invalidate_(std::move(invalidate_callbacks))
+         on_invalidate_(std::move(invalidate_callbacks)), grace_period_(grace_period)
 {
     logger_ = spdlog::get("main")->clone(fmt::format("server"));
 
@@ -181,8 +183,8 @@ server::~server() noexcept
         }
         cv_.notify_one();
 
-        // Close write end of interrupt pipe. This will cause the accept and read threads to finish execution.
-        api_->closesocket(interrupt_[1]);
+        // This will cause the accept and read threads to finish execution.
+        interrupt();
     }
 
     // Wait until server threads have finished execution.
@@ -201,8 +203,12 @@ server::~server() noexcept
         write_thread_.join();
     }
 
+    // Decoders may still invalidate sockets.
+    wait_for_decoders();
+
     // Cleanup.
-    std::vector<socket> remaining_sockets{listen_socket_, interrupt_[0]};
+    // The read end of the interrupt socket has already been closed by interrupt().
+    std::vector<socket> remaining_sockets{listen_socket_, interrupt_[1]};
     remaining_sockets.insert(remaining_sockets.end(), clients_.begin(), clients_.end());
 
     close_all(remaining_sockets);
@@ -217,6 +223,17 @@ void server::close_all(const std::vector<wpwrapper::server::socket>& fds)
     }
 }
 
+void server::interrupt() noexcept
+{
+    // Closing a socket cancels blocking calls on it in other threads, including WSAPoll().
+    api_->closesocket(interrupt_[0]);
+}
+
+bool server::disinherit(wpwrapper::server::socket client) const noexcept
+{
+    return api_->SetHandleInformation(reinterpret_cast<HANDLE>(client), HANDLE_FLAG_INHERIT, 0) != 0;
+}
+
 int server::last_error() const noexcept
 {
     return api_->WSAGetLastError();
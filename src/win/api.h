@@ -103,6 +103,15 @@ public:
     /// \see https://docs.microsoft.com/en-us/windows/desktop/api/synchapi/nf-synchapi-setevent
     virtual BOOL SetEvent(HANDLE hEvent) const noexcept = 0;
 
+    /// \see https://docs.microsoft.com/en-us/windows/desktop/api/handleapi/nf-handleapi-sethandleinformation
+    virtual BOOL SetHandleInformation(HANDLE hObject, DWORD dwMask, DWORD dwFlags) const noexcept = 0;
+
+    /// \see https://docs.microsoft.com/en-us/windows/desktop/api/processthreadsapi/nf-processthreadsapi-setpriorityclass
+    virtual BOOL SetPriorityClass(HANDLE hProcess, DWORD dwPriorityClass) const noexcept = 0;
+
+    /// \see https://docs.microsoft.com/en-us/windows/desktop/api/winsock/nf-winsock-setsockopt
+    virtual int setsockopt(SOCKET s, int level, int optname, const char* optval, int optlen) const noexcept = 0;
+
     /// \see https://docs.microsoft.com/en-us/windows/desktop/api/winsock2/nf-winsock2-shutdown
     virtual int shutdown(SOCKET s, int how) const noexcept = 0;
 
@@ -133,6 +133,21 @@ BOOL api_wrapper::SetEvent(HANDLE hEvent) const noexcept
     return ::SetEvent(hEvent);
 }
 
+BOOL api_wrapper::SetHandleInformation(HANDLE hObject, DWORD dwMask, DWORD dwFlags) const noexcept
+{
+    return ::SetHandleInformation(hObject, dwMask, dwFlags);
+}
+
+BOOL api_wrapper::SetPriorityClass(HANDLE hProcess, DWORD dwPriorityClass) const noexcept
+{
+    return ::SetPriorityClass(hProcess, dwPriorityClass);
+}
+
+int api_wrapper::setsockopt(SOCKET s, int level, int optname, const char* optval, int optlen) const noexcept
+{
+    return ::setsockopt(s, level, optname, optval, optlen);
+}
+
 int api_wrapper::shutdown(SOCKET s, int how) const noexcept
 {
     return ::shutdown(s, how);
@@ -77,6 +77,12 @@ public:
 
     BOOL SetEvent(HANDLE hEvent) const noexcept override;
 
+    BOOL SetHandleInformation(HANDLE hObject, DWORD dwMask, DWORD dwFlags) const noexcept override;
+
+    BOOL SetPriorityClass(HANDLE hProcess, DWORD dwPriorityClass) const noexcept override;
+
+    int setsockopt(SOCKET s, int level, int optname, const char* optval, int optlen) const noexcept override;
+
     int shutdown(SOCKET s, int how) const noexcept override;
 
     SOCKET socket(int af, int type, int protocol) const noexcept override;